@@ -0,0 +1,706 @@
+#define PLUSH_IMPLEMENTATION
+#include "plush.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define PLUSH_BENCH_SORT_MIN_FACES 16
+#define PLUSH_BENCH_SORT_MAX_FACES (1 << 20)
+#define PLUSH_BENCH_MIN_TIME_NS 20000000.0
+#define PLUSH_BENCH_RENDER_FRAMES 16
+#define PLUSH_BENCH_RENDER_DISTANCE 5.0f
+#define PLUSH_BENCH_COVERAGE_WIDTH 203
+#define PLUSH_BENCH_COVERAGE_HEIGHT 157
+#define PLUSH_BENCH_COVERAGE_CELLS 13
+#define PLUSH_BENCH_COVERAGE_BORDER 10
+#define PLUSH_BENCH_COVERAGE_TRIALS 16
+
+typedef struct
+{
+	const char *name;
+	pl_uChar shade;
+	pl_Bool texture;
+	pl_Bool environment;
+	pl_uChar perspective;
+	pl_uChar transparent;
+	pl_Bool halfspace;
+	pl_Bool visbuffer;
+	pl_Bool prepass;
+	pl_Bool truecolor;
+} plush_bench_mode_t;
+
+typedef struct
+{
+	const char *name;
+	pl_Obj *obj;
+	pl_uInt32 triangles;
+} plush_bench_scene_t;
+
+/* One material per plPF_* filler, see _plSetMaterialPutFace(), the solid
+   ones again with pl_Cam.HalfSpace, the Gouraud textured ones again with
+   pl_Cam.VisBuffer and pl_Cam.DepthPrepass, and the Gouraud ones again to
+   pl_Cam.frameBuffer32 */
+static const plush_bench_mode_t plush_bench_modes[] =
+{
+	{ "SolidF", PL_SHADE_FLAT, 0, 0, 0, 0, 0, 0, 0, 0 },
+	{ "SolidG", PL_SHADE_GOURAUD, 0, 0, 0, 0, 0, 0, 0, 0 },
+	{ "TexF", PL_SHADE_FLAT, 1, 0, 0, 0, 0, 0, 0, 0 },
+	{ "TexG", PL_SHADE_GOURAUD, 1, 0, 0, 0, 0, 0, 0, 0 },
+	{ "TexEnv", PL_SHADE_NONE, 1, 1, 0, 0, 0, 0, 0, 0 },
+	{ "PTexF", PL_SHADE_FLAT, 1, 0, 16, 0, 0, 0, 0, 0 },
+	{ "PTexG", PL_SHADE_GOURAUD, 1, 0, 16, 0, 0, 0, 0, 0 },
+	{ "TransF", PL_SHADE_FLAT, 0, 0, 0, 2, 0, 0, 0, 0 },
+	{ "TransG", PL_SHADE_GOURAUD, 0, 0, 0, 2, 0, 0, 0, 0 },
+	{ "SolidF_HalfSpace", PL_SHADE_FLAT, 0, 0, 0, 0, 1, 0, 0, 0 },
+	{ "SolidG_HalfSpace", PL_SHADE_GOURAUD, 0, 0, 0, 0, 1, 0, 0, 0 },
+	{ "TexG_VisBuffer", PL_SHADE_GOURAUD, 1, 0, 0, 0, 0, 1, 0, 0 },
+	{ "TexEnv_VisBuffer", PL_SHADE_NONE, 1, 1, 0, 0, 0, 1, 0, 0 },
+	{ "PTexG_VisBuffer", PL_SHADE_GOURAUD, 1, 0, 16, 0, 0, 1, 0, 0 },
+	{ "TexG_DepthPrepass", PL_SHADE_GOURAUD, 1, 0, 0, 0, 0, 0, 1, 0 },
+	{ "TexEnv_DepthPrepass", PL_SHADE_NONE, 1, 1, 0, 0, 0, 0, 1, 0 },
+	{ "PTexG_DepthPrepass", PL_SHADE_GOURAUD, 1, 0, 16, 0, 0, 0, 1, 0 },
+	{ "SolidG_TrueColor", PL_SHADE_GOURAUD, 0, 0, 0, 0, 0, 0, 0, 1 },
+	{ "TexG_TrueColor", PL_SHADE_GOURAUD, 1, 0, 0, 0, 0, 0, 0, 1 },
+	{ "PTexG_TrueColor", PL_SHADE_GOURAUD, 1, 0, 16, 0, 0, 0, 0, 1 },
+	{ "TransG_TrueColor", PL_SHADE_GOURAUD, 0, 0, 0, 2, 0, 0, 0, 1 }
+};
+
+static const pl_uInt plush_bench_resolutions[][2] =
+{
+	{ 320, 240 },
+	{ 640, 480 },
+	{ 1280, 720 }
+};
+
+static const char *plush_bench_stages[PL_NUM_STAGES] =
+{
+	"transform", "light", "sort", "clip", "raster"
+};
+
+#define PLUSH_BENCH_COUNT(a) (sizeof(a) / sizeof((a)[0]))
+
+static double plush_bench_now_ns(void);
+static void plush_bench_sort(void);
+static void plush_bench_render(void);
+static void plush_bench_convert(void);
+static unsigned long plush_bench_coverage(void);
+
+int main(int argc, char **argv)
+{
+	const char *what = argc > 1 ? argv[1] : "all";
+	int all = !strcmp(what, "all");
+	unsigned long bad = 0;
+
+	if(!all && strcmp(what, "sort") && strcmp(what, "render") && strcmp(what, "convert") && strcmp(what, "coverage"))
+	{
+		fprintf(stderr, "usage: %s [all|sort|render|convert|coverage]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	printf("{\n");
+	if(all || !strcmp(what, "sort"))
+		plush_bench_sort();
+	if(all)
+		printf(",\n");
+	if(all || !strcmp(what, "render"))
+		plush_bench_render();
+	if(all)
+		printf(",\n");
+	if(all || !strcmp(what, "convert"))
+		plush_bench_convert();
+	if(all)
+		printf(",\n");
+	if(all || !strcmp(what, "coverage"))
+		bad = plush_bench_coverage();
+	printf("\n}\n");
+	return bad ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static double plush_bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+** Times the heap sort and the radix sort used by plRenderEnd() on the same
+** random depths, both directions, and reports where the radix sort starts to
+** win. Use it to tune PL_RADIX_SORT_MIN.
+*/
+static void plush_bench_sort(void)
+{
+	_faceInfo *faces, *input, *scratch;
+	pl_uInt32 n, i, crossover = 0;
+	double t, heap_ns, radix_ns;
+	int runs, r;
+
+	input = malloc(PLUSH_BENCH_SORT_MAX_FACES * sizeof(_faceInfo));
+	faces = malloc(PLUSH_BENCH_SORT_MAX_FACES * sizeof(_faceInfo));
+	scratch = malloc(PLUSH_BENCH_SORT_MAX_FACES * sizeof(_faceInfo));
+	if(input == NULL || faces == NULL || scratch == NULL)
+	{
+		fprintf(stderr, "error: out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	srand(1);
+	for(i = 0; i < PLUSH_BENCH_SORT_MAX_FACES; i++)
+	{
+		/* Sum of three camera space depths, like _RenderObj() computes */
+		input[i].zd = 3.0f + 30.0f * rand() / (float) RAND_MAX;
+		input[i].face = NULL;
+	}
+
+	printf("  \"sort\": {\n    \"radix_sort_min\": %d,\n    \"results\": [\n", PL_RADIX_SORT_MIN);
+	for(n = PLUSH_BENCH_SORT_MIN_FACES; n <= PLUSH_BENCH_SORT_MAX_FACES; n *= 2)
+	{
+		runs = 0;
+		t = plush_bench_now_ns();
+		do
+		{
+			memcpy(faces, input, n * sizeof(_faceInfo));
+			_hsort(faces, n, runs & 1);
+			runs++;
+		} while(plush_bench_now_ns() - t < PLUSH_BENCH_MIN_TIME_NS);
+		heap_ns = (plush_bench_now_ns() - t) / runs;
+
+		t = plush_bench_now_ns();
+		for(r = 0; r < runs; r++)
+		{
+			memcpy(faces, input, n * sizeof(_faceInfo));
+			_plRadixSort(faces, scratch, n, r & 1);
+		}
+		radix_ns = (plush_bench_now_ns() - t) / runs;
+
+		if(radix_ns < heap_ns && !crossover)
+			crossover = n;
+		else if(radix_ns >= heap_ns)
+			crossover = 0;
+
+		printf("      { \"faces\": %lu, \"heap_ns_per_face\": %.2f, \"radix_ns_per_face\": %.2f }%s\n",
+			(unsigned long) n, heap_ns / n, radix_ns / n, n < PLUSH_BENCH_SORT_MAX_FACES ? "," : "");
+	}
+	printf("    ],\n    \"crossover_faces\": %lu\n  }", (unsigned long) crossover);
+
+	free(scratch);
+	free(faces);
+	free(input);
+}
+
+static pl_uInt32 plush_bench_count_faces(pl_Obj *obj)
+{
+	pl_uInt32 n = obj->NumFaces;
+	int i;
+
+	for(i = 0; i < PL_MAX_CHILDREN; i++)
+		if(obj->Children[i] != NULL)
+			n += plush_bench_count_faces(obj->Children[i]);
+	return n;
+}
+
+static pl_Obj *plush_bench_fit(pl_Obj *obj, pl_Float radius, pl_Float x, pl_Float y)
+{
+	if(obj == NULL)
+	{
+		fprintf(stderr, "error: out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	plObjCalcBounds(obj);
+	plObjTranslate(obj, -obj->BoundCenter[0], -obj->BoundCenter[1], -obj->BoundCenter[2]);
+	plObjScale(obj, radius / obj->BoundRadius);
+	obj->Xp = x;
+	obj->Yp = y;
+	return obj;
+}
+
+/*
+** Six primitives on a 3x2 grid, each cut into div segments around.
+*/
+static pl_Obj *plush_bench_primitives(pl_uInt div)
+{
+	pl_Obj *root = plObjCreate(0, 0);
+
+	if(root == NULL)
+	{
+		fprintf(stderr, "error: out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	root->Children[0] = plush_bench_fit(plMakeSphere(1.0f, div, div / 2, NULL), 0.6f, -1.4f, 0.7f);
+	root->Children[1] = plush_bench_fit(plMakeTorus(0.7f, 0.3f, div, div / 2, NULL), 0.6f, 0.0f, 0.7f);
+	root->Children[2] = plush_bench_fit(plMakeCone(1.0f, 2.0f, div, 1, NULL), 0.6f, 1.4f, 0.7f);
+	root->Children[3] = plush_bench_fit(plMakeCylinder(1.0f, 2.0f, div, 1, 1, NULL), 0.6f, -1.4f, -0.7f);
+	root->Children[4] = plush_bench_fit(plMakeBox(1.0f, 1.0f, 1.0f, NULL), 0.6f, 0.0f, -0.7f);
+	root->Children[5] = plush_bench_fit(plMakePlane(1.0f, 1.0f, div / 4, NULL), 0.6f, 1.4f, -0.7f);
+	return root;
+}
+
+/*
+** Makes a material for each of plush_bench_modes, with texture for the
+** textured ones, and a palette for all of them.
+*/
+static void plush_bench_materials(pl_Mat **materials, pl_Texture *texture, pl_uChar *palette)
+{
+	size_t m;
+
+	for(m = 0; m < PLUSH_BENCH_COUNT(plush_bench_modes); m++)
+	{
+		materials[m] = plMatCreate();
+		if(materials[m] == NULL)
+		{
+			fprintf(stderr, "error: out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+		materials[m]->NumGradients = 64;
+		materials[m]->ShadeType = plush_bench_modes[m].shade;
+		materials[m]->Texture = plush_bench_modes[m].texture ? texture : NULL;
+		materials[m]->Environment = plush_bench_modes[m].environment ? texture : NULL;
+		materials[m]->PerspectiveCorrect = plush_bench_modes[m].perspective;
+		materials[m]->Transparent = plush_bench_modes[m].transparent;
+		plMatInit(materials[m]);
+	}
+	plMatMakeOptPal(palette, 0, 255, materials, PLUSH_BENCH_COUNT(plush_bench_modes));
+	for(m = 0; m < PLUSH_BENCH_COUNT(plush_bench_modes); m++)
+		plMatMapToPal(materials[m], palette, 0, 255);
+}
+
+static void plush_bench_delete_materials(pl_Mat **materials, pl_Texture *texture)
+{
+	size_t m;
+
+	for(m = 0; m < PLUSH_BENCH_COUNT(plush_bench_modes); m++)
+	{
+		materials[m]->Texture = NULL;
+		materials[m]->Environment = NULL;
+		plMatDelete(materials[m]);
+	}
+	plTexDelete(texture);
+}
+
+/*
+** Renders every scene at every resolution with every filler, orbiting the
+** camera around the scene along the same path each time. Frame times are
+** taken with the stage timers off, then the frames are run again with them
+** on to split the time between the stages of the pipeline.
+*/
+static void plush_bench_render(void)
+{
+	plush_bench_scene_t scenes[3];
+	pl_Mat *materials[PLUSH_BENCH_COUNT(plush_bench_modes)];
+	pl_RenderStats *stats = plRenderContextStats(NULL);
+	double stage_ns[PL_NUM_STAGES], pixels, z_fails, shades_saved;
+	pl_uChar palette[768];
+	pl_Texture *texture;
+	pl_Light *light;
+	pl_Cam *camera;
+	pl_uChar *frame;
+	pl_ARGB *frame32;
+	pl_ZBuffer *zbuffer;
+	pl_uInt w, h;
+	size_t s, r, m;
+	int frames, f, i, first = 1;
+	double t, frame_ns, clear_ns, pass_ns;
+
+	texture = plReadPCXTex("data/texture.pcx", 1, 1);
+	scenes[0].name = "suzanne";
+	scenes[0].obj = plRead3DSObj("data/suzanne.3ds", NULL);
+	if(texture == NULL || scenes[0].obj == NULL)
+	{
+		fprintf(stderr, "error: failed to read data/, run from the top of the tree\n");
+		exit(EXIT_FAILURE);
+	}
+	plush_bench_fit(scenes[0].obj, 1.5f, 0.0f, 0.0f);
+	scenes[1].name = "primitives_low";
+	scenes[1].obj = plush_bench_primitives(8);
+	scenes[2].name = "primitives_high";
+	scenes[2].obj = plush_bench_primitives(96);
+	for(s = 0; s < PLUSH_BENCH_COUNT(scenes); s++)
+		scenes[s].triangles = plush_bench_count_faces(scenes[s].obj);
+
+	plush_bench_materials(materials, texture, palette);
+
+	light = plLightCreate();
+	plLightSet(light, PL_LIGHT_VECTOR, 30.0f, 45.0f, 0.0f, 1.0f, 1.0f);
+
+	printf("  \"render\": {\n    \"frames\": %d,\n    \"zbuffer_bits\": %d,\n    \"results\": [\n",
+		PLUSH_BENCH_RENDER_FRAMES, PL_ZBUFFER_BITS);
+	for(r = 0; r < PLUSH_BENCH_COUNT(plush_bench_resolutions); r++)
+	{
+		w = plush_bench_resolutions[r][0];
+		h = plush_bench_resolutions[r][1];
+		frame = malloc(w * h);
+		frame32 = malloc(w * h * sizeof(pl_ARGB));
+		zbuffer = malloc(w * h * sizeof(pl_ZBuffer));
+		camera = plCamCreate(w, h, w * 3.0f / (h * 4.0f), 90.0f, frame, zbuffer);
+		if(frame == NULL || frame32 == NULL || zbuffer == NULL || camera == NULL)
+		{
+			fprintf(stderr, "error: out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+		camera->Sort = 0;
+
+		for(s = 0; s < PLUSH_BENCH_COUNT(scenes); s++)
+		{
+			for(m = 0; m < PLUSH_BENCH_COUNT(plush_bench_modes); m++)
+			{
+				plObjSetMat(scenes[s].obj, materials[m], 1);
+				camera->HalfSpace = plush_bench_modes[m].halfspace;
+				camera->VisBuffer = plush_bench_modes[m].visbuffer;
+				camera->DepthPrepass = plush_bench_modes[m].prepass;
+				camera->frameBuffer32 = plush_bench_modes[m].truecolor ? frame32 : NULL;
+
+				/* Whole camera paths until the minimum time, untimed stages */
+				stats->Timers = 0;
+				frames = 0;
+				pass_ns = plush_bench_now_ns();
+				frame_ns = clear_ns = 0.0;
+				do
+				{
+					for(f = 0; f < PLUSH_BENCH_RENDER_FRAMES; f++, frames++)
+					{
+						pl_Float a = f * 360.0f / PLUSH_BENCH_RENDER_FRAMES;
+
+						t = plush_bench_now_ns();
+						plCamClear(camera, 0, 0);
+						clear_ns += plush_bench_now_ns() - t;
+						camera->X = PLUSH_BENCH_RENDER_DISTANCE * sin(a * PL_PI / 180.0);
+						camera->Y = 1.0f + sin(a * 2.0 * PL_PI / 180.0);
+						camera->Z = -PLUSH_BENCH_RENDER_DISTANCE * cos(a * PL_PI / 180.0);
+						plCamSetTarget(camera, 0.0f, 0.0f, 0.0f);
+
+						t = plush_bench_now_ns();
+						plRenderBegin(camera);
+						plRenderLight(light);
+						plRenderObj(scenes[s].obj);
+						plRenderEnd();
+						frame_ns += plush_bench_now_ns() - t;
+					}
+				} while(plush_bench_now_ns() - pass_ns < PLUSH_BENCH_MIN_TIME_NS);
+				frame_ns /= frames;
+				clear_ns /= frames;
+
+				/* The same frames again with the stage timers on */
+				stats->Timers = 1;
+				memset(stage_ns, 0, sizeof(stage_ns));
+				pixels = z_fails = shades_saved = 0.0;
+				for(f = 0; f < frames; f++)
+				{
+					pl_Float a = (f % PLUSH_BENCH_RENDER_FRAMES) * 360.0f / PLUSH_BENCH_RENDER_FRAMES;
+
+					plCamClear(camera, 0, 0);
+					camera->X = PLUSH_BENCH_RENDER_DISTANCE * sin(a * PL_PI / 180.0);
+					camera->Y = 1.0f + sin(a * 2.0 * PL_PI / 180.0);
+					camera->Z = -PLUSH_BENCH_RENDER_DISTANCE * cos(a * PL_PI / 180.0);
+					plCamSetTarget(camera, 0.0f, 0.0f, 0.0f);
+
+					plRenderBegin(camera);
+					plRenderLight(light);
+					plRenderObj(scenes[s].obj);
+					plRenderEnd();
+					for(i = 0; i < PL_NUM_STAGES; i++)
+						stage_ns[i] += stats->StageTime[i] * 1e9;
+					pixels += stats->PixelsWritten;
+					z_fails += stats->ZFails;
+					shades_saved += stats->ShadesSaved;
+				}
+
+				printf("%s      { \"scene\": \"%s\", \"width\": %u, \"height\": %u, \"triangles\": %lu, \"mode\": \"%s\",\n",
+					first ? "" : ",\n", scenes[s].name, w, h, (unsigned long) scenes[s].triangles,
+					plush_bench_modes[m].name);
+				printf("        \"frame_ns\": %.0f, \"ns_per_triangle\": %.2f, \"ns_per_pixel\": %.3f, \"clear_ns\": %.0f,\n",
+					frame_ns, frame_ns / scenes[s].triangles, frame_ns / (w * h), clear_ns);
+				printf("        \"pixels_written\": %.0f, \"z_fails\": %.0f, \"shades_saved\": %.0f,\n        \"stage_ns\": {",
+					pixels / frames, z_fails / frames, shades_saved / frames);
+				for(i = 0; i < PL_NUM_STAGES; i++)
+					printf(" \"%s\": %.0f%s", plush_bench_stages[i], stage_ns[i] / frames, i < PL_NUM_STAGES - 1 ? "," : " }");
+				printf(" }");
+				first = 0;
+			}
+		}
+
+		plCamDelete(camera);
+		free(zbuffer);
+		free(frame32);
+		free(frame);
+	}
+	printf("\n    ]\n  }");
+
+	stats->Timers = 0;
+	plLightDelete(light);
+	for(s = 0; s < PLUSH_BENCH_COUNT(scenes); s++)
+		plObjDelete(scenes[s].obj);
+	plush_bench_delete_materials(materials, texture);
+}
+
+/*
+** Times plFramebufferToARGBCtx() at every resolution, at its own size and
+** scaled up twice, on one thread and on four if built with PL_THREADS,
+** against a plain loop looking up each pixel in the palette.
+*/
+static void plush_bench_convert(void)
+{
+	static const pl_uInt threads[] = { 1, 4 };
+	pl_RenderContext *ctx = plRenderContextCreate();
+	pl_uChar palette[768];
+	pl_ARGB table[256];
+	pl_Cam *camera;
+	pl_uChar *frame;
+	pl_ARGB *out;
+	pl_uInt w, h, scale, used, x, y, k;
+	size_t r, p, i;
+	int runs, first = 1;
+	double t, convert_ns, reference_ns, pixels;
+
+	if(ctx == NULL)
+	{
+		fprintf(stderr, "error: out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	srand(1);
+	for(i = 0; i < sizeof(palette); i++)
+		palette[i] = rand();
+	for(i = 0; i < 256; i++)
+		table[i] = 0xFF000000 | palette[i * 3] << 16 | palette[i * 3 + 1] << 8 | palette[i * 3 + 2];
+
+	printf("  \"convert\": {\n    \"results\": [\n");
+	for(r = 0; r < PLUSH_BENCH_COUNT(plush_bench_resolutions); r++)
+	{
+		w = plush_bench_resolutions[r][0];
+		h = plush_bench_resolutions[r][1];
+		frame = malloc(w * h);
+		out = malloc(w * h * 4 * sizeof(pl_ARGB));
+		camera = plCamCreate(w, h, w * 3.0f / (h * 4.0f), 90.0f, frame, NULL);
+		if(frame == NULL || out == NULL || camera == NULL)
+		{
+			fprintf(stderr, "error: out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+		for(i = 0; i < w * h; i++)
+			frame[i] = rand();
+
+		for(scale = 1; scale <= 2; scale++)
+		{
+			pixels = (double) w * h * scale * scale;
+
+			t = plush_bench_now_ns();
+			runs = 0;
+			do
+			{
+				for(y = 0; y < h * scale; y++)
+					for(x = 0; x < w; x++)
+						for(k = 0; k < scale; k++)
+							out[(y * w + x) * scale + k] = table[frame[(y / scale) * w + x]];
+				runs++;
+			} while(plush_bench_now_ns() - t < PLUSH_BENCH_MIN_TIME_NS);
+			reference_ns = (plush_bench_now_ns() - t) / runs;
+
+			for(p = 0; p < PLUSH_BENCH_COUNT(threads); p++)
+			{
+				used = plRenderContextSetThreads(ctx, threads[p]);
+				if(p > 0 && used == 1)
+					break;
+
+				t = plush_bench_now_ns();
+				runs = 0;
+				do
+				{
+					plFramebufferToARGBCtx(ctx, camera, palette, out, 0, scale);
+					runs++;
+				} while(plush_bench_now_ns() - t < PLUSH_BENCH_MIN_TIME_NS);
+				convert_ns = (plush_bench_now_ns() - t) / runs;
+
+				printf("%s      { \"width\": %u, \"height\": %u, \"scale\": %u, \"threads\": %u,\n",
+					first ? "" : ",\n", w, h, scale, used);
+				printf("        \"frame_ns\": %.0f, \"ns_per_pixel\": %.3f, \"reference_ns_per_pixel\": %.3f }",
+					convert_ns, convert_ns / pixels, reference_ns / pixels);
+				first = 0;
+			}
+		}
+
+		plCamDelete(camera);
+		free(out);
+		free(frame);
+	}
+	printf("\n    ]\n  }");
+	plRenderContextDelete(ctx);
+}
+
+/*
+** Fills a grid of triangles, its inner vertices jittered, or snapped to half
+** and whole pixels, with every filler, with and without pl_Cam.HalfSpace and
+** with and without ClipTop and ClipBottom, and checks that the z-buffer
+** is written exactly once at every pixel inside the grid and the clipping,
+** and nowhere else. Each triangle is drawn to a cleared z-buffer and the
+** pixels it wrote are counted and cleared again. Returns the number of
+** pixels that were wrong.
+*/
+static unsigned long plush_bench_coverage(void)
+{
+	const pl_uInt w = PLUSH_BENCH_COVERAGE_WIDTH, h = PLUSH_BENCH_COVERAGE_HEIGHT;
+	const pl_uInt n = PLUSH_BENCH_COVERAGE_CELLS, border = PLUSH_BENCH_COVERAGE_BORDER;
+	pl_Mat *materials[PLUSH_BENCH_COUNT(plush_bench_modes)];
+	pl_sInt32 gx[PLUSH_BENCH_COVERAGE_CELLS + 1][PLUSH_BENCH_COVERAGE_CELLS + 1];
+	pl_sInt32 gy[PLUSH_BENCH_COVERAGE_CELLS + 1][PLUSH_BENCH_COVERAGE_CELLS + 1];
+	static const int corners[4][3][2] =
+	{
+		{ { 0, 0 }, { 1, 0 }, { 1, 1 } }, { { 0, 0 }, { 1, 1 }, { 0, 1 } },
+		{ { 0, 0 }, { 1, 0 }, { 0, 1 } }, { { 1, 0 }, { 1, 1 }, { 0, 1 } }
+	};
+	pl_uChar palette[768];
+	pl_Texture *texture;
+	pl_Cam *camera;
+	pl_uChar *frame, *hits;
+	pl_ARGB *frame32;
+	pl_ZBuffer *zbuffer;
+	pl_Face face;
+	pl_sInt x0, x1, y0, y1, x, y;
+	pl_uInt i, j, k, t, trial, halfspace, clipped, inside;
+	size_t m;
+	unsigned long pixels, wrong, bad = 0, triangles = 0;
+	double fx, fy;
+	int first = 1;
+
+	texture = plReadPCXTex("data/texture.pcx", 1, 1);
+	if(texture == NULL)
+	{
+		fprintf(stderr, "error: failed to read data/, run from the top of the tree\n");
+		exit(EXIT_FAILURE);
+	}
+	plush_bench_materials(materials, texture, palette);
+	frame = malloc(w * h);
+	frame32 = malloc(w * h * sizeof(pl_ARGB));
+	zbuffer = calloc(w * h, sizeof(pl_ZBuffer));
+	hits = malloc(w * h);
+	camera = plCamCreate(w, h, 1.0f, 90.0f, frame, zbuffer);
+	if(frame == NULL || frame32 == NULL || zbuffer == NULL || hits == NULL || camera == NULL)
+	{
+		fprintf(stderr, "error: out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	printf("  \"coverage\": {\n    \"results\": [\n");
+	for(m = 0; m < PLUSH_BENCH_COUNT(plush_bench_modes); m++)
+	{
+		/* The other modes use the same fillers as these, their camera
+		   flags only matter to plRender*() */
+		if(plush_bench_modes[m].halfspace || plush_bench_modes[m].visbuffer || plush_bench_modes[m].prepass)
+			continue;
+		camera->frameBuffer32 = plush_bench_modes[m].truecolor ? frame32 : NULL;
+		for(halfspace = 0; halfspace < 2; halfspace++)
+		{
+			for(clipped = 0; clipped < 2; clipped++)
+			{
+				camera->HalfSpace = halfspace;
+				camera->ClipTop = clipped ? h / 3 : 0;
+				camera->ClipBottom = clipped ? h * 2 / 3 : h;
+				pixels = wrong = 0;
+				srand(1);
+				for(trial = 0; trial < PLUSH_BENCH_COVERAGE_TRIALS; trial++)
+				{
+					for(i = 0; i <= n; i++)
+					{
+						for(j = 0; j <= n; j++)
+						{
+							fx = border + i * (w - 2.0 * border) / n;
+							fy = border + j * (h - 2.0 * border) / n;
+							if(i > 0 && j > 0 && i < n && j < n)
+							{
+								fx += (rand() % 2000 - 1000) / 400.0;
+								fy += (rand() % 2000 - 1000) / 400.0;
+								if(trial & 1)
+								{
+									fx = floor(fx) + (rand() & 1) * 0.5;
+									fy = floor(fy) + (rand() & 1) * 0.5;
+								}
+							}
+							gx[i][j] = (pl_sInt32) (fx * (1 << 20));
+							gy[i][j] = (pl_sInt32) (fy * (1 << 20));
+						}
+					}
+
+					memset(hits, 0, w * h);
+					memset(&face, 0, sizeof(face));
+					face.Material = materials[m];
+					face.fShade = 0.5f;
+					for(i = 0; i < n; i++)
+					{
+						for(j = 0; j < n; j++)
+						{
+							for(t = 0; t < 2; t++)
+							{
+								x0 = w;
+								y0 = h;
+								x1 = y1 = 0;
+								for(k = 0; k < 3; k++)
+								{
+									int cx = i + corners[((i + j + trial) & 1) * 2 + t][k][0];
+									int cy = j + corners[((i + j + trial) & 1) * 2 + t][k][1];
+
+									face.Scrx[k] = gx[cx][cy];
+									face.Scry[k] = gy[cx][cy];
+									face.Scrz[k] = 0.5f;
+									face.Shades[k] = 0.25f * (k + 1);
+									face.MappingU[k] = face.eMappingU[k] = cx << 18;
+									face.MappingV[k] = face.eMappingV[k] = cy << 18;
+									x0 = plMin(x0, (face.Scrx[k] >> 20) - 1);
+									x1 = plMax(x1, (face.Scrx[k] >> 20) + 2);
+									y0 = plMin(y0, (face.Scry[k] >> 20) - 1);
+									y1 = plMax(y1, (face.Scry[k] >> 20) + 2);
+								}
+								materials[m]->_PutFace(camera, &face);
+								triangles++;
+								for(y = plMax(y0, 0); y < plMin(y1, (pl_sInt) h); y++)
+								{
+									for(x = plMax(x0, 0); x < plMin(x1, (pl_sInt) w); x++)
+									{
+										if(zbuffer[y * w + x] != 0)
+										{
+											if(hits[y * w + x] < 255)
+												hits[y * w + x]++;
+											zbuffer[y * w + x] = 0;
+										}
+									}
+								}
+							}
+						}
+					}
+
+					/* Inside the grid every pixel is drawn once, outside
+					   the clipping none, and nowhere more than once */
+					for(y = 0; y < (pl_sInt) h; y++)
+					{
+						for(x = 0; x < (pl_sInt) w; x++)
+						{
+							inside = x > (pl_sInt) border && x < (pl_sInt) (w - border - 1) &&
+								y > (pl_sInt) border && y < (pl_sInt) (h - border - 1);
+							if(y < camera->ClipTop || y >= camera->ClipBottom)
+								inside = 0;
+							pixels += inside;
+							if(zbuffer[y * w + x] != 0 || hits[y * w + x] > 1 ||
+								(inside && hits[y * w + x] != 1) ||
+								((y < camera->ClipTop || y >= camera->ClipBottom) && hits[y * w + x]))
+								wrong++;
+							zbuffer[y * w + x] = 0;
+						}
+					}
+				}
+
+				printf("%s      { \"filler\": \"%s\", \"halfspace\": %u, \"clipped\": %u, \"pixels\": %lu, \"bad\": %lu }",
+					first ? "" : ",\n", plush_bench_modes[m].name, halfspace, clipped, pixels, wrong);
+				first = 0;
+				bad += wrong;
+			}
+		}
+	}
+	printf("\n    ],\n    \"triangles\": %lu,\n    \"bad\": %lu\n  }", triangles, bad);
+
+	plCamDelete(camera);
+	free(hits);
+	free(zbuffer);
+	free(frame32);
+	free(frame);
+	plush_bench_delete_materials(materials, texture);
+	return bad;
+}
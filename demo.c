@@ -324,7 +324,7 @@ static void plush_demo_run(plush_demo_t *self)
 			self->model->Za += self->dt * self->rotation[2];
 		}
 
-		SDL_memset(self->buffer->pixels, 0, self->buffer->h * self->buffer->pitch);
+		plCamClear(self->camera, 0, 0);
 
 		plTextPrintf(self->camera, 0, 0, 0, 255, (pl_sChar *) "FPS: %d", self->fps);
 		plTextPrintf(self->camera, 0, self->h - 32, 0, 255, plVersionString);
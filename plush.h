@@ -49,15 +49,48 @@ extern "C" {
 	#define PL_MAX_LIGHTS (32)
 #endif
 
-/* Maximum number of triangles per scene -- if you exceed this, entire
-objects will be ignored. You can increase this if you need it. It takes
-approximately 8*PL_MAX_TRIANGLES bytes of memory. i.e. the default of
-16384 consumes 128kbytes of memory. not really a big deal,
+/* Initial number of triangles per scene. The face queue of a render context
+starts this big and grows when a scene needs more (see
+plRenderContextReserve()), and is then reused by later frames. It takes
+approximately 16*PL_MAX_TRIANGLES bytes of memory on 64-bit systems.
 */
 #ifndef PL_MAX_TRIANGLES
 	#define PL_MAX_TRIANGLES (16384)
 #endif
 
+/* Define PL_THREADS (and link with pthreads) to let render contexts use
+worker threads, see plRenderContextSetThreads(). This is the maximum number
+of threads per context. */
+#ifndef PL_MAX_THREADS
+	#define PL_MAX_THREADS (64)
+#endif
+
+/* SSE2 and AVX2 code paths are used when the compiler targets them (i.e.
+with -msse2 or -mavx2), for vertex transforms and for filling solid and
+Gouraud shaded spans. They give the same results as the plain C code, which
+is what other targets use. Define PL_NO_SIMD to always use the plain C code. */
+
+/* Format of the z-buffer (see pl_ZBuffer), which holds 1/Z so that it is
+cleared to 0 and nearer pixels have larger values. 32 stores it as a float,
+24 and 16 store ZNear/Z (see pl_Cam.ZNear) as fixed point with 24 or 16
+fraction bits, in an int or a pl_uInt16. 16 halves the memory traffic of
+the z-test. The fixed point formats only tell depths near Z apart if they
+differ by more than about Z*Z/(ZNear*65535) with 16 bits, or
+Z*Z/(ZNear*16777215) with 24, and everything nearer than ZNear gets the
+same value, so set ZNear to the nearest depth that is ever visible. With
+16 bits and the default ZNear of 1 that is a step of 0.15 at Z = 100 and
+of 1 at Z = 256. */
+#ifndef PL_ZBUFFER_BITS
+	#define PL_ZBUFFER_BITS (32)
+#endif
+
+/* Number of triangles from which the painter's algorithm sort uses a radix
+sort rather than a heap sort. Run the sort benchmark in bench.c to find the
+crossover point for your machine. */
+#ifndef PL_RADIX_SORT_MIN
+	#define PL_RADIX_SORT_MIN (512)
+#endif
+
 #ifndef NUM_CLIP_PLANES
 	#define NUM_CLIP_PLANES 5
 #endif
@@ -122,6 +155,30 @@ approximately 8*PL_MAX_TRIANGLES bytes of memory. i.e. the default of
 #define PL_TEXENV_MIN (5)
 #define PL_TEXENV_MAX (6)
 
+/*
+** Stages of the rendering pipeline. Used with pl_RenderStats.StageTime.
+*/
+#define PL_STAGE_TRANSFORM (0) /* Transforming vertices */
+#define PL_STAGE_LIGHT (1)     /* Culling and lighting faces */
+#define PL_STAGE_SORT (2)      /* Sorting faces for the painter's algorithm */
+#define PL_STAGE_CLIP (3)      /* Clipping and projecting faces */
+#define PL_STAGE_RASTER (4)    /* Filling triangles */
+#define PL_NUM_STAGES (5)
+
+/*
+** Triangle fillers, as chosen by plMatInit(). Used with pl_RenderStats.Fill.
+*/
+#define PL_PF_SOLIDF (0)    /* plPF_SolidF() */
+#define PL_PF_SOLIDG (1)    /* plPF_SolidG() */
+#define PL_PF_TEXF (2)      /* plPF_TexF() */
+#define PL_PF_TEXG (3)      /* plPF_TexG() */
+#define PL_PF_TEXENV (4)    /* plPF_TexEnv() */
+#define PL_PF_PTEXF (5)     /* plPF_PTexF() */
+#define PL_PF_PTEXG (6)     /* plPF_PTexG() */
+#define PL_PF_TRANSF (7)    /* plPF_TransF() */
+#define PL_PF_TRANSG (8)    /* plPF_TransG() */
+#define PL_NUM_PF (9)
+
 #define PUTFACE_SORT() \
   i0 = 0; i1 = 1; i2 = 2; \
   if (TriFace->Scry[0] > TriFace->Scry[1]) { \
@@ -164,11 +221,14 @@ approximately 8*PL_MAX_TRIANGLES bytes of memory. i.e. the default of
   MappingV3=TriFace->MappingV[i2]*Texture->vScale*\
             TriFace->Material->TexScaling;
 
-typedef float pl_ZBuffer;              /* z-buffer type (must be float) */
 typedef float pl_Float;                /* General floating point */
 typedef float pl_IEEEFloat32;          /* IEEE 32 bit floating point */
 typedef signed long int pl_sInt32;     /* signed 32 bit integer */
 typedef unsigned long int pl_uInt32;   /* unsigned 32 bit integer */
+typedef unsigned int pl_ARGB;          /* 32 bit ARGB8888 pixel, the word
+                                          0xAARRGGBB, so the bytes B, G, R,
+                                          A on little-endian hosts */
+typedef signed long long int pl_sInt64; /* signed 64 bit integer */
 typedef signed short int pl_sInt16;    /* signed 16 bit integer */
 typedef unsigned short int pl_uInt16;  /* unsigned 16 bit integer */
 typedef signed int pl_sInt;            /* signed optimal integer */
@@ -177,6 +237,14 @@ typedef int pl_Bool;                   /* boolean */
 typedef unsigned char pl_uChar;        /* unsigned 8 bit integer */
 typedef signed char pl_sChar;          /* signed 8 bit integer */
 
+#if PL_ZBUFFER_BITS == 16
+typedef pl_uInt16 pl_ZBuffer;          /* z-buffer type (see PL_ZBUFFER_BITS) */
+#elif PL_ZBUFFER_BITS == 24
+typedef signed int pl_ZBuffer;
+#else
+typedef float pl_ZBuffer;
+#endif
+
 /*
 ** Texture type. Read textures with plReadPCXTex(), and assign them to
 ** plMat.Environment or plMat.Texture.
@@ -196,6 +264,16 @@ typedef struct _pl_Face pl_Face;
 /*
 ** Material type. Create materials with plMatCreate().
 */
+/* What the colors of an untextured material were made from, see
+   plMatInit() */
+typedef struct {
+  pl_uChar ft;                 /* Fill type, PL_FILL_* */
+  pl_Bool shaded;              /* Shade type isn't PL_SHADE_NONE */
+  pl_sInt Ambient[3], Diffuse[3], Specular[3];
+  pl_uInt Shininess, NumGradients;
+  pl_uChar Transparent;
+} _pl_MatSource;
+
 typedef struct _pl_Mat {
   pl_sInt Ambient[3];          /* RGB of surface (0-255 is a good range) */
   pl_sInt Diffuse[3];          /* RGB of diffuse (0-255 is a good range) */
@@ -221,6 +299,10 @@ typedef struct _pl_Mat {
   pl_uInt16 *_AddTable;        /* Shading/Translucent/etc table */
   pl_uChar *_ReMapTable;       /* Table to remap colors to palette */
   pl_uChar *_RequestedColors;  /* _ColorsUsed colors, desired colors */
+  pl_ARGB *_RGBTable;          /* _RequestedColors as ARGB8888, the colors
+                                  drawn to pl_Cam.frameBuffer32 */
+  _pl_MatSource _Source;       /* What _RequestedColors were made from,
+                                  if untextured */
   void (*_PutFace)(pl_Cam *cam, pl_Face *TriFace); /* Function that renders the triangle with this material */
 } pl_Mat;
 
@@ -277,6 +359,10 @@ typedef struct _pl_Obj {
                                          X then Y then Z. Measured in degrees */
   pl_Float Matrix[16];                /* Transformation matrix */
   pl_Float RotMatrix[16];             /* Rotation only matrix (for normals) */
+  pl_Float BoundMin[3], BoundMax[3];  /* Bounding box of the vertices */
+  pl_Float BoundCenter[3];            /* Bounding sphere of the vertices */
+  pl_Float BoundRadius;               /* < 0 if the bounds are unknown
+                                         (see plObjCalcBounds()) */
 } pl_Obj;
 
 /*
@@ -320,9 +406,87 @@ struct _pl_Cam {
   pl_Float X, Y, Z;              /* Camera position in worldspace */
   pl_Float Pitch, Pan, Roll;     /* Camera angle in degrees in worldspace */
   pl_uChar *frameBuffer;         /* Framebuffer (ScreenWidth*ScreenHeight) */
+  pl_ARGB *frameBuffer32;        /* ARGB8888 framebuffer (ditto), drawn to
+                                    instead of frameBuffer if not NULL */
   pl_ZBuffer *zBuffer;           /* Z Buffer (NULL if none) */
+  pl_Float ZNear;                /* Depth mapped to the nearest value of a
+                                    fixed point zBuffer, nearer pixels all
+                                    get that value. Defaults to 1, set it
+                                    to the nearest visible depth (see
+                                    PL_ZBUFFER_BITS) */
+  pl_Bool OcclusionCull;         /* Skip hidden objects and triangles using a
+                                    coarse copy of zBuffer (see plRender*()) */
+  pl_Bool HalfSpace;             /* Fill plPF_SolidF() and plPF_SolidG()
+                                    triangles in 8x8 blocks with edge
+                                    functions, rather than by scanlines */
+  pl_Bool VisBuffer;             /* Fill textured triangles in two passes,
+                                    depth first and then the shading of each
+                                    visible pixel once (see plRender*()) */
+  pl_Bool DepthPrepass;          /* Fill textured triangles in two passes,
+                                    depth first and then with their fillers
+                                    on the visible pixels only */
+  struct _pl_FillStats *_Stats;  /* Used internally, counters of the fillers
+                                    while in a plRender*() block */
+  pl_uInt *_Ids, _Id;            /* Used internally, the ids the depth pass
+                                    of DepthPrepass left and that of the
+                                    triangle being filled */
+  struct _pl_CamClear *_Clear;   /* Used internally, what plCamClear() has
+                                    to clear next time */
 };
 
+/*
+** Render context. Owns all the state of a plRender*() block (face list,
+** lights, clipping frustum and scratch space), so that independent viewports
+** can be rendered at the same time. See plRenderContextCreate().
+*/
+typedef struct _pl_RenderContext pl_RenderContext;
+
+/*
+** Inverse color map of a palette, which makes mapping many materials to the
+** same palette cheap. See plPalMapCreate().
+*/
+typedef struct _pl_PalMap pl_PalMap;
+
+/*
+** Counters of one triangle filler. See pl_RenderStats.
+*/
+typedef struct _pl_FillStats {
+  pl_uInt32 Triangles;           /* Triangles at least a row high filled */
+  pl_uInt32 Spans;               /* Rows of pixels filled */
+  pl_uInt32 Pixels;              /* Pixels written */
+  pl_uInt32 ZFails;              /* Pixels that failed the z-buffer test */
+} pl_FillStats;
+
+/*
+** Render statistics of a context, from the last plRender*() block. See
+** plRenderContextStats(). The triangle counts don't overlap: a triangle
+** is only counted by the first test that rejects it.
+*/
+typedef struct _pl_RenderStats {
+  pl_uInt32 BackfaceCulled;      /* Triangles facing away from the camera */
+  pl_uInt32 FrustumCulled;       /* Triangles outside the view, including
+                                    those of objects skipped as a whole */
+  pl_uInt32 OcclusionCulled;     /* Triangles hidden in the occlusion buffer
+                                    (see pl_Cam.OcclusionCull). With binning
+                                    each bin rejects its part separately. */
+  pl_uInt32 PixelsWritten;       /* Sum of Fill[].Pixels */
+  pl_uInt32 ZFails;              /* Sum of Fill[].ZFails */
+  pl_uInt32 ShadesSaved;         /* Pixels that passed the z-buffer test but
+                                    weren't shaded, as a nearer triangle
+                                    covered them (see pl_Cam.VisBuffer and
+                                    pl_Cam.DepthPrepass) */
+  pl_FillStats Fill[PL_NUM_PF];  /* Per filler, indexed by PL_PF_* */
+  pl_Bool Timers;                /* Set to time the stages of the pipeline */
+  double StageTime[PL_NUM_STAGES]; /* Seconds spent in each PL_STAGE_* by the
+                                    last plRender*() block, if Timers is set */
+} pl_RenderStats;
+
+/*
+** Scene. A bounding volume hierarchy of objects, which plRenderScene()
+** walks to render only those in view. See plSceneCreate().
+*/
+typedef struct _pl_Scene pl_Scene;
+
 #ifdef PLUSH_IMPLEMENTATION
 PL_API pl_sChar plVersionString[] = "Plush 3D Version 1.2.0";
 PL_API pl_sChar plCopyrightString[] = "Copyright (C) 1996-2000, Justin Frankel and Nullsoft";
@@ -596,6 +760,8 @@ extern pl_uInt32 plRender_TriStats[4]; /* Three different triangle counts from
                                           1: tris after culling
                                           2: final polys after real clipping
                                           3: final tris after tesselation
+                                          See plRenderContextStats() for
+                                          what the rest went to.
                                        */
 #endif
 
@@ -629,6 +795,13 @@ PL_API void plMatDelete(pl_Mat *m);
     nothing
   Notes:
     you *must* do this before calling plMatMapToPal() or plMatMakeOptPal().
+    Materials drawn to a pl_Cam.frameBuffer32 only need this, as they draw
+    the colors they request directly, without a palette.
+    Call it again after changing the material. The colors are only made
+    again if something they depend on changed, and if they come out the same
+    as before (e.g. when ShadeType went from flat to Gouraud shading) the
+    material keeps its mapping to the palette, so plMatMapToPal() needn't be
+    called again.
 */
 PL_API void plMatInit(pl_Mat *m);
 
@@ -644,11 +817,52 @@ PL_API void plMatInit(pl_Mat *m);
   Returns:
     nothing
   Notes:
-    Mapping a material with > 2000 colors can take up to a second or two.
-      Be careful, and go easy on plMat.NumGradients ;)
+    Each color is mapped to the nearest entry, the first one if several are
+    as near. The entries that can be nearest to the colors in each of a grid
+    of 32x32x32 cells are worked out as colors fall in the cells, and kept
+    in a built-in pl_PalMap for the next call, so mapping more materials to
+    the same palette range only costs a few comparisons a color.
+    Without PL_THREADS the built-in map makes this unsafe to call from two
+    threads at once, use plMatMapToPalMap() with a map for each thread.
+    plPalMapDelete(0) frees the memory of the built-in map.
 */
 PL_API void plMatMapToPal(pl_Mat *m, pl_uChar *pal, pl_sInt pstart, pl_sInt pend);
 
+/*
+  plMatMapToPalMap() is plMatMapToPal() with an inverse color map of your own
+  Parameters:
+    map: a map allocated with plPalMapCreate(), 0 for the built-in one
+    mat: material to map
+    pal, pstart, pend: as for plMatMapToPal()
+  Returns:
+    nothing
+  Notes:
+    A map holds the cells of the last palette range it was used with, and
+    starts afresh when given another. Only one thread may use a map at a
+    time, except the built-in one when PL_THREADS is defined.
+*/
+PL_API void plMatMapToPalMap(pl_PalMap *map, pl_Mat *m, pl_uChar *pal,
+                             pl_sInt pstart, pl_sInt pend);
+
+/*
+  plPalMapCreate() allocates a new inverse color map
+  Parameters:
+    none
+  Returns:
+    a pointer to the map on success, 0 on failure
+*/
+PL_API pl_PalMap *plPalMapCreate();
+
+/*
+  plPalMapDelete() frees an inverse color map
+  Parameters:
+    map: the map to free, or 0 to free the memory of the built-in one, which
+         is made again by the next plMatMapToPal()
+  Returns:
+    nothing
+*/
+PL_API void plPalMapDelete(pl_PalMap *map);
+
 
 /*
   plMatMakeOptPal() makes an almost optimal palette from materials
@@ -661,6 +875,12 @@ PL_API void plMatMapToPal(pl_Mat *m, pl_uChar *pal, pl_sInt pstart, pl_sInt pend
     nmats: number of materials
   Returns:
     nothing
+  Notes:
+    If the materials request no more distinct colors than there are entries,
+    those are used as they are, and the entries after them are left alone.
+    Otherwise the colors are cut into boxes, each time splitting the one
+    with the most squared error where that leaves the least, and each entry
+    gets the mean of a box. Colors requested more often weigh more.
 */
 PL_API void plMatMakeOptPal(pl_uChar *p, pl_sInt pstart,
                      pl_sInt pend, pl_Mat **materials, pl_sInt nmats);
@@ -747,6 +967,22 @@ PL_API pl_Obj *plObjTranslate(pl_Obj *o, pl_Float x, pl_Float y, pl_Float z);
 */
 PL_API pl_Obj *plObjFlipNormals(pl_Obj *o);
 
+/*
+  plObjCalcBounds() recomputes the bounding box and sphere of an object and
+    all of it's subobjects from their vertices
+  Parameters:
+    o: the object
+  Returns:
+    a pointer to o
+  Notes:
+    The renderer skips objects, and whole hierarchies of objects, whose
+    bounds are outside of the view, without transforming their vertices.
+    plObjScale(), plObjStretch(), plObjTranslate() and plObjCalcNormals()
+    keep the bounds up to date. If you change o->Vertices yourself, call
+    plObjCalcBounds() or set o->BoundRadius to -1.0 to never skip o.
+*/
+PL_API pl_Obj *plObjCalcBounds(pl_Obj *o);
+
 /*
   plObjSetMat() sets the material of all faces in an object.
   Paramters:
@@ -809,6 +1045,19 @@ PL_API void plClipRenderFace(pl_Face *face);
 */
 PL_API pl_sInt plClipNeeded(pl_Face *face);
 
+/*
+  plClipSetFrustumCtx(), plClipRenderFaceCtx() and plClipNeededCtx() are the
+    same as the above, but operate on the frustum of a render context instead
+    of the global one.
+  Parameters:
+    ctx: a render context allocated with plRenderContextCreate()
+    (the rest are the same as above)
+  Notes: these are used internally by plRender*Ctx(), same warnings apply.
+*/
+PL_API void plClipSetFrustumCtx(pl_RenderContext *ctx, pl_Cam *cam);
+PL_API void plClipRenderFaceCtx(pl_RenderContext *ctx, pl_Face *face);
+PL_API pl_sInt plClipNeededCtx(pl_RenderContext *ctx, pl_Face *face);
+
 /******************************************************************************
 ** Light Handling Routines (light.c)
 ******************************************************************************/
@@ -894,6 +1143,39 @@ PL_API void plCamSetTarget(pl_Cam *c, pl_Float x, pl_Float y, pl_Float z);
 */
 PL_API void plCamDelete(pl_Cam *c);
 
+/*
+  plCamClear() clears the framebuffer and Z buffer of a camera
+  Parameters:
+    c: the camera to clear the buffers of
+    color: the color to clear the framebuffer to
+    z: the value to clear the Z buffer to, usually 0 (infinitely far)
+  Returns:
+    nothing
+  Notes:
+    The first call clears the whole screen. From then on the camera keeps,
+    for each row, the span of pixels that the plPF_*() fillers and
+    plTextPutChar() drew to, and the next call clears only those. The
+    whole screen is cleared again if color, z, or the buffers or size of
+    the camera changed. Anything drawn into the buffers by other means is
+    not tracked, so clear it yourself.
+    If the camera has a frameBuffer32, that is cleared instead of
+    frameBuffer, to the color as a gray, see plCamClear32().
+*/
+PL_API void plCamClear(pl_Cam *c, pl_uChar color, pl_ZBuffer z);
+
+/*
+  plCamClear32() clears the ARGB8888 framebuffer and Z buffer of a camera
+  Parameters:
+    c: the camera to clear the buffers of, with a frameBuffer32
+    color: the ARGB8888 color to clear the framebuffer to
+    z: the value to clear the Z buffer to, usually 0 (infinitely far)
+  Returns:
+    nothing
+  Notes:
+    The same as plCamClear(), with a color for frameBuffer32.
+*/
+PL_API void plCamClear32(pl_Cam *c, pl_ARGB color, pl_ZBuffer z);
+
 /******************************************************************************
 ** Easy Rendering Interface (render.c)
 ******************************************************************************/
@@ -931,6 +1213,26 @@ PL_API void plRenderLight(pl_Light *light);
 */
 PL_API void plRenderObj(pl_Obj *obj);
 
+/*
+   plRenderObjInstanced() adds copies of an object and all of it's subobjects
+     to the scene, each one placed by a matrix of its own.
+   Parameters:
+     obj: object to render
+     matrices: count object to world space matrices, 16 floats each, the same
+               as obj->Matrix. Only rotation, translation and uniform scaling
+               are supported.
+     count: number of copies
+   Returns:
+     nothing
+   Notes: The position, rotation and Matrix of obj itself are ignored.
+     Unlike plRenderObj(), this doesn't write to the object: the transformed
+     vertices and lit faces of each copy are kept in scratch memory of the
+     render context until plRenderEnd(). Only the copies that are in view take
+     room there, and it is reused from one frame to the next.
+*/
+PL_API void plRenderObjInstanced(pl_Obj *obj, pl_Float *matrices,
+                                 pl_uInt32 count);
+
 /*
    plRenderEnd() actually does the rendering, and closes the rendering process
    Paramters:
@@ -940,6 +1242,278 @@ PL_API void plRenderObj(pl_Obj *obj);
 */
 PL_API void plRenderEnd();
 
+/*
+  plRenderContextCreate() allocates a new render context
+  Parameters:
+    none
+  Returns:
+    a pointer to the render context on success, 0 on failure
+  Notes:
+    The plRender*() functions above use a built-in global context. Use a
+    context of your own with the plRender*Ctx() functions below if you need
+    more than one rendering process at a time, e.g. one per thread.
+*/
+PL_API pl_RenderContext *plRenderContextCreate();
+
+/*
+  plRenderContextDelete() frees a render context
+  Parameters:
+    ctx: the context to free
+  Returns:
+    nothing
+*/
+PL_API void plRenderContextDelete(pl_RenderContext *ctx);
+
+/*
+  plRenderContextTriStats() gets the triangle counts of a render context
+  Parameters:
+    ctx: the context
+  Returns:
+    a pointer to four counters, same layout as plRender_TriStats
+*/
+PL_API pl_uInt32 *plRenderContextTriStats(pl_RenderContext *ctx);
+
+/*
+  plRenderContextReserve() sizes the face queue of a render context
+  Parameters:
+    ctx: the context (0 for the one used by plRender*())
+    faces: number of triangles to make room for
+  Returns:
+    1 on success, 0 if out of memory
+  Notes:
+    The queue grows by itself when a scene needs more room, and never shrinks,
+    so this is only needed to avoid allocating while rendering the first
+    frames. See plRenderContextHighWater().
+*/
+PL_API pl_Bool plRenderContextReserve(pl_RenderContext *ctx, pl_uInt32 faces);
+
+/*
+  plRenderContextHighWater() gets the largest number of triangles that have
+    been queued in a single frame
+  Parameters:
+    ctx: the context (0 for the one used by plRender*())
+  Returns:
+    the high-water mark of the face queue
+*/
+PL_API pl_uInt32 plRenderContextHighWater(pl_RenderContext *ctx);
+
+/*
+  plRenderContextStats() gets the statistics of a render context
+  Parameters:
+    ctx: the context (0 for the one used by plRender*())
+  Returns:
+    a pointer to the statistics, which stay valid as long as the context
+  Notes:
+    plRenderBegin*() clears them, apart from Timers. The triangle and pixel
+    counters are always kept, and complete once plRenderEnd*() returns;
+    the totals of plRenderContextTriStats() still apply alongside.
+    Stage timers are off by default, as the clipping and rasterization
+    stages are timed per triangle when they aren't binned (see
+    plRenderContextSetBinning()), which has a cost. Turn them on by setting
+    Timers. Times are wall clock times, so with worker threads a stage
+    counts once however many threads run it.
+*/
+PL_API pl_RenderStats *plRenderContextStats(pl_RenderContext *ctx);
+
+/*
+  plRenderBeginCtx(), plRenderLightCtx(), plRenderObjCtx(),
+    plRenderObjInstancedCtx() and plRenderEndCtx() are the same as the above,
+    but operate on a render context.
+  Parameters:
+    ctx: a render context allocated with plRenderContextCreate()
+    (the rest are the same as above)
+  Notes:
+    One rendering process can occur at a time per context. Different contexts
+    can be used from different threads at the same time, as long as they do
+    not render to the same camera or share objects.
+    If the camera has a zBuffer and OcclusionCull set, the context keeps a
+    pyramid of the farthest depth of each 8x8 and 64x64 block of the
+    z-buffer. Each triangle is tested against it before being filled, and each
+    object is tested when it is passed to plRenderObj*(), before it is lit,
+    against what earlier plRenderBegin*()/plRenderEnd*() blocks left in the
+    z-buffer. So render big occluders first, in a block of their own.
+    The pyramid is rebuilt lazily at the start of each block, so the z-buffer
+    may be cleared or changed between blocks.
+    If the camera has a zBuffer and VisBuffer set, the z-buffered triangles
+    of plPF_TexF(), plPF_TexG(), plPF_TexEnv(), plPF_PTexF() and plPF_PTexG()
+    are drawn in two passes, bin by bin (see plRenderContextSetBinning(), the
+    whole screen is one bin if binning is off). The first pass only writes
+    their depth, and which triangle each pixel shows to a buffer of 32 bit
+    ids kept by the context. The second shades each pixel once, for the triangle left in
+    it, with the texture perspective corrected on every pixel. The other
+    triangles are drawn after that, in their usual order, so those that
+    aren't z-buffered end up in front. In the statistics the Pixels of those
+    fillers are the pixels shaded, and ShadesSaved the ones that a nearer
+    triangle covered in the first pass.
+    DepthPrepass does the same with the fillers themselves shading: the
+    second pass fills those triangles again, each only on the pixels the
+    first pass left to it, so the image is the same as without it. If both
+    are set VisBuffer is used.
+*/
+PL_API void plRenderBeginCtx(pl_RenderContext *ctx, pl_Cam *Camera);
+PL_API void plRenderLightCtx(pl_RenderContext *ctx, pl_Light *light);
+PL_API void plRenderObjCtx(pl_RenderContext *ctx, pl_Obj *obj);
+PL_API void plRenderObjInstancedCtx(pl_RenderContext *ctx, pl_Obj *obj,
+                                    pl_Float *matrices, pl_uInt32 count);
+PL_API void plRenderEndCtx(pl_RenderContext *ctx);
+
+/*
+  plRenderContextSetThreads() sets the number of threads a context renders with
+  Parameters:
+    ctx: the context
+    threads: total number of threads, including the calling one. 0 or 1
+             renders on the calling thread only.
+  Returns:
+    the number of threads that will actually be used
+  Notes:
+    The threads transform and light large objects in plRenderObjCtx(), and
+    fill the bins in plRenderEndCtx() if binning is on. The output is the
+    same whatever the number of threads.
+    Worker threads are only available if plush was compiled with PL_THREADS
+    defined, otherwise this always returns 1. Don't call this between
+    plRenderBeginCtx() and plRenderEndCtx().
+*/
+PL_API pl_uInt plRenderContextSetThreads(pl_RenderContext *ctx, pl_uInt threads);
+
+/*
+  plRenderContextSetBinning() enables binned rasterization for a context
+  Parameters:
+    ctx: the context
+    binHeight: height of each bin in screen rows (64 is a good value),
+               0 disables binning (the default)
+  Returns:
+    nothing
+  Notes:
+    In binned mode plRenderEndCtx() clips and projects all the triangles
+    first, sorts them into bins of full-width bands of rows, and then fills
+    the bins in parallel with the threads set with plRenderContextSetThreads().
+    Triangles are drawn in the same order within each bin, so the result is
+    identical to the non-binned one, with or without a z-buffer.
+*/
+PL_API void plRenderContextSetBinning(pl_RenderContext *ctx, pl_uInt binHeight);
+
+/*
+  plFramebufferToARGB() converts the framebuffer of a camera to ARGB8888
+  Parameters:
+    cam: the camera, with a frameBuffer
+    palette: the palette the materials were mapped to (see plMatMapToPal()),
+             256 RGB triplets
+    out: where the ScreenWidth by ScreenHeight pixels go, as the pl_ARGB
+         words 0xAARRGGBB of pl_Cam.frameBuffer32 (the bytes B, G, R, A in
+         memory on little-endian hosts), with an alpha of 255
+    stride: distance between the rows of out, in pixels, 0 for ScreenWidth
+  Returns:
+    nothing
+  Notes:
+    The same as plFramebufferToARGBCtx(0,cam,palette,out,stride,1).
+*/
+PL_API void plFramebufferToARGB(pl_Cam *cam, const pl_uChar *palette,
+                                pl_ARGB *out, pl_uInt stride);
+
+/*
+  plFramebufferToARGBCtx() converts the framebuffer of a camera to ARGB8888,
+    scaled up, on the threads of a render context
+  Parameters:
+    ctx: the context to use the threads of (0 for the one used by plRender*())
+    cam: the camera, with a frameBuffer
+    palette: 256 RGB triplets, as for plFramebufferToARGB()
+    out: where the pixels go, ScreenWidth*scale by ScreenHeight*scale
+    stride: distance between the rows of out, in pixels, 0 for
+            ScreenWidth*scale
+    scale: how many times bigger to make it, each pixel becomes a scale by
+           scale block
+  Returns:
+    nothing
+  Notes:
+    The rows are split between the threads set with
+    plRenderContextSetThreads(). Don't call this between plRenderBeginCtx()
+    and plRenderEndCtx() with the same context.
+*/
+PL_API void plFramebufferToARGBCtx(pl_RenderContext *ctx, pl_Cam *cam,
+                                   const pl_uChar *palette, pl_ARGB *out,
+                                   pl_uInt stride, pl_uInt scale);
+
+/******************************************************************************
+** Scene Management (scene.c)
+******************************************************************************/
+
+/*
+  plSceneCreate() allocates an empty scene
+  Parameters:
+    none
+  Returns:
+    a pointer to the scene on success, 0 on failure
+*/
+PL_API pl_Scene *plSceneCreate();
+
+/*
+  plSceneDelete() frees a scene
+  Parameters:
+    scene: the scene to free
+  Returns:
+    nothing
+  Notes:
+    The objects in the scene are not freed.
+*/
+PL_API void plSceneDelete(pl_Scene *scene);
+
+/*
+  plSceneAdd() adds an object and all of it's subobjects to a scene
+  Parameters:
+    scene: the scene
+    obj: the object
+  Returns:
+    an id for plSceneUpdate() and plSceneRemove(), or -1 if out of memory
+  Notes:
+    The object is placed in the scene from its current position, rotation
+    and bounds (see plObjCalcBounds()). Objects with unknown bounds are
+    rendered whenever the scene is.
+*/
+PL_API pl_sInt32 plSceneAdd(pl_Scene *scene, pl_Obj *obj);
+
+/*
+  plSceneRemove() removes an object from a scene
+  Parameters:
+    scene: the scene
+    id: the id plSceneAdd() returned for the object
+  Returns:
+    nothing
+*/
+PL_API void plSceneRemove(pl_Scene *scene, pl_sInt32 id);
+
+/*
+  plSceneUpdate() tells a scene that an object has moved
+  Parameters:
+    scene: the scene
+    id: the id plSceneAdd() returned for the object
+  Returns:
+    nothing
+  Notes:
+    Call it after changing the position, rotation or Matrix of the object,
+    its subobjects or their bounds. Each object sits in the hierarchy with
+    some room to spare, so small movements cost next to nothing; larger
+    ones take the object out and insert it again.
+*/
+PL_API void plSceneUpdate(pl_Scene *scene, pl_sInt32 id);
+
+/*
+  plRenderScene() adds the objects of a scene which might be in view to the
+    plRender() block, like plRenderObj() would
+  Parameters:
+    scene: the scene
+  Returns:
+    nothing
+  Notes:
+    Branches of the hierarchy outside of the view frustum are skipped
+    without looking at their objects, so the cost grows with what is in view
+    rather than with the size of the scene. Their triangles still count in
+    plRender_TriStats[0].
+    The objects are added in no particular order, so for the painter's
+    algorithm use a z-buffer or set Camera->Sort.
+*/
+PL_API void plRenderScene(pl_Scene *scene);
+PL_API void plRenderSceneCtx(pl_RenderContext *ctx, pl_Scene *scene);
+
 /******************************************************************************
 ** Object Primitives Code (make.c)
 ******************************************************************************/
@@ -1202,7 +1776,7 @@ PL_API void plTextSetFont(pl_uChar *font, pl_uChar height);
     x: the x screen position of the left of the text
     y: the y screen position of the top of the text
     z: the depth of the text (used when cam->zBuffer is set)
-    color: the color to make the text
+    color: the color to make the text, a gray level with a frameBuffer32
     c: the character to put. Special characters such as '\n' aren't handled.
   Returns:
     nothing
@@ -1249,6 +1823,14 @@ PL_API void plTextPrintf(pl_Cam *cam, pl_sInt x, pl_sInt y, pl_Float z,
 ** Built-in Rasterizers
 ******************************************************************************/
 
+/*
+  The rasterizers sample pixels at their centers, with the vertices placed to
+  the 1/2^20 of a pixel of pl_Face.Scrx and Scry. A pixel is drawn if its
+  center is inside the triangle, or on a top or left edge of it, so triangles
+  sharing an edge draw each pixel along it exactly once. plPF_SolidF() and
+  plPF_SolidG() snap the vertices to 1/16 of a pixel with pl_Cam.HalfSpace.
+*/
+
 PL_API void plPF_SolidF(pl_Cam *, pl_Face *);
 PL_API void plPF_SolidG(pl_Cam *, pl_Face *);
 PL_API void plPF_TexF(pl_Cam *, pl_Face *);
@@ -1267,9 +1849,147 @@ PL_API void plPF_TransG(pl_Cam *, pl_Face *);
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#ifdef PL_THREADS
+#include <pthread.h>
+#endif
+#if !defined(PL_NO_SIMD) && defined(__SSE2__)
+#define _PL_SSE2
+#include <emmintrin.h>
+#endif
+#if !defined(PL_NO_SIMD) && defined(__AVX2__)
+#define _PL_AVX2
+#include <immintrin.h>
+#endif
+
+/* Inlined even when not optimizing, so that the constant arguments of the
+   _plPF_*() filler templates select their code at compile time */
+#if defined(__GNUC__)
+#define _PL_INLINE static inline __attribute__((always_inline))
+#elif defined(_MSC_VER)
+#define _PL_INLINE static __forceinline
+#else
+#define _PL_INLINE static
+#endif
+
+/* State of plCamClear(): the buffers and values it last cleared to, and on
+   each row the span drawn to since then. The spans are kept per row rather
+   than per tile so that binned rendering, where each thread only draws its
+   own rows, never shares one between threads. */
+typedef struct _pl_CamClear {
+  pl_uChar *frameBuffer;
+  pl_ARGB *frameBuffer32;
+  pl_ZBuffer *zBuffer;
+  pl_uInt w, h;
+  pl_ARGB color;
+  pl_ZBuffer z;
+  pl_sInt32 *x0, *x1;                  /* Span drawn to on each row, empty
+                                          if x0 >= x1 */
+} _pl_CamClear;
+
+/* Adds x0..x1-1 on rows y0..y1-1 to what plCamClear() has to clear */
+static void _plCamTouch(pl_Cam *cam, pl_sInt32 x0, pl_sInt32 x1,
+                        pl_sInt32 y0, pl_sInt32 y1) {
+  _pl_CamClear *c = cam->_Clear;
+  if (x0 < 0) x0 = 0;
+  if (x1 > (pl_sInt32) c->w) x1 = c->w;
+  if (y0 < 0) y0 = 0;
+  if (y1 > (pl_sInt32) c->h) y1 = c->h;
+  if (x0 >= x1) return;
+  for (; y0 < y1; y0 ++) {
+    if (x0 < c->x0[y0]) c->x0[y0] = x0;
+    if (x1 > c->x1[y0]) c->x1[y0] = x1;
+  }
+}
+
+/* Fills n bytes from p with the 4 byte pattern pat, with the byte at address
+   a taken from pat[a & 3] */
+static void _plCamClearRun(pl_uChar *p, const pl_uChar *pat, size_t n) {
+  size_t i;
+  if (pat[0] == pat[1] && pat[0] == pat[2] && pat[0] == pat[3]) {
+    memset(p,pat[0],n);
+    return;
+  }
+  /* Write one pattern, then copy what is done onto the rest */
+  for (i = 0; i < n && i < 4; i ++) p[i] = pat[((size_t) p+i) & 3];
+  for (; i < n; i += i) memcpy(p+i,p,plMin(i,n-i));
+}
+
+PL_API void plCamClear(pl_Cam *cam, pl_uChar color, pl_ZBuffer z) {
+  plCamClear32(cam,cam->frameBuffer32 ? 0xFF000000 | color*0x010101 : color,
+               z);
+}
+
+PL_API void plCamClear32(pl_Cam *cam, pl_ARGB color, pl_ZBuffer z) {
+  _pl_CamClear *c = cam->_Clear;
+  pl_uInt w = cam->ScreenWidth, h = cam->ScreenHeight, y;
+  pl_uChar cpat[4], zpat[4];
+  size_t o = 0, n = 0, zs = sizeof(pl_ZBuffer);
+  size_t cs = cam->frameBuffer32 ? sizeof(pl_ARGB) : 1;
+  pl_uChar *fb = cam->frameBuffer32 ? (pl_uChar *) cam->frameBuffer32 :
+                                      cam->frameBuffer;
+  pl_Bool all;
+  if (c && c->h != h) {
+    free(c);
+    c = cam->_Clear = 0;
+  }
+  all = !c || c->frameBuffer != cam->frameBuffer ||
+        c->frameBuffer32 != cam->frameBuffer32 ||
+        c->zBuffer != cam->zBuffer || c->w != w || c->color != color ||
+        c->z != z;
+  if (!c) {
+    c = (_pl_CamClear *) malloc(sizeof(_pl_CamClear)+2*h*sizeof(pl_sInt32));
+    if (c) {
+      c->x0 = (pl_sInt32 *) (c+1);
+      c->x1 = c->x0+h;
+    }
+    cam->_Clear = c;
+  }
+  for (y = 0; y < 4; y ++) {
+    cpat[y] = cs == 1 ? (pl_uChar) color : ((pl_uChar *) &color)[y];
+    zpat[y] = ((pl_uChar *) &z)[y % zs];
+  }
+  /* Spans that follow on from each other, such as whole rows, are cleared
+     in one go */
+  for (y = 0; y <= h; y ++) {
+    pl_sInt32 x0 = 0, x1 = 0;
+    if (y < h) {
+      x0 = all ? 0 : c->x0[y];
+      x1 = all ? (pl_sInt32) w : c->x1[y];
+      if (c) {
+        c->x0[y] = w;
+        c->x1[y] = 0;
+      }
+      if (x0 >= x1) continue;
+      if (o+n == (size_t) y*w+x0) {
+        n += x1-x0;
+        continue;
+      }
+    }
+    if (n) {
+      if (fb) _plCamClearRun(fb+o*cs,cpat,n*cs);
+      if (cam->zBuffer)
+        _plCamClearRun((pl_uChar *) (cam->zBuffer+o),zpat,n*zs);
+    }
+    o = (size_t) y*w+x0;
+    n = x1-x0;
+  }
+  if (c) {
+    c->frameBuffer = cam->frameBuffer;
+    c->frameBuffer32 = cam->frameBuffer32;
+    c->zBuffer = cam->zBuffer;
+    c->w = w;
+    c->h = h;
+    c->color = color;
+    c->z = z;
+  }
+}
 
 PL_API void plCamDelete(pl_Cam *c) {
-  if (c) free(c);
+  if (c) {
+    free(c->_Clear);
+    free(c);
+  }
 }
 
 PL_API void plCamSetTarget(pl_Cam *c, pl_Float x, pl_Float y, pl_Float z) {
@@ -1305,6 +2025,7 @@ PL_API pl_Cam *plCamCreate(pl_uInt sw, pl_uInt sh, pl_Float ar, pl_Float fov,
   c->CenterX = sw>>1;
   c->CenterY = sh>>1;
   c->ClipBack = 8.0e30f;
+  c->ZNear = 1.0f;
   c->frameBuffer = fb;
   c->zBuffer = zb;
   c->Sort = 1;
@@ -1322,42 +2043,447 @@ typedef struct
   double eMappingV[8];
 } _clipInfo;
 
-static _clipInfo m_cl[2];
+typedef struct {
+  pl_Float zd;
+  pl_Face *face;
+} _faceInfo;
 
-static double m_clipPlanes[NUM_CLIP_PLANES][4];
-static pl_Cam *m_cam;
-static pl_sInt32 m_cx, m_cy;
-static double m_fov;
-static double m_adj_asp;
+/* A block of scratch memory, followed by size bytes */
+typedef struct _plScratch {
+  struct _plScratch *next;
+  pl_uInt32 size, used;
+} _plScratch;
 
-static void _FindNormal(double x2, double x3,
-                        double y2, double y3,
-                        double zv,
-                        double *res);
+typedef struct {
+  pl_Light *light;
+  pl_Float l[3];
+} _lightInfo;
 
- /* Returns: 0 if nothing gets in,  1 or 2 if pout1 & pout2 get in */
-static pl_uInt _ClipToPlane(pl_uInt numVerts, double *plane);
+/* Counters of one bin, added to pl_RenderStats once the bins are filled.
+   Triangles that start in an earlier bin go in cont, whose Triangles are
+   left out so that each triangle counts once. */
+typedef struct {
+  pl_FillStats Fill[PL_NUM_PF], cont[PL_NUM_PF];
+  pl_uInt32 occluded;
+  pl_uInt32 saved;                     /* Adds up to ShadesSaved */
+  pl_FillStats shade[PL_NUM_PF];       /* Second pass of DepthPrepass, of
+                                          which only Pixels count */
+} _plBinStats;
+
+/* A triangle of the visibility buffer (see pl_Cam.VisBuffer), with what
+   _plVisShade() needs to shade its pixels. Values are planes of three
+   doubles, a + x*dx + y*dy being the value at pixel x of row y. */
+typedef struct {
+  pl_uChar pf;                         /* Its PL_PF_*, PL_NUM_PF if it is
+                                          not deferred */
+  pl_uChar vshift, evshift;
+  pl_uChar *texture, *environment, *remap;
+  pl_ARGB *rgbmap;
+  pl_uInt16 *addtable;
+  pl_uInt bc;                          /* Flat shade, from addtable */
+  pl_sInt32 uAnd, vAnd, euAnd, evAnd;
+  double u[3], v[3];                   /* Texture coordinates, 16.16, over
+                                          z for the perspective fillers */
+  double c[3];                         /* Gouraud shade, 8.8 */
+  double eu[3], ev[3];                 /* Environment coordinates, 16.16 */
+  double z[3];                         /* 1/Z */
+} _plVisFace;
+
+struct _pl_RenderContext {
+  pl_uInt32 *TriStats;                 /* Points to _TriStats, or to
+                                          plRender_TriStats for the global
+                                          context */
+  pl_uInt32 _TriStats[4];
+
+  /* plRender*() state */
+  pl_uInt32 numfaces, maxfaces;        /* Used and allocated entries */
+  pl_uInt32 highWater;                 /* Most faces queued in a frame */
+  _faceInfo *faces;
+  _faceInfo *sortScratch;              /* maxfaces entries, for the radix
+                                          sort */
+  pl_uInt32 sortScratchSize;
+  pl_Float cMatrix[16];
+  pl_uInt32 numlights;
+  _lightInfo lights[PL_MAX_LIGHTS];
+  pl_Cam *cam;
+
+  /* plClip*() state */
+  _clipInfo cl[2];
+  double clipPlanes[NUM_CLIP_PLANES][4];
+  double clipPlaneLen[NUM_CLIP_PLANES]; /* Lengths of the plane normals */
+  pl_Cam *clipCam;
+  pl_sInt32 cx, cy;
+  double fov;
+  double adj_asp;
+
+  /* Binned rasterization state (see plRenderContextSetBinning()) */
+  pl_uInt binHeight;                   /* Rows per bin, 0 if not binning */
+  pl_uInt numBins;
+  pl_uInt32 numBinFaces, maxBinFaces;
+  pl_Face *binFaces;                   /* Clipped and projected faces */
+  pl_uInt32 *binStart;                 /* numBins+1 offsets into binIndex */
+  pl_uInt32 maxBinIndex;
+  pl_uInt32 *binIndex;                 /* Face indices, bin after bin */
+  _plBinStats *binStats;               /* maxBinStats counters */
+  pl_uInt maxBinStats;
+
+  /* Worker threads (see plRenderContextSetThreads()) */
+  pl_uInt numThreads;
+#ifdef PL_THREADS
+  pthread_t threads[PL_MAX_THREADS];
+  pthread_mutex_t jobMutex;
+  pthread_cond_t jobCond, doneCond;
+  pl_uInt jobGeneration, jobNext, jobDone, jobCount;
+  pl_Bool jobQuit;
+#endif
+  void (*jobFunc)(pl_RenderContext *ctx, pl_uInt index);
+
+  /* Hierarchical z-buffer (see pl_Cam.OcclusionCull) */
+  pl_Bool hizOn;                       /* Occlusion culling this block */
+  pl_uInt hizW[2], hizH[2];            /* Size of each level, in tiles */
+  pl_ZBuffer *hiz[2];                  /* Farthest depth of each 8x8 and
+                                          64x64 tile */
+  pl_uChar *hizDirty[2];               /* Tiles to recompute before use */
+  pl_uInt32 hizSize;                   /* Allocated bytes at hiz[0] */
+
+  /* Visibility buffer (see pl_Cam.VisBuffer) */
+  pl_Bool visOn;                       /* Deferring faces this block */
+  pl_Bool visPrepass;                  /* For pl_Cam.DepthPrepass */
+  pl_uInt *visIds;                     /* Face of each pixel, 1 + its index
+                                          in binFaces, 0 if none. Kept at 0
+                                          between blocks. */
+  pl_sInt32 *visX0, *visX1;            /* Span of each row that has ids */
+  pl_uInt32 visSize;                   /* Allocated bytes at visIds */
+  pl_uInt32 visPixels;                 /* Pixels of the last layout of
+                                          visIds, which are all 0 */
+  _plVisFace *visFaces;                /* One per entry of binFaces */
+  pl_uInt32 maxVisFaces;
+
+  /* Object being transformed and lit by _RenderObj(), in chunks */
+  pl_Obj *xfObj;
+  pl_Float *xfMatrix, *xfnMatrix;
+  pl_Vertex *xfVerts;                  /* Where the transformed vertices go */
+  pl_Face *xfFaces;                    /* Where the lit faces go, if not in
+                                          xfObj itself */
+  pl_uInt xfChunks;
+  pl_uInt32 xfCount[PL_MAX_THREADS*4]; /* Visible faces per chunk */
+  pl_uInt32 xfBackface[PL_MAX_THREADS*4]; /* Backfacing faces per chunk */
+
+  /* Framebuffer being converted by plFramebufferToARGBCtx(), in bands */
+  pl_Cam *cvtCam;
+  pl_ARGB cvtPalette[256];
+  pl_ARGB *cvtOut;
+  pl_uInt cvtStride, cvtScale;
+  pl_uInt cvtRows;                     /* Rows of cvtCam per band */
+
+  /* Per instance vertices and faces (see plRenderObjInstanced()), kept until
+     plRenderEnd*() and reused by the next block */
+  _plScratch *scratch, *scratchCur;
+
+  pl_RenderStats stats;
+};
 
-PL_API void plClipSetFrustum(pl_Cam *cam) {
-  m_adj_asp = 1.0 / cam->AspectRatio;
-  m_fov = plMin(plMax(cam->Fov,1.0),179.0);
-  m_fov = (1.0/tan(m_fov*(PL_PI/360.0)))*(double) (cam->ClipRight-cam->ClipLeft);
-  m_cx = cam->CenterX<<20;
-  m_cy = cam->CenterY<<20;
-  m_cam = cam;
-  memset(m_clipPlanes,0,sizeof(m_clipPlanes));
+/* Seconds from an arbitrary point, for the stage timers */
+static double _plTimer(void) {
+#ifdef CLOCK_MONOTONIC
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec + ts.tv_nsec*1e-9;
+#else
+  return clock()/(double) CLOCKS_PER_SEC;
+#endif
+}
 
-  /* Back */
-  m_clipPlanes[0][2] = -1.0;
-  m_clipPlanes[0][3] = -cam->ClipBack;
+/* Gets the first and last+1 screen row a projected face covers, the same way
+   the plPF_*() fillers round them */
+#define _plFaceRows(f,y0,y1) { \
+  pl_sInt32 _mn = ( f )->Scry[0], _mx = ( f )->Scry[0]; \
+  if (( f )->Scry[1] < _mn) _mn = ( f )->Scry[1]; \
+  if (( f )->Scry[1] > _mx) _mx = ( f )->Scry[1]; \
+  if (( f )->Scry[2] < _mn) _mn = ( f )->Scry[2]; \
+  if (( f )->Scry[2] > _mx) _mx = ( f )->Scry[2]; \
+  ( y0 ) = _plFillPixel(_mn); \
+  ( y1 ) = _plFillPixel(_mx); \
+}
 
-  /* Left */
-  m_clipPlanes[1][3] = 0.00000001;
-  if (cam->ClipLeft == cam->CenterX) {
-    m_clipPlanes[1][0] = 1.0;
-  }
-  else _FindNormal(-100,-100,
-                100, -100,
+/* Counts a triangle drawn by filler pf for pl_RenderStats, if the camera is
+   in a plRender*() block */
+static void _plFillStats(pl_Cam *cam, pl_uInt pf, pl_uInt32 spans,
+                         pl_uInt32 pixels, pl_uInt32 written) {
+  pl_FillStats *s = cam->_Stats;
+  if (!s) return;
+  s += pf;
+  s->Triangles ++;
+  s->Spans += spans;
+  s->Pixels += written;
+  s->ZFails += pixels - written;
+}
+
+/*
+** Values of the z-buffer (see PL_ZBUFFER_BITS). The fillers interpolate 1/Z
+** times _plZScale(), and _plZ() turns the value z of a pixel into what the
+** z-buffer holds. The fixed point formats saturate, so everything nearer
+** than pl_Cam.ZNear gets the nearest value, and are compared as ints, so a
+** value rounded below 0 fails every z test without being clamped.
+*/
+#if PL_ZBUFFER_BITS == 32
+#define _plZScale(cam) 1.0f
+#define _plZ(z) (z)
+#else
+#define _PL_ZMAX ((1<<PL_ZBUFFER_BITS)-1)
+#define _plZScale(cam) ((cam)->ZNear*(pl_Float) _PL_ZMAX)
+#define _plZ(z) ((pl_sInt) plMin((z),(pl_Float) _PL_ZMAX))
+#endif
+
+/* The z-buffer test of the textured fillers, by their zb argument: 1 is the
+   usual one, and they then write z. 2 is the colour pass of
+   pl_Cam.DepthPrepass, which passes where the depth pass left the id of the
+   face being drawn, and they leave the z-buffer alone. */
+#define _plZTest(zb,cam,zbuf,z) ((zb) == 2 ? \
+  (cam)->_Ids[(zbuf)-(cam)->zBuffer] == (cam)->_Id : *(zbuf) < (z))
+
+/*
+** Pixels of the framebuffer the fillers draw to, by their rgb argument: 0 is
+** frameBuffer, of palette indices, and 1 is frameBuffer32, of ARGB8888
+** colors. Either way gmem points at bytes, and moves on by _plPixelSize()
+** per pixel. Color i of a material is remap[i] (its _ReMapTable) in the one
+** and rgbmap[i] (its _RGBTable) in the other.
+*/
+#define _plFrameBuffer(cam,rgb) \
+  ((rgb) ? (pl_uChar *) (cam)->frameBuffer32 : (cam)->frameBuffer)
+#define _plPixelSize(rgb) ((rgb) ? 4 : 1)
+#define _plPutPixel(rgb,gmem,remap,rgbmap,i) ((rgb) ? \
+  (void) (*(pl_ARGB *) (gmem) = (rgbmap)[i]) : (void) (*(gmem) = (remap)[i]))
+
+/* What the transparent fillers add to the shade of the pixel at gmem: its
+   _AddTable entry, or for an ARGB8888 pixel the same sum plMatMapToPal()
+   gives a palette entry, the intensity times n (_ColorsUsed-_tsfact) */
+#define _plBehind(rgb,gmem,addtable,n) ((rgb) ? \
+  ((((*(pl_ARGB *) (gmem))>>16)&0xFF) + \
+   (((*(pl_ARGB *) (gmem))>>8)&0xFF) + \
+   ((*(pl_ARGB *) (gmem))&0xFF))*(n)/768 : (addtable)[*(gmem)])
+
+/*
+** Triangle setup shared by the plPF_*() fillers, which also fixes their fill
+** rule. Scrx and Scry are 12.20 fixed point, so vertices are placed to 1/2^20
+** of a pixel, and each edge is walked exactly at that precision: its x on a
+** row is kept rounded up to 12.20 with the remainder carried over, and it is
+** always set up from its own two vertices, top to bottom, so two triangles
+** sharing an edge see the same x on every row. Pixels are sampled at their
+** centers. A center exactly on an edge belongs to the triangle only if the
+** edge is a top or left edge (the top-left rule), so triangles sharing an
+** edge write each pixel along it exactly once, with no gaps between them.
+*/
+
+/* The first pixel, or row, whose center is at or past the 12.20 coordinate v */
+#define _plFillPixel(v) (((v)+(1<<19)-1)>>20)
+
+typedef struct {
+  pl_sInt32 X, dX;       /* x on the current row rounded up, and step per row */
+  pl_sInt64 r, dr, h;    /* How far X and dX are rounded up, in 1/h of 12.20 */
+} _pl_FillEdge;
+
+typedef struct {
+  _pl_FillEdge e, s;     /* The long edge and the current short edge */
+  pl_Bool midLeft;       /* Whether s is the left edge */
+  pl_sInt32 Y, Ymid;     /* Current row, and first row past the middle vertex */
+  pl_sInt32 Yend;        /* Last row to draw + 1, within cam->ClipBottom */
+  pl_sInt32 xm, ym;      /* Middle vertex */
+  pl_sInt32 xb, yb;      /* Bottom vertex */
+  double x0, y0;         /* Top vertex, in pixels, for _plFillPlane() */
+  double dx1, dy1;       /* Middle vertex relative to the top one */
+  double dx2, dy2;       /* Bottom vertex relative to the top one */
+  double idet;           /* 1 / twice the signed area, in pixels */
+} _pl_Fill;
+
+/* ceil(n/d) for d > 0, with in *r how far it was rounded up, times d. The
+   quotient is estimated in floating point with id = 1/d, which is off by at
+   most one, and then corrected, as 64 bit divides are slow */
+static pl_sInt64 _plFillCeil(pl_sInt64 n, pl_sInt64 d, double id,
+                             pl_sInt64 *r) {
+  pl_sInt64 q = (pl_sInt64) (n*id);
+  *r = q*d - n;
+  if (*r < 0) { q++; *r += d; }
+  else if (*r >= d) { q--; *r -= d; }
+  return q;
+}
+
+/* Sets up e to walk the edge from (xa,ya) down to (xb,yb), with yb > ya,
+   starting on row y */
+static void _plFillEdge(_pl_FillEdge *e, pl_sInt32 xa, pl_sInt32 ya,
+                        pl_sInt32 xb, pl_sInt32 yb, pl_sInt32 y) {
+  pl_sInt64 dx = (pl_sInt64) xb - xa;
+  double id;
+  e->h = (pl_sInt64) yb - ya;
+  id = 1.0/e->h;
+  e->X = (pl_sInt32) (xa + _plFillCeil(dx*(((pl_sInt64) y<<20)+(1<<19)-ya),
+                                       e->h,id,&e->r));
+  e->dX = (pl_sInt32) _plFillCeil(dx*(1<<20),e->h,id,&e->dr);
+}
+
+/* The first pixel on the current row at or right of the left edge of f, and
+   of the right edge */
+#define _plFillLeft(f) _plFillPixel((f)->midLeft ? (f)->s.X : (f)->e.X)
+#define _plFillRight(f) _plFillPixel((f)->midLeft ? (f)->e.X : (f)->s.X)
+
+/* Sets the vertices of f from those of TriFace, i0 first, for _plFillPlane(),
+   and returns twice the signed area of the triangle, in pixels */
+_PL_INLINE double _plFillBasis(_pl_Fill *f, pl_Face *TriFace,
+                               pl_uChar i0, pl_uChar i1, pl_uChar i2) {
+  pl_sInt32 *sx = TriFace->Scrx, *sy = TriFace->Scry;
+  double det;
+  f->x0 = sx[i0]*(1.0/(1<<20));
+  f->y0 = sy[i0]*(1.0/(1<<20));
+  f->dx1 = (sx[i1]-sx[i0])*(1.0/(1<<20));
+  f->dy1 = (sy[i1]-sy[i0])*(1.0/(1<<20));
+  f->dx2 = (sx[i2]-sx[i0])*(1.0/(1<<20));
+  f->dy2 = (sy[i2]-sy[i0])*(1.0/(1<<20));
+  det = f->dx1*f->dy2 - f->dx2*f->dy1;
+  f->idet = det != 0.0 ? 1.0/det : 0.0;
+  return det;
+}
+
+/*
+** _plFillSetup() sets up f to walk face TriFace, with vertices i0, i1 and i2
+** sorted top to bottom by PUTFACE_SORT(), from the first row it draws within
+** cam->ClipTop and cam->ClipBottom.
+** Returns: 0 if it draws no rows
+*/
+_PL_INLINE pl_Bool _plFillSetup(_pl_Fill *f, pl_Cam *cam, pl_Face *TriFace,
+                                pl_uChar i0, pl_uChar i1, pl_uChar i2) {
+  pl_sInt32 *sx = TriFace->Scrx, *sy = TriFace->Scry;
+  double det;
+  f->Y = _plFillPixel(sy[i0]);
+  f->Ymid = _plFillPixel(sy[i1]);
+  f->Yend = _plFillPixel(sy[i2]);
+  if (f->Y < cam->ClipTop) f->Y = cam->ClipTop;
+  if (f->Yend > cam->ClipBottom) f->Yend = cam->ClipBottom;
+  if (f->Y >= f->Yend) return 0;
+  if (cam->_Clear)
+    _plCamTouch(cam,_plFillPixel(plMin(sx[0],plMin(sx[1],sx[2]))),
+                _plFillPixel(plMax(sx[0],plMax(sx[1],sx[2]))),f->Y,f->Yend);
+  f->xm = sx[i1]; f->ym = sy[i1];
+  f->xb = sx[i2]; f->yb = sy[i2];
+  _plFillEdge(&f->e,sx[i0],sy[i0],sx[i2],sy[i2],f->Y);
+  if (f->Y < f->Ymid) _plFillEdge(&f->s,sx[i0],sy[i0],sx[i1],sy[i1],f->Y);
+  else _plFillEdge(&f->s,sx[i1],sy[i1],sx[i2],sy[i2],f->Y);
+  det = _plFillBasis(f,TriFace,i0,i1,i2);
+  /* The middle vertex is left of the long edge if det < 0 */
+  f->midLeft = det < 0.0;
+  return 1;
+}
+
+/* Moves edge e on to the next row. The carry out of the remainder is as
+   likely as not, so it is taken without a branch */
+_PL_INLINE void _plFillStep(_pl_FillEdge *e) {
+  pl_sInt64 r = e->r + e->dr;
+  pl_Bool c = r >= e->h;
+  e->X += e->dX - c;
+  e->r = c ? r - e->h : r;
+}
+
+/* Moves f on to the next row, switching to the lower short edge at Ymid */
+_PL_INLINE void _plFillNext(_pl_Fill *f) {
+  _plFillStep(&f->e);
+  if (++f->Y == f->Ymid && f->Y < f->Yend)
+    _plFillEdge(&f->s,f->xm,f->ym,f->xb,f->yb,f->Y);
+  else _plFillStep(&f->s);
+}
+
+/* Gets the screen gradients dadx and dady of a value given as a0, a1 and a2
+   at the vertices set up in f, and in *a its value at the center of pixel 0
+   on row f->Y, so a + x*dadx is its value on pixel x of that row */
+_PL_INLINE void _plFillPlane(const _pl_Fill *f, double a0, double a1,
+                             double a2, double *a, double *dadx, double *dady) {
+  a1 -= a0; a2 -= a0;
+  *dadx = (a1*f->dy2 - a2*f->dy1)*f->idet;
+  *dady = (a2*f->dx1 - a1*f->dx2)*f->idet;
+  *a = a0 + (0.5-f->x0)*(*dadx) + (f->Y+0.5-f->y0)*(*dady);
+}
+
+/* _plFillPlane() of the z-buffer values (see _plZScale()) of a face */
+_PL_INLINE void _plFillZPlane(const _pl_Fill *f, pl_Cam *cam, pl_Face *face,
+                              pl_uChar i0, pl_uChar i1, pl_uChar i2,
+                              double *z, double *dzdx, double *dzdy) {
+  double s = _plZScale(cam);
+  (void) cam;                          /* _plZScale() is 1 for float z */
+  _plFillPlane(f,face->Scrz[i0]*s,face->Scrz[i1]*s,face->Scrz[i2]*s,
+               z,dzdx,dzdy);
+}
+
+/* Runs code, adding the time it took to stage if the timers are on */
+#define _plTimeStage(ctx,stage,...) { \
+  if ((ctx)->stats.Timers) { \
+    double _t = _plTimer(); \
+    __VA_ARGS__; \
+    (ctx)->stats.StageTime[stage] += _plTimer() - _t; \
+  } else { __VA_ARGS__; } \
+}
+
+/* The context used by the plain plRender*() and plClip*() functions. Use
+   _plDefault() to get it, which points its TriStats at plRender_TriStats. */
+static pl_RenderContext _plDefaultCtx;
+
+static pl_RenderContext *_plDefault(void) {
+  if (!_plDefaultCtx.TriStats) _plDefaultCtx.TriStats = plRender_TriStats;
+  return &_plDefaultCtx;
+}
+
+static void _FindNormal(double x2, double x3,
+                        double y2, double y3,
+                        double zv,
+                        double *res);
+
+ /* Returns: 0 if nothing gets in,  1 or 2 if pout1 & pout2 get in */
+static pl_uInt _ClipToPlane(pl_RenderContext *ctx, pl_uInt numVerts,
+                            double *plane);
+
+/* Stores a projected face for plRenderEndCtx() to rasterize later. Returns
+   0 if out of memory. */
+static pl_Bool _plBinFace(pl_RenderContext *ctx, pl_Face *face);
+
+/* Returns 1 if a projected face is hidden between rows top and bottom-1,
+   otherwise marks its tiles (and their level 1 blocks, if level1 is set) as
+   drawn to and returns 0 */
+static pl_Bool _plHiZCullFace(pl_RenderContext *ctx, pl_Face *face,
+                              pl_sInt top, pl_sInt bottom, pl_Bool level1);
+
+PL_API void plClipSetFrustum(pl_Cam *cam) {
+  plClipSetFrustumCtx(_plDefault(),cam);
+}
+
+PL_API void plClipRenderFace(pl_Face *face) {
+  plClipRenderFaceCtx(_plDefault(),face);
+}
+
+PL_API pl_sInt plClipNeeded(pl_Face *face) {
+  return plClipNeededCtx(_plDefault(),face);
+}
+
+PL_API void plClipSetFrustumCtx(pl_RenderContext *ctx, pl_Cam *cam) {
+  double (*m_clipPlanes)[4] = ctx->clipPlanes;
+  double m_fov, m_adj_asp;
+  pl_uInt a;
+  m_adj_asp = ctx->adj_asp = 1.0 / cam->AspectRatio;
+  m_fov = plMin(plMax(cam->Fov,1.0),179.0);
+  m_fov = ctx->fov =
+    (1.0/tan(m_fov*(PL_PI/360.0)))*(double) (cam->ClipRight-cam->ClipLeft);
+  ctx->cx = cam->CenterX<<20;
+  ctx->cy = cam->CenterY<<20;
+  ctx->clipCam = cam;
+  memset(ctx->clipPlanes,0,sizeof(ctx->clipPlanes));
+
+  /* Back */
+  m_clipPlanes[0][2] = -1.0;
+  m_clipPlanes[0][3] = -cam->ClipBack;
+
+  /* Left */
+  m_clipPlanes[1][3] = 0.00000001;
+  if (cam->ClipLeft == cam->CenterX) {
+    m_clipPlanes[1][0] = 1.0;
+  }
+  else _FindNormal(-100,-100,
+                100, -100,
                 m_fov*-100.0/(cam->ClipLeft-cam->CenterX),
                 m_clipPlanes[1]);
   if (cam->ClipLeft > cam->CenterX) {
@@ -1407,12 +2533,18 @@ PL_API void plClipSetFrustum(pl_Cam *cam) {
     m_clipPlanes[4][1] = -m_clipPlanes[4][1];
     m_clipPlanes[4][2] = -m_clipPlanes[4][2];
   }
+  for (a = 0; a < NUM_CLIP_PLANES; a ++)
+    ctx->clipPlaneLen[a] = sqrt(m_clipPlanes[a][0]*m_clipPlanes[a][0] +
+                                m_clipPlanes[a][1]*m_clipPlanes[a][1] +
+                                m_clipPlanes[a][2]*m_clipPlanes[a][2]);
 }
 
-PL_API void plClipRenderFace(pl_Face *face) {
+PL_API void plClipRenderFaceCtx(pl_RenderContext *ctx, pl_Face *face) {
   pl_uInt k, a, w, numVerts, q;
+  pl_sInt32 y0, y1;
   double tmp, tmp2;
   pl_Face newface;
+  _clipInfo *m_cl = ctx->cl;
 
   for (a = 0; a < 3; a ++) {
     m_cl[0].newVertices[a] = *(face->Vertices[a]);
@@ -1425,11 +2557,11 @@ PL_API void plClipRenderFace(pl_Face *face) {
 
   numVerts = 3;
   q = 0;
-  a = (m_clipPlanes[0][3] < 0.0 ? 0 : 1);
+  a = (ctx->clipPlanes[0][3] < 0.0 ? 0 : 1);
   while (a < NUM_CLIP_PLANES && numVerts > 2)
   {
-    numVerts = _ClipToPlane(numVerts, m_clipPlanes[a]);
-    memcpy(&m_cl[0],&m_cl[1],sizeof(m_cl)/2);
+    numVerts = _ClipToPlane(ctx, numVerts, ctx->clipPlanes[a]);
+    memcpy(&m_cl[0],&m_cl[1],sizeof(ctx->cl)/2);
     a++;
   }
   if (numVerts > 2) {
@@ -1446,27 +2578,44 @@ PL_API void plClipRenderFace(pl_Face *face) {
         newface.eMappingU[a] = (pl_sInt32)m_cl[0].eMappingU[w];
         newface.eMappingV[a] = (pl_sInt32)m_cl[0].eMappingV[w];
         newface.Scrz[a] = 1.0f/newface.Vertices[a]->xformedz;
-        tmp2 = m_fov * newface.Scrz[a];
+        tmp2 = ctx->fov * newface.Scrz[a];
         tmp = tmp2*newface.Vertices[a]->xformedx;
         tmp2 *= newface.Vertices[a]->xformedy;
-        newface.Scrx[a] = m_cx + ((pl_sInt32)((tmp*(float) (1<<20))));
-        newface.Scry[a] = m_cy - ((pl_sInt32)((tmp2*m_adj_asp*(float) (1<<20))));
+        newface.Scrx[a] = ctx->cx + ((pl_sInt32)((tmp*(float) (1<<20))));
+        newface.Scry[a] = ctx->cy -
+          ((pl_sInt32)((tmp2*ctx->adj_asp*(float) (1<<20))));
+      }
+      if ((ctx->binHeight || ctx->visOn) && _plBinFace(ctx,&newface)) {
+        /* Drawn by plRenderEndCtx(). Those there was no memory to bin are
+           drawn now, with the clipping of the whole camera. */
+      } else if (ctx->hizOn && newface.Material->zBufferable &&
+               _plHiZCullFace(ctx,&newface,0,ctx->clipCam->ScreenHeight,1))
+        ctx->stats.OcclusionCulled ++;
+      else {
+        /* Triangles less than a row high draw nothing, and aren't binned
+           either, so leave them out of the counts */
+        _plFaceRows(&newface,y0,y1);
+        if (y1 > y0) ctx->clipCam->_Stats = ctx->stats.Fill;
+        _plTimeStage(ctx,PL_STAGE_RASTER,
+                     newface.Material->_PutFace(ctx->clipCam,&newface));
+        ctx->clipCam->_Stats = 0;
       }
-      newface.Material->_PutFace(m_cam,&newface);
-      plRender_TriStats[3] ++;
+      ctx->TriStats[3] ++;
     }
-    plRender_TriStats[2] ++;
-  }
+    ctx->TriStats[2] ++;
+  } else ctx->stats.FrustumCulled ++;
 }
 
-PL_API pl_sInt plClipNeeded(pl_Face *face) {
+PL_API pl_sInt plClipNeededCtx(pl_RenderContext *ctx, pl_Face *face) {
+  pl_Cam *m_cam = ctx->clipCam;
+  double m_fov = ctx->fov;
   double dr,dl,db,dt;
   double f;
   dr = (m_cam->ClipRight-m_cam->CenterX);
   dl = (m_cam->ClipLeft-m_cam->CenterX);
   db = (m_cam->ClipBottom-m_cam->CenterY);
   dt = (m_cam->ClipTop-m_cam->CenterY);
-  f = m_fov*m_adj_asp;
+  f = m_fov*ctx->adj_asp;
   return ((m_cam->ClipBack <= 0.0 ||
            face->Vertices[0]->xformedz <= m_cam->ClipBack ||
            face->Vertices[1]->xformedz <= m_cam->ClipBack ||
@@ -1496,11 +2645,13 @@ static void _FindNormal(double x2, double x3,double y2, double y3,
 }
 
 /* Returns: 0 if nothing gets in,  1 or 2 if pout1 & pout2 get in */
-static pl_uInt _ClipToPlane(pl_uInt numVerts, double *plane)
+static pl_uInt _ClipToPlane(pl_RenderContext *ctx, pl_uInt numVerts,
+                            double *plane)
 {
   pl_uInt i, nextvert, curin, nextin;
   double curdot, nextdot, scale;
   pl_uInt invert, outvert;
+  _clipInfo *m_cl = ctx->cl;
   invert = 0;
   outvert = 0;
   curdot = m_cl[0].newVertices[0].xformedx*plane[0] +
@@ -2063,7 +3214,13 @@ static void _plGeneratePhongTexturePalette(pl_Mat *, pl_Texture *);
 static void _plGeneratePhongTransparentPalette(pl_Mat *m);
 static void  _plGenerateTransparentPalette(pl_Mat *);
 static void _plSetMaterialPutFace(pl_Mat *m);
+static void _plPF_TexFEnv(pl_Cam *cam, pl_Face *TriFace);
+static void _plPF_TexGEnv(pl_Cam *cam, pl_Face *TriFace);
+static void _plPF_PTexFEnv(pl_Cam *cam, pl_Face *TriFace);
+static void _plPF_PTexGEnv(pl_Cam *cam, pl_Face *TriFace);
 static void _plMatSetupTransparent(pl_Mat *m, pl_uChar *pal);
+static void _plMatSetupRGB(pl_Mat *m);
+static void _plMatGetSource(pl_Mat *m, _pl_MatSource *src);
 
 PL_API pl_Mat *plMatCreate() {
   pl_Mat *m;
@@ -2086,12 +3243,17 @@ PL_API void plMatDelete(pl_Mat *m) {
   if (m) {
     if (m->_ReMapTable) free(m->_ReMapTable);
     if (m->_RequestedColors) free(m->_RequestedColors);
+    if (m->_RGBTable) free(m->_RGBTable);
     if (m->_AddTable) free(m->_AddTable);
     free(m);
   }
 }
 
 PL_API void plMatInit(pl_Mat *m) {
+  _pl_MatSource src;
+  pl_uChar *old;
+  pl_uInt oldColors, oldtsfact;
+  pl_uChar oldft;
   if (m->Shininess < 1) m->Shininess = 1;
   m->_ft = ((m->Environment ? PL_FILL_ENVIRONMENT : 0) |
            (m->Texture ? PL_FILL_TEXTURE : 0));
@@ -2102,6 +3264,22 @@ PL_API void plMatInit(pl_Mat *m) {
   if (m->_ft == (PL_FILL_TEXTURE|PL_FILL_ENVIRONMENT))
     m->_st = PL_SHADE_NONE;
 
+  /* Nothing the colors are made from changed, only the fill function can.
+     Textures can change in place, so their colors are always made again. */
+  _plMatGetSource(m,&src);
+  if (m->_RequestedColors && !(m->_ft & PL_FILL_TEXTURE) &&
+      !(m->_ft & PL_FILL_ENVIRONMENT) &&
+      !memcmp(&src,&m->_Source,sizeof(src))) {
+    _plSetMaterialPutFace(m);
+    return;
+  }
+  oldft = m->_Source.ft;
+  m->_Source = src;
+  old = m->_RequestedColors;
+  oldColors = m->_ColorsUsed;
+  oldtsfact = m->_tsfact;
+  m->_RequestedColors = 0;
+
   if (m->_ft == PL_FILL_SOLID) {
     if (m->_st == PL_SHADE_NONE) _plGenerateSinglePalette(m);
     else _plGeneratePhongPalette(m);
@@ -2119,9 +3297,42 @@ PL_API void plMatInit(pl_Mat *m) {
     if (m->_st == PL_SHADE_NONE) _plGenerateTransparentPalette(m);
     else _plGeneratePhongTransparentPalette(m);
   }
+
+  /* The same colors for the same fill as before, so _ReMapTable, _RGBTable
+     and the _AddTable of transparent materials still hold */
+  if (!old || !m->_RequestedColors || oldColors != m->_ColorsUsed ||
+      oldft != m->_ft || oldtsfact != m->_tsfact ||
+      memcmp(old,m->_RequestedColors,m->_ColorsUsed*3))
+    _plMatSetupRGB(m);
+  if (old) free(old);
   _plSetMaterialPutFace(m);
 }
 
+static void _plMatGetSource(pl_Mat *m, _pl_MatSource *src) {
+  memset(src,0,sizeof(_pl_MatSource));
+  src->ft = m->_ft;
+  src->shaded = m->_st != PL_SHADE_NONE;
+  memcpy(src->Ambient,m->Ambient,sizeof(src->Ambient));
+  memcpy(src->Diffuse,m->Diffuse,sizeof(src->Diffuse));
+  memcpy(src->Specular,m->Specular,sizeof(src->Specular));
+  src->Shininess = m->Shininess;
+  src->NumGradients = m->NumGradients;
+  src->Transparent = m->Transparent;
+}
+
+static void _plMatSetupRGB(pl_Mat *m) {
+  pl_uChar *c = m->_RequestedColors;
+  pl_uInt32 i;
+  if (m->_RGBTable) free(m->_RGBTable);
+  m->_RGBTable = 0;
+  if (!c) return;
+  m->_RGBTable = (pl_ARGB *) malloc(m->_ColorsUsed*sizeof(pl_ARGB));
+  if (!m->_RGBTable) return;
+  for (i = 0; i < m->_ColorsUsed; i ++, c += 3)
+    m->_RGBTable[i] = 0xFF000000 | ((pl_ARGB) c[0]<<16) |
+                      ((pl_ARGB) c[1]<<8) | c[2];
+}
+
 static void _plMatSetupTransparent(pl_Mat *m, pl_uChar *pal) {
   pl_uInt x, intensity;
   if (m->Transparent)
@@ -2137,35 +3348,214 @@ static void _plMatSetupTransparent(pl_Mat *m, pl_uChar *pal) {
   }
 }
 
+/* Inverse color map for plMatMapToPal(), kept for the last palette range it
+   was given. Each cell of a grid of colors lists, in order, the entries that
+   can be the nearest one to a color in it: those no farther from the cell
+   than the farthest corner of the cell is from the entry nearest to that.
+   The lists are made the first time a color falls in a cell, from the list
+   of the coarser cell around it, which is made from the whole palette. */
+#define _PL_PALMAP_COARSE_BITS 3
+#define _PL_PALMAP_BITS 5
+#define _PL_PALMAP_COARSE (1<<(3*_PL_PALMAP_COARSE_BITS))
+#define _PL_PALMAP_CELLS (_PL_PALMAP_COARSE + (1<<(3*_PL_PALMAP_BITS)))
+#define _plPalMapCellOf(r,g,b,bits) \
+  ((((r)>>(8-(bits)))<<(2*(bits))) | (((g)>>(8-(bits)))<<(bits)) | \
+   ((b)>>(8-(bits))))
+
+struct _pl_PalMap {
+  pl_uChar pal[768];
+  pl_sInt pstart, pend;
+  pl_Bool valid;
+  pl_uInt32 *cellStart;                /* Offset of the list of each cell,
+                                          the coarse ones first */
+  pl_uInt16 *cellCount;                /* Its length, 0 if not made yet */
+  pl_uChar *entries;                   /* The lists of all the cells */
+  pl_uInt32 numEntries, maxEntries;
+  pl_Bool distReady;
+  pl_uInt16 nearDist[(1<<_PL_PALMAP_COARSE_BITS)+(1<<_PL_PALMAP_BITS)][256];
+  pl_uInt16 farDist[(1<<_PL_PALMAP_COARSE_BITS)+(1<<_PL_PALMAP_BITS)][256];
+                                       /* Squared distance from each value
+                                          of a channel to the nearest and
+                                          farthest value in each row of
+                                          coarse, then fine cells */
+};
+
+/* The map used by plMatMapToPal() */
+static pl_PalMap _plPalMap;
+#ifdef PL_THREADS
+static pthread_mutex_t _plPalMapMutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+PL_API pl_PalMap *plPalMapCreate() {
+  return (pl_PalMap *) calloc(1,sizeof(pl_PalMap));
+}
+
+PL_API void plPalMapDelete(pl_PalMap *map) {
+  if (!map) {
+#ifdef PL_THREADS
+    pthread_mutex_lock(&_plPalMapMutex);
+#endif
+    free(_plPalMap.cellStart);
+    free(_plPalMap.cellCount);
+    free(_plPalMap.entries);
+    memset(&_plPalMap,0,sizeof(_plPalMap));
+#ifdef PL_THREADS
+    pthread_mutex_unlock(&_plPalMapMutex);
+#endif
+    return;
+  }
+  free(map->cellStart);
+  free(map->cellCount);
+  free(map->entries);
+  free(map);
+}
+
+/* Uses the map pm for pal, starting it afresh if the palette range changed.
+   Returns 0 if out of memory. */
+static pl_Bool _plPalMapSet(pl_PalMap *pm, pl_uChar *pal, pl_sInt pstart,
+                            pl_sInt pend) {
+  pl_uInt32 len = (pend+1-pstart)*3;
+  pl_sInt32 i, v, lo, hi, bits, a;
+  if (!pm->distReady) {
+    for (i = 0; i < (1<<_PL_PALMAP_COARSE_BITS)+(1<<_PL_PALMAP_BITS); i ++) {
+      bits = i < (1<<_PL_PALMAP_COARSE_BITS) ? _PL_PALMAP_COARSE_BITS :
+                                               _PL_PALMAP_BITS;
+      lo = (i < (1<<_PL_PALMAP_COARSE_BITS) ? i :
+            i-(1<<_PL_PALMAP_COARSE_BITS)) << (8-bits);
+      hi = lo + (1<<(8-bits)) - 1;
+      for (v = 0; v < 256; v ++) {
+        a = v < lo ? lo-v : v > hi ? v-hi : 0;
+        pm->nearDist[i][v] = (pl_uInt16) (a*a);
+        a = plMax(v-lo,hi-v);
+        pm->farDist[i][v] = (pl_uInt16) (a*a);
+      }
+    }
+    pm->distReady = 1;
+  }
+  if (pm->valid && pm->pstart == pstart &&
+      pm->pend == pend &&
+      !memcmp(pm->pal+pstart*3,pal+pstart*3,len)) return 1;
+  pm->valid = 0;
+  if (!pm->cellStart) {
+    pm->cellStart =
+      (pl_uInt32 *) malloc(_PL_PALMAP_CELLS*sizeof(pl_uInt32));
+    pm->cellCount =
+      (pl_uInt16 *) malloc(_PL_PALMAP_CELLS*sizeof(pl_uInt16));
+    if (!pm->cellStart || !pm->cellCount) {
+      free(pm->cellStart);
+      free(pm->cellCount);
+      pm->cellStart = 0;
+      pm->cellCount = 0;
+      return 0;
+    }
+  }
+  memset(pm->cellCount,0,_PL_PALMAP_CELLS*sizeof(pl_uInt16));
+  memcpy(pm->pal+pstart*3,pal+pstart*3,len);
+  pm->pstart = pstart;
+  pm->pend = pend;
+  pm->numEntries = 0;
+  pm->valid = 1;
+  return 1;
+}
+
+/* Makes the list of cell index, which is cell of a grid with bits per
+   channel, out of the list of cell from, or of the whole palette if from is
+   -1. Returns 0 if out of memory. */
+static pl_Bool _plPalMapCell(pl_PalMap *pm, pl_uInt32 index, pl_uInt32 cell,
+                             pl_uInt bits, pl_sInt32 from) {
+  pl_sInt32 dmin[256], d, bound = 0x7FFFFFFF;
+  pl_sInt k, c, n;
+  pl_uInt32 max;
+  pl_uInt16 *nd[3], *fd[3];
+  pl_uChar *p, *e, *list = 0;
+  n = from < 0 ? pm->pend+1-pm->pstart : pm->cellCount[from];
+  if (pm->numEntries + n > pm->maxEntries) {
+    max = plMax(pm->maxEntries*2,1<<(3*_PL_PALMAP_BITS));
+    e = (pl_uChar *) realloc(pm->entries,max);
+    if (!e) return 0;
+    pm->entries = e;
+    pm->maxEntries = max;
+  }
+  if (from >= 0) list = pm->entries + pm->cellStart[from];
+  for (c = 0; c < 3; c ++) {
+    d = (cell>>((2-c)*bits))&((1<<bits)-1);
+    if (bits != _PL_PALMAP_COARSE_BITS) d += 1<<_PL_PALMAP_COARSE_BITS;
+    nd[c] = pm->nearDist[d];
+    fd[c] = pm->farDist[d];
+  }
+  for (k = 0; k < n; k ++) {
+    p = pm->pal + (pm->pstart + (list ? list[k] : k))*3;
+    dmin[k] = nd[0][p[0]] + nd[1][p[1]] + nd[2][p[2]];
+    d = fd[0][p[0]] + fd[1][p[1]] + fd[2][p[2]];
+    if (d < bound) bound = d;
+  }
+  e = pm->entries + pm->numEntries;
+  for (k = 0; k < n; k ++)
+    if (dmin[k] <= bound) *e++ = list ? list[k] : (pl_uChar) k;
+  pm->cellStart[index] = pm->numEntries;
+  pm->cellCount[index] =
+    (pl_uInt16) (e - pm->entries - pm->numEntries);
+  pm->numEntries += pm->cellCount[index];
+  return 1;
+}
+
 PL_API void plMatMapToPal(pl_Mat *m, pl_uChar *pal, pl_sInt pstart, pl_sInt pend) {
+  plMatMapToPalMap(0,m,pal,pstart,pend);
+}
+
+PL_API void plMatMapToPalMap(pl_PalMap *map, pl_Mat *m, pl_uChar *pal,
+                             pl_sInt pstart, pl_sInt pend) {
+  pl_PalMap *pm = map ? map : &_plPalMap;
   pl_sInt32 j, r, g, b, bestdiff, r2, g2, b2;
-  pl_sInt bestpos,k;
-  pl_uInt32 i;
-  pl_uChar *p;
+  pl_sInt bestpos, k, n;
+  pl_uInt32 i, cell, coarse;
+  pl_uChar *p, *e, all[256];
+  pl_Bool cached;
   if (!m->_RequestedColors) plMatInit(m);
   if (!m->_RequestedColors) return;
   if (m->_ReMapTable) free(m->_ReMapTable);
   m->_ReMapTable = (pl_uChar *) malloc(m->_ColorsUsed);
+  for (k = 0; k < 256; k ++) all[k] = (pl_uChar) k;
+#ifdef PL_THREADS
+  if (!map) pthread_mutex_lock(&_plPalMapMutex);
+#endif
+  cached = pend >= pstart && _plPalMapSet(pm,pal,pstart,pend);
   for (i = 0; i < m->_ColorsUsed; i ++) {
     bestdiff = 1000000000;
     bestpos = pstart;
     r = m->_RequestedColors[i*3];
     g = m->_RequestedColors[i*3+1];
     b = m->_RequestedColors[i*3+2];
-    p = pal + pstart*3;
-    for (k = pstart; k <= (pl_sInt)pend; k ++) {
+    coarse = _plPalMapCellOf(r,g,b,_PL_PALMAP_COARSE_BITS);
+    cell = _plPalMapCellOf(r,g,b,_PL_PALMAP_BITS);
+    if (cached && (pm->cellCount[_PL_PALMAP_COARSE+cell] ||
+                   ((pm->cellCount[coarse] ||
+                     _plPalMapCell(pm,coarse,coarse,
+                                   _PL_PALMAP_COARSE_BITS,-1)) &&
+                    _plPalMapCell(pm,_PL_PALMAP_COARSE+cell,cell,
+                                  _PL_PALMAP_BITS,coarse)))) {
+      e = pm->entries + pm->cellStart[_PL_PALMAP_COARSE+cell];
+      n = pm->cellCount[_PL_PALMAP_COARSE+cell];
+    } else {
+      e = all;
+      n = pend+1-pstart;
+    }
+    for (k = 0; k < n; k ++) {
+      p = pal + (pstart+e[k])*3;
       r2 = p[0] - r;
       g2 = p[1] - g;
       b2 = p[2] - b;
-      p += 3;
       j = r2*r2+g2*g2+b2*b2;
       if (j < bestdiff) {
         bestdiff = j;
-        bestpos = k;
+        bestpos = pstart+e[k];
       }
     }
     m->_ReMapTable[i] = bestpos;
   }
+#ifdef PL_THREADS
+  if (!map) pthread_mutex_unlock(&_plPalMapMutex);
+#endif
   _plMatSetupTransparent(m,pal);
 }
 
@@ -2346,6 +3736,7 @@ static void  _plGenerateTransparentPalette(pl_Mat *m) {
 }
 
 static void _plSetMaterialPutFace(pl_Mat *m) {
+  pl_Bool env;
   m->_PutFace = 0;
   switch (m->_ft) {
     case PL_FILL_TRANSPARENT: switch(m->_st) {
@@ -2372,24 +3763,25 @@ static void _plSetMaterialPutFace(pl_Mat *m) {
     break;
     case PL_FILL_ENVIRONMENT:
     case PL_FILL_TEXTURE:
+      env = m->_ft == PL_FILL_ENVIRONMENT;
       if (m->PerspectiveCorrect) switch (m->_st) {
         case PL_SHADE_NONE: case PL_SHADE_FLAT:
         case PL_SHADE_FLAT_DISTANCE: case PL_SHADE_FLAT_DISTANCE|PL_SHADE_FLAT:
-          m->_PutFace = plPF_PTexF;
+          m->_PutFace = env ? _plPF_PTexFEnv : plPF_PTexF;
         break;
         case PL_SHADE_GOURAUD: case PL_SHADE_GOURAUD_DISTANCE:
         case PL_SHADE_GOURAUD|PL_SHADE_GOURAUD_DISTANCE:
-          m->_PutFace = plPF_PTexG;
+          m->_PutFace = env ? _plPF_PTexGEnv : plPF_PTexG;
         break;
       }
       else switch (m->_st) {
         case PL_SHADE_NONE: case PL_SHADE_FLAT:
         case PL_SHADE_FLAT_DISTANCE: case PL_SHADE_FLAT_DISTANCE|PL_SHADE_FLAT:
-          m->_PutFace = plPF_TexF;
+          m->_PutFace = env ? _plPF_TexFEnv : plPF_TexF;
         break;
         case PL_SHADE_GOURAUD: case PL_SHADE_GOURAUD_DISTANCE:
         case PL_SHADE_GOURAUD|PL_SHADE_GOURAUD_DISTANCE:
-          m->_PutFace = plPF_TexG;
+          m->_PutFace = env ? _plPF_TexGEnv : plPF_TexG;
         break;
       }
     break;
@@ -2399,105 +3791,172 @@ static void _plSetMaterialPutFace(pl_Mat *m) {
   }
 }
 
-typedef struct __ct {
-  pl_uChar r,g,b;
-  pl_Bool visited;
-  struct __ct *next;
-} _ct;
+/* A distinct color requested of plMatMakeOptPal(), and how many times */
+typedef struct {
+  pl_uChar c[3];
+  pl_uInt32 w;
+} _plOptColor;
+
+/* A box of colors, colors[start..start+n) in plMatMakeOptPal(), with their
+   total weight, weighted sums and sum of squares, and squared error */
+typedef struct {
+  pl_uInt32 start, n;
+  double w, s[3], q, err;
+} _plOptBox;
+
+/* Sums of the colors of a box with each value of each channel */
+typedef struct {
+  double w[3][256], s[3][256][3], q[3][256];
+} _plOptHist;
+
+static void _plOptBoxError(_plOptBox *b) {
+  b->err = b->w > 0 ? b->q - (b->s[0]*b->s[0] + b->s[1]*b->s[1] +
+                              b->s[2]*b->s[2])/b->w : 0;
+}
 
-static int mdist(_ct *a, _ct *b) {
-  return ((a->r-b->r)*(a->r-b->r)+(a->g-b->g)*(a->g-b->g)+(a->b-b->b)*(a->b-b->b));
+/* Cuts a box in two along the channel and value that leaves the least
+   squared error, into b and the box at nb. Returns 0 if it has a single
+   color. */
+static pl_Bool _plOptSplit(_plOptColor *colors, _plOptBox *b, _plOptBox *nb,
+                           _plOptHist *h) {
+  pl_uInt32 i, j;
+  pl_sInt a, v, k, bestA = -1, bestV = 0;
+  double w, s[3], q, e, best = 0;
+  _plOptColor *c, t;
+  memset(h,0,sizeof(_plOptHist));
+  for (i = 0; i < b->n; i ++) {
+    c = colors + b->start + i;
+    q = c->w*((double) c->c[0]*c->c[0] + (double) c->c[1]*c->c[1] +
+              (double) c->c[2]*c->c[2]);
+    for (a = 0; a < 3; a ++) {
+      v = c->c[a];
+      h->w[a][v] += c->w;
+      for (k = 0; k < 3; k ++) h->s[a][v][k] += (double) c->w*c->c[k];
+      h->q[a][v] += q;
+    }
+  }
+  for (a = 0; a < 3; a ++) {
+    w = q = s[0] = s[1] = s[2] = 0;
+    for (v = 0; v < 255; v ++) {
+      w += h->w[a][v];
+      for (k = 0; k < 3; k ++) s[k] += h->s[a][v][k];
+      q += h->q[a][v];
+      if (w <= 0) continue;
+      if (w >= b->w) break;
+      e = q - (s[0]*s[0] + s[1]*s[1] + s[2]*s[2])/w + (b->q - q) -
+          ((b->s[0]-s[0])*(b->s[0]-s[0]) + (b->s[1]-s[1])*(b->s[1]-s[1]) +
+           (b->s[2]-s[2])*(b->s[2]-s[2]))/(b->w - w);
+      if (bestA < 0 || e < best) { best = e; bestA = a; bestV = v; }
+    }
+  }
+  if (bestA < 0) return 0;
+
+  /* Colors up to bestV stay in b, the rest go to nb */
+  *nb = *b;
+  b->w = b->q = b->s[0] = b->s[1] = b->s[2] = 0;
+  for (i = j = 0; i < nb->n; i ++) {
+    c = colors + nb->start + i;
+    if (c->c[bestA] > bestV) continue;
+    b->w += c->w;
+    b->q += c->w*((double) c->c[0]*c->c[0] + (double) c->c[1]*c->c[1] +
+                  (double) c->c[2]*c->c[2]);
+    for (k = 0; k < 3; k ++) b->s[k] += (double) c->w*c->c[k];
+    t = colors[nb->start + j];
+    colors[nb->start + j++] = *c;
+    *c = t;
+  }
+  b->n = j;
+  nb->start += j;
+  nb->n -= j;
+  nb->w -= b->w;
+  nb->q -= b->q;
+  for (k = 0; k < 3; k ++) nb->s[k] -= b->s[k];
+  _plOptBoxError(b);
+  _plOptBoxError(nb);
+  return 1;
 }
 
 PL_API void plMatMakeOptPal(pl_uChar *p, pl_sInt pstart,
                      pl_sInt pend, pl_Mat **materials, pl_sInt nmats) {
-  pl_uChar *allColors = 0;
-  pl_sInt numColors = 0, nc, x;
-  pl_sInt len = pend + 1 - pstart;
-  pl_sInt32 current, newnext, bestdist, thisdist;
-  _ct *colorBlock, *best, *cp;
-
-  for (x = 0; x < nmats; x ++) {
+  pl_uInt32 *buf, *keys, *tmp, *sw, numColors = 0, numUnique, i, j, x;
+  pl_uInt32 count[256];
+  pl_sInt len = pend + 1 - pstart, nb, b, best, pass;
+  pl_uChar *rc;
+  _plOptColor *colors;
+  _plOptBox *boxes;
+  _plOptHist *hist;
+
+  for (x = 0; x < (pl_uInt32) nmats; x ++) {
     if (materials[x]) {
       if (!materials[x]->_RequestedColors) plMatInit(materials[x]);
       if (materials[x]->_RequestedColors) numColors+=materials[x]->_ColorsUsed;
     }
   }
-  if (!numColors) return;
-
-  allColors=(pl_uChar*)malloc(numColors*3);
-  numColors=0;
-
-  for (x = 0; x < nmats; x ++) {
-    if (materials[x]) {
-      if (materials[x]->_RequestedColors)
-        memcpy(allColors + (numColors*3), materials[x]->_RequestedColors,
-             materials[x]->_ColorsUsed*3);
-      numColors += materials[x]->_ColorsUsed;
-    }
-  }
-
-  if (numColors <= len) {
-    memcpy(p+pstart*3,allColors,numColors*3);
-    free(allColors);
+  if (!numColors || len < 1) return;
+
+  /* Sort the colors as 24 bit keys, a byte per pass, to count each one */
+  keys = buf = (pl_uInt32 *) malloc(numColors*2*sizeof(pl_uInt32));
+  if (!buf) return;
+  tmp = buf + numColors;
+  for (i = x = 0; x < (pl_uInt32) nmats; x ++) {
+    if (!materials[x] || !materials[x]->_RequestedColors) continue;
+    rc = materials[x]->_RequestedColors;
+    for (j = 0; j < materials[x]->_ColorsUsed; j ++, rc += 3)
+      keys[i++] = ((pl_uInt32) rc[0]<<16) | ((pl_uInt32) rc[1]<<8) | rc[2];
+  }
+  for (pass = 0; pass < 24; pass += 8) {
+    memset(count,0,sizeof(count));
+    for (i = 0; i < numColors; i ++) count[(keys[i]>>pass)&0xFF]++;
+    for (i = j = 0; i < 256; i ++) { x = count[i]; count[i] = j; j += x; }
+    for (i = 0; i < numColors; i ++) tmp[count[(keys[i]>>pass)&0xFF]++] = keys[i];
+    sw = keys; keys = tmp; tmp = sw;
+  }
+
+  colors = (_plOptColor *) malloc(numColors*sizeof(_plOptColor));
+  if (!colors) { free(buf); return; }
+  for (i = numUnique = 0; i < numColors; i ++) {
+    if (i && keys[i] == keys[i-1]) { colors[numUnique-1].w++; continue; }
+    colors[numUnique].c[0] = (pl_uChar) (keys[i]>>16);
+    colors[numUnique].c[1] = (pl_uChar) (keys[i]>>8);
+    colors[numUnique].c[2] = (pl_uChar) keys[i];
+    colors[numUnique++].w = 1;
+  }
+  free(buf);
+
+  if (numUnique <= (pl_uInt32) len) {
+    for (i = 0; i < numUnique; i ++)
+      memcpy(p + (pstart+i)*3,colors[i].c,3);
+    free(colors);
     return;
   }
 
-  colorBlock = (_ct *) malloc(sizeof(_ct)*numColors);
-  for (x = 0; x < numColors; x++) {
-    colorBlock[x].r = allColors[x*3];
-    colorBlock[x].g = allColors[x*3+1];
-    colorBlock[x].b = allColors[x*3+2];
-    colorBlock[x].visited = 0;
-    colorBlock[x].next = 0;
-  }
-  free(allColors);
-
-  /* Build a list, starting at color 0 */
-  current = 0;
-  nc = numColors;
-  do {
-    newnext = -1;
-    bestdist = 300000000;
-    colorBlock[current].visited = 1;
-    for (x = 0; x < nc; x ++) {
-      if (!colorBlock[x].visited) {
-        thisdist = mdist(colorBlock + x, colorBlock + current);
-        if (thisdist < 5) { colorBlock[x].visited = 1; numColors--; }
-        else if (thisdist < bestdist) { bestdist = thisdist; newnext = x; }
-      }
-    }
-    if (newnext != -1) {
-      colorBlock[current].next = colorBlock + newnext;
-      current = newnext;
-    }
-  } while (newnext != -1);
-  colorBlock[current].next = 0; /* terminate the list */
-
-  /* we now have a linked list starting at colorBlock, which is each one and
-     it's closest neighbor */
-
-  while (numColors > len) {
-    bestdist = mdist(colorBlock,colorBlock->next);
-    for (best = cp = colorBlock; cp->next; cp = cp->next) {
-      if (bestdist > (thisdist = mdist(cp,cp->next))) {
-        best = cp;
-        bestdist = thisdist;
-      }
-    }
-    best->r = ((int) best->r + (int) best->next->r)>>1;
-    best->g = ((int) best->g + (int) best->next->g)>>1;
-    best->b = ((int) best->b + (int) best->next->b)>>1;
-    best->next = best->next->next;
-    numColors--;
-  }
-  x = pstart*3;
-  for (cp = colorBlock; cp; cp = cp->next) {
-    p[x++] = cp->r;
-    p[x++] = cp->g;
-    p[x++] = cp->b;
-  }
-  free(colorBlock);
+  /* Median cut: split the box with the most squared error until there are
+     len of them, then use the mean color of each */
+  boxes = (_plOptBox *) malloc(len*sizeof(_plOptBox));
+  hist = (_plOptHist *) malloc(sizeof(_plOptHist));
+  if (!boxes || !hist) { free(boxes); free(hist); free(colors); return; }
+  memset(boxes,0,sizeof(_plOptBox));
+  boxes[0].n = numUnique;
+  for (i = 0; i < numUnique; i ++) {
+    boxes[0].w += colors[i].w;
+    boxes[0].q += colors[i].w*((double) colors[i].c[0]*colors[i].c[0] +
+                               (double) colors[i].c[1]*colors[i].c[1] +
+                               (double) colors[i].c[2]*colors[i].c[2]);
+    for (j = 0; j < 3; j ++) boxes[0].s[j] += (double) colors[i].w*colors[i].c[j];
+  }
+  _plOptBoxError(boxes);
+  for (nb = 1; nb < len; nb ++) {
+    for (best = -1, b = 0; b < nb; b ++)
+      if (boxes[b].n > 1 && (best < 0 || boxes[b].err > boxes[best].err))
+        best = b;
+    if (best < 0 || !_plOptSplit(colors,boxes+best,boxes+nb,hist)) break;
+  }
+  for (b = 0; b < nb; b ++)
+    for (j = 0; j < 3; j ++)
+      p[(pstart+b)*3+j] = (pl_uChar) (boxes[b].s[j]/boxes[b].w + 0.5);
+  free(hist);
+  free(boxes);
+  free(colors);
 }
 
 PL_API void plMatrixRotate(pl_Float matrix[], pl_uChar m, pl_Float Deg) {
@@ -2558,12 +4017,54 @@ PL_API void plNormalizeVector(pl_Float *x, pl_Float *y, pl_Float *z) {
   } else *x = *y = *z = 0.0;
 }
 
+static void _plObjFillBounds(pl_Obj *o) {
+  pl_uInt32 i;
+  pl_Vertex *v = o->Vertices;
+  double dx, dy, dz, r = 0.0;
+  if (!o->NumVertices) {
+    o->BoundRadius = -1.0;
+    return;
+  }
+  o->BoundMin[0] = o->BoundMax[0] = v->x;
+  o->BoundMin[1] = o->BoundMax[1] = v->y;
+  o->BoundMin[2] = o->BoundMax[2] = v->z;
+  for (i = 1; i < o->NumVertices; i ++) {
+    v++;
+    if (v->x < o->BoundMin[0]) o->BoundMin[0] = v->x;
+    if (v->x > o->BoundMax[0]) o->BoundMax[0] = v->x;
+    if (v->y < o->BoundMin[1]) o->BoundMin[1] = v->y;
+    if (v->y > o->BoundMax[1]) o->BoundMax[1] = v->y;
+    if (v->z < o->BoundMin[2]) o->BoundMin[2] = v->z;
+    if (v->z > o->BoundMax[2]) o->BoundMax[2] = v->z;
+  }
+  for (i = 0; i < 3; i ++)
+    o->BoundCenter[i] = (o->BoundMin[i]+o->BoundMax[i])*0.5f;
+  v = o->Vertices;
+  for (i = 0; i < o->NumVertices; i ++) {
+    dx = v->x-o->BoundCenter[0];
+    dy = v->y-o->BoundCenter[1];
+    dz = v->z-o->BoundCenter[2];
+    if (dx*dx+dy*dy+dz*dz > r) r = dx*dx+dy*dy+dz*dz;
+    v++;
+  }
+  o->BoundRadius = (pl_Float) sqrt(r);
+}
+
+PL_API pl_Obj *plObjCalcBounds(pl_Obj *o) {
+  pl_uInt i;
+  _plObjFillBounds(o);
+  for (i = 0; i < PL_MAX_CHILDREN; i ++)
+    if (o->Children[i]) plObjCalcBounds(o->Children[i]);
+  return o;
+}
+
 PL_API pl_Obj *plObjScale(pl_Obj *o, pl_Float s) {
   pl_uInt32 i = o->NumVertices;
   pl_Vertex *v = o->Vertices;
   while (i--) {
     v->x *= s; v->y *= s; v->z *= s; v++;
   }
+  _plObjFillBounds(o);
   for (i = 0; i < PL_MAX_CHILDREN; i ++)
     if (o->Children[i]) plObjScale(o->Children[i],s);
   return o;
@@ -2575,6 +4076,7 @@ PL_API pl_Obj *plObjStretch(pl_Obj *o, pl_Float x, pl_Float y, pl_Float z) {
   while (i--) {
     v->x *= x; v->y *= y; v->z *= z; v++;
   }
+  _plObjFillBounds(o);
   for (i = 0; i < PL_MAX_CHILDREN; i ++)
     if (o->Children[i]) plObjStretch(o->Children[i],x,y,z);
   return o;
@@ -2586,6 +4088,7 @@ PL_API pl_Obj *plObjTranslate(pl_Obj *o, pl_Float x, pl_Float y, pl_Float z) {
   while (i--) {
     v->x += x; v->y += y; v->z += z; v++;
   }
+  _plObjFillBounds(o);
   return o;
 }
 
@@ -2623,6 +4126,7 @@ PL_API pl_Obj *plObjCreate(pl_uInt32 nv, pl_uInt32 nf) {
   memset(o,0,sizeof(pl_Obj));
   o->GenMatrix = 1;
   o->BackfaceCull = 1;
+  o->BoundRadius = -1.0;
   o->NumVertices = nv;
   o->NumFaces = nf;
   if (nv && !(o->Vertices=(pl_Vertex *) malloc(sizeof(pl_Vertex)*nv))) {
@@ -2651,6 +4155,10 @@ PL_API pl_Obj *plObjClone(pl_Obj *o) {
   out->BackfaceCull = o->BackfaceCull;
   out->BackfaceIllumination = o->BackfaceIllumination;
   out->GenMatrix = o->GenMatrix;
+  memcpy(out->BoundMin, o->BoundMin, sizeof(o->BoundMin));
+  memcpy(out->BoundMax, o->BoundMax, sizeof(o->BoundMax));
+  memcpy(out->BoundCenter, o->BoundCenter, sizeof(o->BoundCenter));
+  out->BoundRadius = o->BoundRadius;
   memcpy(out->Vertices, o->Vertices, sizeof(pl_Vertex) * o->NumVertices);
   iff = o->Faces;
   of = out->Faces;
@@ -2725,176 +4233,763 @@ PL_API void plObjCalcNormals(pl_Obj *obj) {
     plNormalizeVector(&v->nx, &v->ny, &v->nz);
     v++;
   } while (--i);
+  _plObjFillBounds(obj);
   for (i = 0; i < PL_MAX_CHILDREN; i ++)
     if (obj->Children[i]) plObjCalcNormals(obj->Children[i]);
 }
 
-PL_API void plPF_PTexF(pl_Cam *cam, pl_Face *TriFace) {
-  pl_uChar i0, i1, i2;
-  pl_uChar *gmem = cam->frameBuffer;
-  pl_uChar *remap = TriFace->Material->_ReMapTable;
-  pl_ZBuffer *zbuf = cam->zBuffer;
-  pl_Float MappingU1, MappingU2, MappingU3;
-  pl_Float MappingV1, MappingV2, MappingV3;
-  pl_sInt32 MappingU_AND, MappingV_AND;
-  pl_uChar *texture;
-  pl_uChar vshift;
-  pl_uInt16 bc;
-  pl_Texture *Texture;
-  pl_sInt32 iShade;
+/* Number of bits set in the low 16 bits of x */
+#define _plBits16(x) { \
+  (x) = ((x) & 0x5555) + (((x) >> 1) & 0x5555); \
+  (x) = ((x) & 0x3333) + (((x) >> 2) & 0x3333); \
+  (x) = ((x) & 0x0F0F) + (((x) >> 4) & 0x0F0F); \
+  (x) = ((x) & 0x00FF) + ((x) >> 8); \
+}
 
-  pl_uChar nm, nmb;
-  pl_sInt n;
-  pl_Float U1,V1,U2,V2,dU1=0,dU2=0,dV1=0,dV2=0,dUL=0,dVL=0,UL,VL;
-  pl_sInt32 iUL, iVL, idUL=0, idVL=0, iULnext, iVLnext;
+/* Shade c (16.16) for pixel i of a span, clamped to the colors of a
+   material, as a color index */
+#define _plSpanShade(c,dc,i,maxColor) \
+  (plMin(plMax((c)+(pl_sInt32) (i)*(dc),0),(maxColor))>>16)
 
-  pl_sInt32 scrwidth = cam->ScreenWidth;
-  pl_sInt32 X1, X2, dX1=0, dX2=0, XL1, Xlen;
-  pl_ZBuffer Z1, dZ1=0, dZ2=0, Z2, dZL=0, ZL, pZL, pdZL;
-  pl_sInt32 Y1, Y2, Y0, dY;
-  pl_uChar stat;
+/*
+** Span kernels of plPF_SolidF() and plPF_SolidG(). Pixel i of a span of n
+** gets a z of z+i*dz rather than adding dz up pixel by pixel, so that the
+** SIMD versions, 16 pixels at a time, give the same results as the plain C
+** tail. The z-buffered ones return the number of pixels that passed the
+** z test.
+*/
+#ifdef _PL_SSE2
+/* The z values z+fi*dz of 4 pixels, as ints like _plZ() for the fixed point
+   formats */
+#if PL_ZBUFFER_BITS == 32
+#define _PL_SPAN_ZV4(vz,vdz,fi) _mm_add_ps((vz),_mm_mul_ps((fi),(vdz)))
+#else
+#define _PL_SPAN_ZV4(vz,vdz,fi) _mm_cvttps_epi32(_mm_min_ps( \
+  _mm_add_ps((vz),_mm_mul_ps((fi),(vdz))),_mm_set1_ps((pl_Float) _PL_ZMAX)))
+#endif
 
-  pl_Bool zb = (zbuf&&TriFace->Material->zBufferable) ? 1 : 0;
+#if PL_ZBUFFER_BITS == 16
+/* Tests 8 z values z+fi*dz against zbuf, writing those that pass, and sets
+   the 16 bit mask m to the result. SSE2 only compares signed, so the values
+   are compared with their top bit flipped. */
+#define _PL_SPAN_Z8(zbuf,vz,vdz,fi,m) { \
+  __m128i _f = _mm_set1_epi16(-32768), _b = _mm_set1_epi32(32768); \
+  __m128i _z = _mm_packs_epi32(_mm_sub_epi32(_PL_SPAN_ZV4(vz,vdz,fi),_b), \
+    _mm_sub_epi32(_PL_SPAN_ZV4(vz,vdz,_mm_add_ps((fi),_mm_set1_ps(4.0f))), \
+                  _b)); \
+  __m128i _o = _mm_xor_si128(_mm_loadu_si128((__m128i *) (zbuf)),_f); \
+  m = _mm_cmpgt_epi16(_z,_o); \
+  _mm_storeu_si128((__m128i *) (zbuf),_mm_xor_si128(_f, \
+    _mm_or_si128(_mm_and_si128(m,_z),_mm_andnot_si128(m,_o)))); \
+}
 
-  if (TriFace->Material->Environment) Texture = TriFace->Material->Environment;
-  else Texture = TriFace->Material->Texture;
+/* Tests 16 z values from zbuf+i, and packs the results into the byte mask
+   m. fi holds the lane indices as floats, and moves on by 16. */
+#define _PL_SPAN_Z16(zbuf,i,vz,vdz,fi,m) { \
+  __m128i _m0, _m1; \
+  __m128 _8 = _mm_set1_ps(8.0f); \
+  _PL_SPAN_Z8((zbuf)+(i),vz,vdz,fi,_m0); fi = _mm_add_ps(fi,_8); \
+  _PL_SPAN_Z8((zbuf)+(i)+8,vz,vdz,fi,_m1); fi = _mm_add_ps(fi,_8); \
+  m = _mm_packs_epi16(_m0,_m1); \
+}
+#else
+/* Tests 4 z values z+fi*dz against zbuf, writing those that pass, and
+   sets the mask m to the result */
+#if PL_ZBUFFER_BITS == 24
+#define _PL_SPAN_Z4(zbuf,vz,vdz,fi,m) { \
+  __m128i _z = _PL_SPAN_ZV4(vz,vdz,fi); \
+  __m128i _o = _mm_loadu_si128((__m128i *) (zbuf)); \
+  m = _mm_cmpgt_epi32(_z,_o); \
+  _mm_storeu_si128((__m128i *) (zbuf), \
+    _mm_or_si128(_mm_and_si128(m,_z),_mm_andnot_si128(m,_o))); \
+}
+#else
+#define _PL_SPAN_Z4(zbuf,vz,vdz,fi,m) { \
+  __m128 _z = _PL_SPAN_ZV4(vz,vdz,fi); \
+  __m128 _o = _mm_loadu_ps(zbuf); \
+  __m128 _m = _mm_cmplt_ps(_o,_z); \
+  _mm_storeu_ps((zbuf),_mm_or_ps(_mm_and_ps(_m,_z),_mm_andnot_ps(_m,_o))); \
+  m = _mm_castps_si128(_m); \
+}
+#endif
 
-  if (!Texture) return;
-  texture = Texture->Data;
-  iShade = (pl_sInt32)(TriFace->fShade*256.0);
-  if (iShade < 0) iShade=0;
-  if (iShade > 255) iShade=255;
+/* Tests 16 z values from zbuf+i, and packs the results into the byte mask
+   m. fi holds the lane indices as floats, and moves on by 16. */
+#define _PL_SPAN_Z16(zbuf,i,vz,vdz,fi,m) { \
+  __m128i _m0, _m1, _m2, _m3; \
+  __m128 _4 = _mm_set1_ps(4.0f); \
+  _PL_SPAN_Z4((zbuf)+(i),vz,vdz,fi,_m0); fi = _mm_add_ps(fi,_4); \
+  _PL_SPAN_Z4((zbuf)+(i)+4,vz,vdz,fi,_m1); fi = _mm_add_ps(fi,_4); \
+  _PL_SPAN_Z4((zbuf)+(i)+8,vz,vdz,fi,_m2); fi = _mm_add_ps(fi,_4); \
+  _PL_SPAN_Z4((zbuf)+(i)+12,vz,vdz,fi,_m3); fi = _mm_add_ps(fi,_4); \
+  m = _mm_packs_epi16(_mm_packs_epi32(_m0,_m1),_mm_packs_epi32(_m2,_m3)); \
+}
+#endif
 
-  if (!TriFace->Material->_AddTable) bc=0;
-  else bc = TriFace->Material->_AddTable[iShade];
-  nm = TriFace->Material->PerspectiveCorrect;
-  nmb = 0; while (nm) { nmb++; nm >>= 1; }
-  nmb = plMin(6,nmb);
-  nm = 1<<nmb;
-  MappingV_AND = ((1<<Texture->Height)-1)<<Texture->Width;
-  MappingU_AND = (1<<Texture->Width)-1;
-  vshift = 16 - Texture->Width;
+/* Writes the 16 colors c to gmem where the byte mask m is set */
+#define _PL_SPAN_MERGE16(gmem,c,m) \
+  _mm_storeu_si128((__m128i *) (gmem), _mm_or_si128(_mm_and_si128((m),(c)), \
+    _mm_andnot_si128((m),_mm_loadu_si128((__m128i *) (gmem)))))
+#endif
 
-  if (TriFace->Material->Environment) {
-    PUTFACE_SORT_ENV();
-  } else {
-    PUTFACE_SORT_TEX();
-  }
+#ifdef _PL_AVX2
+/* _PL_SPAN_ZV4() for 8 pixels */
+#if PL_ZBUFFER_BITS == 32
+#define _PL_SPAN_ZV8(vz,vdz,fi) _mm256_add_ps((vz),_mm256_mul_ps((fi),(vdz)))
+#else
+#define _PL_SPAN_ZV8(vz,vdz,fi) _mm256_cvttps_epi32(_mm256_min_ps( \
+  _mm256_add_ps((vz),_mm256_mul_ps((fi),(vdz))), \
+  _mm256_set1_ps((pl_Float) _PL_ZMAX)))
+#endif
 
-  MappingU1 *= TriFace->Scrz[i0]/65536.0f;
-  MappingV1 *= TriFace->Scrz[i0]/65536.0f;
-  MappingU2 *= TriFace->Scrz[i1]/65536.0f;
-  MappingV2 *= TriFace->Scrz[i1]/65536.0f;
-  MappingU3 *= TriFace->Scrz[i2]/65536.0f;
-  MappingV3 *= TriFace->Scrz[i2]/65536.0f;
+/* _PL_SPAN_Z16() with 8 pixel vectors, leaving the results as 16 bit masks
+   in p. The packs work within 128 bit lanes, so the quarters are put back
+   in order after packing. */
+#if PL_ZBUFFER_BITS == 16
+#define _PL_SPAN_Z16X(zbuf,i,vz,vdz,fi,p) { \
+  __m256i _f = _mm256_set1_epi16(-32768), _z, _o; \
+  __m256 _8 = _mm256_set1_ps(8.0f); \
+  _z = _PL_SPAN_ZV8(vz,vdz,fi); fi = _mm256_add_ps(fi,_8); \
+  _z = _mm256_permute4x64_epi64(_mm256_packus_epi32(_z, \
+    _PL_SPAN_ZV8(vz,vdz,fi)),0xD8); fi = _mm256_add_ps(fi,_8); \
+  _o = _mm256_loadu_si256((__m256i *) ((zbuf)+(i))); \
+  p = _mm256_cmpgt_epi16(_mm256_xor_si256(_z,_f),_mm256_xor_si256(_o,_f)); \
+  _mm256_storeu_si256((__m256i *) ((zbuf)+(i)),_mm256_blendv_epi8(_o,_z,p)); \
+}
+#elif PL_ZBUFFER_BITS == 24
+#define _PL_SPAN_Z16X(zbuf,i,vz,vdz,fi,p) { \
+  __m256i _z0, _z1, _o0, _o1, _m0, _m1; \
+  __m256 _8 = _mm256_set1_ps(8.0f); \
+  _z0 = _PL_SPAN_ZV8(vz,vdz,fi); fi = _mm256_add_ps(fi,_8); \
+  _z1 = _PL_SPAN_ZV8(vz,vdz,fi); fi = _mm256_add_ps(fi,_8); \
+  _o0 = _mm256_loadu_si256((__m256i *) ((zbuf)+(i))); \
+  _o1 = _mm256_loadu_si256((__m256i *) ((zbuf)+(i)+8)); \
+  _m0 = _mm256_cmpgt_epi32(_z0,_o0); \
+  _m1 = _mm256_cmpgt_epi32(_z1,_o1); \
+  _mm256_storeu_si256((__m256i *) ((zbuf)+(i)), \
+                      _mm256_blendv_epi8(_o0,_z0,_m0)); \
+  _mm256_storeu_si256((__m256i *) ((zbuf)+(i)+8), \
+                      _mm256_blendv_epi8(_o1,_z1,_m1)); \
+  p = _mm256_permute4x64_epi64(_mm256_packs_epi32(_m0,_m1),0xD8); \
+}
+#else
+#define _PL_SPAN_Z16X(zbuf,i,vz,vdz,fi,p) { \
+  __m256 _z0, _z1, _o0, _o1, _m0, _m1, _8 = _mm256_set1_ps(8.0f); \
+  _z0 = _PL_SPAN_ZV8(vz,vdz,fi); fi = _mm256_add_ps(fi,_8); \
+  _z1 = _PL_SPAN_ZV8(vz,vdz,fi); fi = _mm256_add_ps(fi,_8); \
+  _o0 = _mm256_loadu_ps((zbuf)+(i)); \
+  _o1 = _mm256_loadu_ps((zbuf)+(i)+8); \
+  _m0 = _mm256_cmp_ps(_o0,_z0,_CMP_LT_OQ); \
+  _m1 = _mm256_cmp_ps(_o1,_z1,_CMP_LT_OQ); \
+  _mm256_storeu_ps((zbuf)+(i),_mm256_blendv_ps(_o0,_z0,_m0)); \
+  _mm256_storeu_ps((zbuf)+(i)+8,_mm256_blendv_ps(_o1,_z1,_m1)); \
+  p = _mm256_permute4x64_epi64(_mm256_packs_epi32( \
+    _mm256_castps_si256(_m0),_mm256_castps_si256(_m1)),0xD8); \
+}
+#endif
+#endif
 
-  U1 = U2 = MappingU1;
-  V1 = V2 = MappingV1;
-  X2 = X1 = TriFace->Scrx[i0];
-  Z2 = Z1 = TriFace->Scrz[i0];
-  Y0 = (TriFace->Scry[i0]+(1<<19))>>20;
-  Y1 = (TriFace->Scry[i1]+(1<<19))>>20;
-  Y2 = (TriFace->Scry[i2]+(1<<19))>>20;
-
-  dY = Y2-Y0;
-  if (dY) {
-    dX2 = (TriFace->Scrx[i2] - X1) / dY;
-    dZ2 = (TriFace->Scrz[i2] - Z1) / dY;
-    dU2 = (MappingU3 - U1) / dY;
-    dV2 = (MappingV3 - V1) / dY;
-  }
-  dY = Y1-Y0;
-  if (dY) {
-    dX1 = (TriFace->Scrx[i1] - X1) / dY;
-    dZ1 = (TriFace->Scrz[i1] - Z1) / dY;
-    dU1 = (MappingU2 - U1) / dY;
-    dV1 = (MappingV2 - V1) / dY;
-    if (dX2 < dX1) {
-      XL1 = dX2; dX2 = dX1; dX1 = XL1;
-      dUL = dU1; dU1 = dU2; dU2 = dUL;
-      dVL = dV1; dV1 = dV2; dV2 = dVL;
-      dZL = dZ1; dZ1 = dZ2; dZ2 = dZL;
-      stat = 2;
-    } else stat = 1;
-  } else {
-    if (TriFace->Scrx[i1] > X1) {
-      X2 = TriFace->Scrx[i1];
-      Z2 = TriFace->Scrz[i1];
-      U2 = MappingU2;
-      V2 = MappingV2;
-      stat = 2|4;
-    } else {
-      X1 = TriFace->Scrx[i1];
-      Z1 = TriFace->Scrz[i1];
-      U1 = MappingU2;
-      V1 = MappingV2;
-      stat = 1|8;
+static pl_uInt32 _plSpanSolidZ(pl_uChar *gmem, pl_ZBuffer *zbuf,
+                               pl_uInt32 n, pl_Float z, pl_Float dz,
+                               pl_uChar c) {
+  pl_uInt32 i = 0, written = 0;
+  pl_Float zf;
+#ifdef _PL_AVX2
+  {
+    __m256 vz = _mm256_set1_ps(z), vdz = _mm256_set1_ps(dz);
+    __m256 fi = _mm256_setr_ps(0,1,2,3,4,5,6,7);
+    __m256i p;
+    __m128i vc = _mm_set1_epi8((char) c), m;
+    pl_uInt32 b;
+    for (; i+16 <= n; i += 16) {
+      _PL_SPAN_Z16X(zbuf,i,vz,vdz,fi,p);
+      m = _mm_packs_epi16(_mm256_castsi256_si128(p),
+                          _mm256_extracti128_si256(p,1));
+      b = (pl_uInt32) _mm_movemask_epi8(m);
+      if (!b) continue;
+      _mm_storeu_si128((__m128i *) (gmem+i),_mm_blendv_epi8(
+        _mm_loadu_si128((__m128i *) (gmem+i)),vc,m));
+      _plBits16(b);
+      written += b;
     }
   }
-
-  gmem += (Y0 * cam->ScreenWidth);
-  zbuf += (Y0 * cam->ScreenWidth);
-
-  XL1 = ((dX1-dX2)*dY+(1<<19))>>20;
-  if (XL1) {
-    dUL = ((dU1-dU2)*dY)/XL1;
-    dVL = ((dV1-dV2)*dY)/XL1;
-    dZL = ((dZ1-dZ2)*dY)/XL1;
-  } else {
-    XL1 = ((X2-X1+(1<<19))>>20);
-    if (XL1) {
-      dUL = (U2-U1)/XL1;
-      dVL = (V2-V1)/XL1;
-      dZL = (Z2-Z1)/XL1;
+#endif
+#ifdef _PL_SSE2
+  {
+    __m128 vz = _mm_set1_ps(z), vdz = _mm_set1_ps(dz);
+    __m128 fi = _mm_setr_ps((pl_Float) i,(pl_Float) (i+1),
+                            (pl_Float) (i+2),(pl_Float) (i+3));
+    __m128i vc = _mm_set1_epi8((char) c), m;
+    pl_uInt32 b;
+    for (; i+16 <= n; i += 16) {
+      _PL_SPAN_Z16(zbuf,i,vz,vdz,fi,m);
+      b = (pl_uInt32) _mm_movemask_epi8(m);
+      if (!b) continue;
+      _PL_SPAN_MERGE16(gmem+i,vc,m);
+      _plBits16(b);
+      written += b;
+    }
+  }
+#endif
+  for (; i < n; i ++) {
+    zf = z + (pl_Float) i*dz;
+    if (zbuf[i] < _plZ(zf)) {
+      zbuf[i] = _plZ(zf);
+      gmem[i] = c;
+      written ++;
     }
   }
+  return written;
+}
 
-  pdZL = dZL * nm;
-  dUL *= nm;
-  dVL *= nm;
+/* Gets the colors of 16 pixels from i of a Gouraud span. The shade only
+   ever goes one way along a span, so if the ends agree so does the rest. */
+#define _PL_SPAN_SHADE16(col,remap,c,dc,i,maxColor) { \
+  pl_sInt32 _a = _plSpanShade(c,dc,i,maxColor); \
+  pl_uInt32 _k; \
+  if (_a == _plSpanShade(c,dc,(i)+15,maxColor)) \
+    memset((col),(remap)[_a],16); \
+  else for (_k = 0; _k < 16; _k ++) \
+    (col)[_k] = (remap)[_plSpanShade(c,dc,(i)+_k,maxColor)]; \
+}
 
-  while (Y0 < Y2) {
-    if (Y0 == Y1) {
-      dY = Y2-((TriFace->Scry[i1]+(1<<19))>>20);
-      if (dY) {
-        if (stat & 1) {
-          X1 = TriFace->Scrx[i1];
-          dX1 = (TriFace->Scrx[i2]-TriFace->Scrx[i1])/dY;
-        }
-        if (stat & 2) {
-          X2 = TriFace->Scrx[i1];
-          dX2 = (TriFace->Scrx[i2]-TriFace->Scrx[i1])/dY;
-        }
-        if (stat & 4) {
-          X1 = TriFace->Scrx[i0];
-          dX1 = (TriFace->Scrx[i2]-TriFace->Scrx[i0])/dY;
-        }
-        if (stat & 8) {
-          X2 = TriFace->Scrx[i0];
-          dX2 = (TriFace->Scrx[i2]-TriFace->Scrx[i0])/dY;
-        }
-        dZ1 = (TriFace->Scrz[i2]-Z1)/dY;
-        dV1 = (MappingV3 - V1) / dY;
-        dU1 = (MappingU3 - U1) / dY;
+static void _plSpanGouraud(pl_uChar *gmem, pl_uInt32 n, pl_uChar *remap,
+                           pl_sInt32 c, pl_sInt32 dc, pl_sInt32 maxColor) {
+  pl_uInt32 i = 0;
+  for (; i+16 <= n; i += 16) _PL_SPAN_SHADE16(gmem+i,remap,c,dc,i,maxColor);
+  for (; i < n; i ++) gmem[i] = remap[_plSpanShade(c,dc,i,maxColor)];
+}
+
+static pl_uInt32 _plSpanGouraudZ(pl_uChar *gmem, pl_ZBuffer *zbuf,
+                                 pl_uInt32 n, pl_Float z, pl_Float dz,
+                                 pl_uChar *remap, pl_sInt32 c, pl_sInt32 dc,
+                                 pl_sInt32 maxColor) {
+  pl_uInt32 i = 0, written = 0;
+  pl_Float zf;
+#ifdef _PL_SSE2
+  {
+    __m128 vz = _mm_set1_ps(z), vdz = _mm_set1_ps(dz);
+    __m128 fi = _mm_setr_ps(0,1,2,3);
+    __m128i m;
+    pl_uChar col[16];
+    pl_uInt32 b;
+    for (; i+16 <= n; i += 16) {
+      _PL_SPAN_Z16(zbuf,i,vz,vdz,fi,m);
+      b = (pl_uInt32) _mm_movemask_epi8(m);
+      if (!b) continue;
+      if (b == 0xFFFF) {
+        _PL_SPAN_SHADE16(gmem+i,remap,c,dc,i,maxColor);
+      } else {
+        _PL_SPAN_SHADE16(col,remap,c,dc,i,maxColor);
+        _PL_SPAN_MERGE16(gmem+i,_mm_loadu_si128((__m128i *) col),m);
       }
+      _plBits16(b);
+      written += b;
     }
-    XL1 = (X1+(1<<19))>>20;
-    Xlen = ((X2+(1<<19))>>20) - XL1;
-    if (Xlen > 0) {
-      register pl_Float t;
-      pZL = ZL = Z1;
-      UL = U1;
-      VL = V1;
-      gmem += XL1;
-      zbuf += XL1;
-      XL1 += Xlen-scrwidth;
-      t = 65536.0f/ZL;
-      iUL = iULnext = ((pl_sInt32) (UL*t));
-      iVL = iVLnext = ((pl_sInt32) (VL*t));
-      do {
-        UL += dUL;
-        VL += dVL;
-        iUL = iULnext;
+  }
+#endif
+  for (; i < n; i ++) {
+    zf = z + (pl_Float) i*dz;
+    if (zbuf[i] < _plZ(zf)) {
+      zbuf[i] = _plZ(zf);
+      gmem[i] = remap[_plSpanShade(c,dc,i,maxColor)];
+      written ++;
+    }
+  }
+  return written;
+}
+
+/*
+** The span kernels for pl_Cam.frameBuffer32, drawing the ARGB8888 colors of
+** the material's _RGBTable. The z test is the same, and the byte mask of 16
+** pixels it gives is widened to four masks of 4 pixels each.
+*/
+#ifdef _PL_SSE2
+/* Writes the 16 colors c0 to c3 (4 to each) to gmem where the byte mask m
+   is set */
+#define _PL_SPAN_MERGE16X32(gmem,c0,c1,c2,c3,m) { \
+  __m128i _l = _mm_unpacklo_epi8((m),(m)), _h = _mm_unpackhi_epi8((m),(m)); \
+  _PL_SPAN_MERGE16((gmem),(c0),_mm_unpacklo_epi16(_l,_l)); \
+  _PL_SPAN_MERGE16((gmem)+4,(c1),_mm_unpackhi_epi16(_l,_l)); \
+  _PL_SPAN_MERGE16((gmem)+8,(c2),_mm_unpacklo_epi16(_h,_h)); \
+  _PL_SPAN_MERGE16((gmem)+12,(c3),_mm_unpackhi_epi16(_h,_h)); \
+}
+#endif
+
+static void _plSpanSolid32(pl_ARGB *gmem, pl_uInt32 n, pl_ARGB c) {
+  pl_uInt32 i;
+  for (i = 0; i < n; i ++) gmem[i] = c;
+}
+
+static pl_uInt32 _plSpanSolidZ32(pl_ARGB *gmem, pl_ZBuffer *zbuf,
+                                 pl_uInt32 n, pl_Float z, pl_Float dz,
+                                 pl_ARGB c) {
+  pl_uInt32 i = 0, written = 0;
+  pl_Float zf;
+#ifdef _PL_SSE2
+  {
+    __m128 vz = _mm_set1_ps(z), vdz = _mm_set1_ps(dz);
+    __m128 fi = _mm_setr_ps(0,1,2,3);
+    __m128i vc = _mm_set1_epi32((int) c), m;
+    pl_uInt32 b;
+    for (; i+16 <= n; i += 16) {
+      _PL_SPAN_Z16(zbuf,i,vz,vdz,fi,m);
+      b = (pl_uInt32) _mm_movemask_epi8(m);
+      if (!b) continue;
+      _PL_SPAN_MERGE16X32(gmem+i,vc,vc,vc,vc,m);
+      _plBits16(b);
+      written += b;
+    }
+  }
+#endif
+  for (; i < n; i ++) {
+    zf = z + (pl_Float) i*dz;
+    if (zbuf[i] < _plZ(zf)) {
+      zbuf[i] = _plZ(zf);
+      gmem[i] = c;
+      written ++;
+    }
+  }
+  return written;
+}
+
+static void _plSpanGouraud32(pl_ARGB *gmem, pl_uInt32 n, pl_ARGB *rgbmap,
+                             pl_sInt32 c, pl_sInt32 dc, pl_sInt32 maxColor) {
+  pl_uInt32 i;
+  for (i = 0; i < n; i ++) gmem[i] = rgbmap[_plSpanShade(c,dc,i,maxColor)];
+}
+
+static pl_uInt32 _plSpanGouraudZ32(pl_ARGB *gmem, pl_ZBuffer *zbuf,
+                                   pl_uInt32 n, pl_Float z, pl_Float dz,
+                                   pl_ARGB *rgbmap, pl_sInt32 c,
+                                   pl_sInt32 dc, pl_sInt32 maxColor) {
+  pl_uInt32 i = 0, written = 0;
+  pl_Float zf;
+#ifdef _PL_SSE2
+  {
+    __m128 vz = _mm_set1_ps(z), vdz = _mm_set1_ps(dz);
+    __m128 fi = _mm_setr_ps(0,1,2,3);
+    __m128i m;
+    pl_ARGB col[16];
+    pl_uInt32 b, k;
+    for (; i+16 <= n; i += 16) {
+      _PL_SPAN_Z16(zbuf,i,vz,vdz,fi,m);
+      b = (pl_uInt32) _mm_movemask_epi8(m);
+      if (!b) continue;
+      for (k = 0; k < 16; k ++)
+        col[k] = rgbmap[_plSpanShade(c,dc,i+k,maxColor)];
+      _PL_SPAN_MERGE16X32(gmem+i,_mm_loadu_si128((__m128i *) col),
+                          _mm_loadu_si128((__m128i *) (col+4)),
+                          _mm_loadu_si128((__m128i *) (col+8)),
+                          _mm_loadu_si128((__m128i *) (col+12)),m);
+      _plBits16(b);
+      written += b;
+    }
+  }
+#endif
+  for (; i < n; i ++) {
+    zf = z + (pl_Float) i*dz;
+    if (zbuf[i] < _plZ(zf)) {
+      zbuf[i] = _plZ(zf);
+      gmem[i] = rgbmap[_plSpanShade(c,dc,i,maxColor)];
+      written ++;
+    }
+  }
+  return written;
+}
+
+/*
+** Half-space rasterizer, used by plPF_SolidF() and plPF_SolidG() instead of
+** the scanline walk when pl_Cam.HalfSpace is set. The vertices are snapped to
+** 1/16 of a pixel, and the three edge functions are tested at the corners of
+** 8x8 blocks of the screen: blocks outside an edge are skipped, blocks inside
+** all three are taken whole, and only the blocks an edge goes through are
+** tested pixel by pixel, a row of a block at a time. A pixel is drawn if its
+** center is inside the triangle, or on a top or left edge of it. The
+** pixels of each row are then handed to the span kernels, with z and the
+** shade taken from the planes through the vertices.
+*/
+#define _PL_HS_BLOCK 8
+
+/* Takes the pixels of rows jb to je of a block inside a triangle into the
+   runs xs to xe of those rows. e holds the edge values at the top left pixel
+   of the block, and sa and sb their steps across and down, zero for the
+   edges the whole block is inside. The pixels of a row inside a triangle are
+   all next to each other. */
+static void _plHalfSpaceBlock(pl_sInt32 *e, const pl_sInt32 *sa,
+                              const pl_sInt32 *sb, pl_sInt32 bx,
+                              pl_uInt32 cm, pl_sInt32 jb, pl_sInt32 je,
+                              pl_sInt32 *xs, pl_sInt32 *xe) {
+  /* Number of bits set in 0 to 15 */
+  static const pl_uChar bits[16] = { 0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4 };
+  pl_uInt32 m, n;
+  pl_sInt32 j, x;
+#if defined(_PL_AVX2)
+  __m256i i8 = _mm256_setr_epi32(0,1,2,3,4,5,6,7);
+  __m256i e0 = _mm256_add_epi32(_mm256_set1_epi32(e[0]),
+    _mm256_mullo_epi32(_mm256_set1_epi32(sa[0]),i8));
+  __m256i e1 = _mm256_add_epi32(_mm256_set1_epi32(e[1]),
+    _mm256_mullo_epi32(_mm256_set1_epi32(sa[1]),i8));
+  __m256i e2 = _mm256_add_epi32(_mm256_set1_epi32(e[2]),
+    _mm256_mullo_epi32(_mm256_set1_epi32(sa[2]),i8));
+  __m256i s0 = _mm256_set1_epi32(sb[0]), s1 = _mm256_set1_epi32(sb[1]);
+  __m256i s2 = _mm256_set1_epi32(sb[2]);
+#elif defined(_PL_SSE2)
+  __m128i e0 = _mm_setr_epi32(e[0],e[0]+sa[0],e[0]+2*sa[0],e[0]+3*sa[0]);
+  __m128i e1 = _mm_setr_epi32(e[1],e[1]+sa[1],e[1]+2*sa[1],e[1]+3*sa[1]);
+  __m128i e2 = _mm_setr_epi32(e[2],e[2]+sa[2],e[2]+2*sa[2],e[2]+3*sa[2]);
+  __m128i a0 = _mm_set1_epi32(4*sa[0]), a1 = _mm_set1_epi32(4*sa[1]);
+  __m128i a2 = _mm_set1_epi32(4*sa[2]);
+  __m128i s0 = _mm_set1_epi32(sb[0]), s1 = _mm_set1_epi32(sb[1]);
+  __m128i s2 = _mm_set1_epi32(sb[2]);
+#endif
+  for (j = jb; j < je; j ++) {
+#if defined(_PL_AVX2)
+    m = ~(pl_uInt32) _mm256_movemask_ps(_mm256_castsi256_ps(
+      _mm256_or_si256(_mm256_or_si256(e0,e1),e2)));
+    e0 = _mm256_add_epi32(e0,s0);
+    e1 = _mm256_add_epi32(e1,s1);
+    e2 = _mm256_add_epi32(e2,s2);
+#elif defined(_PL_SSE2)
+    __m128i lo = _mm_or_si128(_mm_or_si128(e0,e1),e2);
+    __m128i hi = _mm_or_si128(_mm_or_si128(_mm_add_epi32(e0,a0),
+      _mm_add_epi32(e1,a1)),_mm_add_epi32(e2,a2));
+    m = ~(pl_uInt32) (_mm_movemask_ps(_mm_castsi128_ps(lo)) |
+                      (_mm_movemask_ps(_mm_castsi128_ps(hi)) << 4));
+    e0 = _mm_add_epi32(e0,s0);
+    e1 = _mm_add_epi32(e1,s1);
+    e2 = _mm_add_epi32(e2,s2);
+#else
+    pl_sInt32 i;
+    for (m = 0, i = 0; i < _PL_HS_BLOCK; i ++)
+      if (((e[0]+i*sa[0]) | (e[1]+i*sa[1]) | (e[2]+i*sa[2])) >= 0)
+        m |= 1<<i;
+    e[0] += sb[0]; e[1] += sb[1]; e[2] += sb[2];
+#endif
+    m &= cm;
+    if (!m) continue;
+    n = (m & (0-m)) - 1;
+    x = bx + bits[n & 15] + bits[n >> 4];
+    if (x < xs[j]) xs[j] = x;
+    xe[j] = x + bits[m & 15] + bits[m >> 4];
+  }
+}
+
+_PL_INLINE void _plPF_HalfSpace(pl_Cam *cam, pl_Face *TriFace,
+                                const pl_Bool zb, const pl_Bool gouraud,
+                                const pl_Bool rgb) {
+  pl_uInt32 spans = 0, pixels = 0, written = 0, cm;
+  pl_Mat *mat = TriFace->Material;
+  pl_uInt sw = cam->ScreenWidth;
+  pl_sInt64 X[3], Y[3], E0[3], Eb[3], SA8[3], Omin[3], Omax[3];
+  pl_sInt64 et, area, minX, maxX;
+  pl_sInt32 SA[3], SB[3], e[3], sa[3], sb[3];
+  pl_sInt32 x0, x1, xl, xr, fl, fr, y0, y1, bx, by, x, j, jb, je;
+  pl_sInt32 xs[_PL_HS_BLOCK], xe[_PL_HS_BLOCK];
+  pl_sInt32 maxColor = (mat->_ColorsUsed-1)<<16, shade, dc = 0;
+  pl_Float nc = (mat->_ColorsUsed-1)*65536.0f;
+  double zo = 0.0, dzx = 0.0, dzy = 0.0, co = 0.0, dcx = 0.0, dcy = 0.0;
+  double val, xt;
+  pl_uInt k, a, b, in, out, v[3] = { 0, 1, 2 };
+  pl_Bool seen;
+  pl_uChar bc = 0;
+  pl_ARGB bc32 = 0;
+
+  /* Rounding up to 1/16 pixel keeps the vertices on the same side of
+     every pixel center, so the rows come out the same as from
+     _plFaceRows() */
+  for (k = 0; k < 3; k ++) {
+    X[k] = -((-TriFace->Scrx[k])>>16);
+    Y[k] = -((-TriFace->Scry[k])>>16);
+  }
+  area = (X[1]-X[0])*(Y[2]-Y[0]) - (X[2]-X[0])*(Y[1]-Y[0]);
+  if (area < 0) {
+    v[1] = 2; v[2] = 1;
+    area = -area;
+  }
+
+  _plFaceRows(TriFace,y0,y1);
+  if (y0 < cam->ClipTop) y0 = cam->ClipTop;
+  if (y0 < 0) y0 = 0;
+  if (y1 > cam->ClipBottom) y1 = cam->ClipBottom;
+  if (y1 > (pl_sInt32) cam->ScreenHeight) y1 = cam->ScreenHeight;
+  minX = plMin(X[0],plMin(X[1],X[2]));
+  maxX = plMax(X[0],plMax(X[1],X[2]));
+  x0 = minX < 0 ? 0 : (pl_sInt32) (minX>>4);
+  x1 = maxX >= (pl_sInt64) sw<<4 ? (pl_sInt32) sw : (pl_sInt32) (maxX>>4)+1;
+  if (!area || y0 >= y1 || x0 >= x1) {
+    _plFillStats(cam,gouraud ? PL_PF_SOLIDG : PL_PF_SOLIDF,0,0,0);
+    return;
+  }
+  if (cam->_Clear) _plCamTouch(cam,x0,x1,y0,y1);
+
+  /* Edge k runs between the vertices other than v[k], and is positive on
+     the side of v[k]. E0 is its value at the center of pixel 0,0, and SA
+     and SB its steps per pixel across and down. The value at v[k] is area,
+     so E/area is the weight of v[k] for the planes. */
+  for (k = 0; k < 3; k ++) {
+    a = v[(k+1)%3];
+    b = v[(k+2)%3];
+    SA[k] = (pl_sInt32) (Y[a]-Y[b]);
+    SB[k] = (pl_sInt32) (X[b]-X[a]);
+    E0[k] = SA[k]*(8-X[a]) + SB[k]*(8-Y[a]);
+    val = zb ? TriFace->Scrz[v[k]]*_plZScale(cam) : 0.0;
+    zo += val*E0[k]; dzx += val*SA[k]; dzy += val*SB[k];
+    val = gouraud ? TriFace->Shades[v[k]]*nc : 0.0;
+    co += val*E0[k]; dcx += val*SA[k]; dcy += val*SB[k];
+    /* Pixels exactly on an edge only go to the triangle it is the top or
+       left edge of, the same fill rule as _plFillSetup() */
+    if (!(SA[k] > 0 || (SA[k] == 0 && SB[k] > 0))) E0[k] --;
+    SA[k] *= 16;
+    SB[k] *= 16;
+    /* Offsets of the lowest and highest values in a block */
+    SA8[k] = (pl_sInt64) SA[k]*_PL_HS_BLOCK;
+    Omin[k] = (pl_sInt64) plMin(SA[k],0)*(_PL_HS_BLOCK-1) +
+              (pl_sInt64) plMin(SB[k],0)*(_PL_HS_BLOCK-1);
+    Omax[k] = (pl_sInt64) plMax(SA[k],0)*(_PL_HS_BLOCK-1) +
+              (pl_sInt64) plMax(SB[k],0)*(_PL_HS_BLOCK-1);
+  }
+  zo /= area; dzx *= 16.0/area; dzy *= 16.0/area;
+  co /= area; dcx *= 16.0/area; dcy *= 16.0/area;
+
+  if (gouraud) dc = (pl_sInt32) dcx;
+  else {
+    shade = (pl_sInt32) (TriFace->fShade*(mat->_ColorsUsed-1));
+    if (shade < 0) shade = 0;
+    if (shade > (pl_sInt32) mat->_ColorsUsed-1) shade = mat->_ColorsUsed-1;
+    if (rgb) bc32 = mat->_RGBTable[shade];
+    else bc = mat->_ReMapTable[shade];
+  }
+
+  for (by = y0 & ~(_PL_HS_BLOCK-1); by < y1; by += _PL_HS_BLOCK) {
+    jb = plMax(y0-by,0);
+    je = plMin(y1-by,_PL_HS_BLOCK);
+    for (j = jb; j < je; j ++) {
+      xs[j] = x1;
+      xe[j] = x0;
+    }
+    /* Start and end at the furthest the left and right edges get over the
+       rows of the band, rather than the bounding box */
+    xl = x0;
+    xr = x1;
+    for (k = 0; k < 3; k ++) {
+      if (!SA[k]) continue;
+      et = E0[k] + (pl_sInt64) SB[k]*(by+jb);
+      et = plMax(et,et + (pl_sInt64) SB[k]*(je-1-jb));
+      xt = (double) -et / SA[k];
+      if (SA[k] > 0 && xt-1.0 > xl) xl = (pl_sInt32) (xt-1.0);
+      if (SA[k] < 0 && xt+2.0 < xr) xr = (pl_sInt32) (xt+2.0);
+    }
+    bx = xl & ~(_PL_HS_BLOCK-1);
+    for (k = 0; k < 3; k ++) Eb[k] = E0[k] + (pl_sInt64) SA[k]*bx +
+                                     (pl_sInt64) SB[k]*by;
+    fl = xr;
+    fr = xl;
+    seen = 0;
+    for (; bx < xr; bx += _PL_HS_BLOCK) {
+      in = out = 0;
+      for (k = 0; k < 3; k ++) {
+        if (Eb[k] + Omax[k] < 0) out = 1;
+        if (Eb[k] + Omin[k] >= 0) in |= 1<<k;
+      }
+      if (out) {
+        /* The blocks a triangle touches in a row of blocks are all next to
+           each other, so once past them there are no more */
+        if (seen) break;
+      } else if (in == 7) {
+        /* Whole blocks are all next to each other too */
+        seen = 1;
+        if (bx < fl) fl = bx;
+        fr = bx+_PL_HS_BLOCK;
+      } else {
+        /* An edge goes through the block, so the values of the edges in it
+           are small enough for 32 bits */
+        seen = 1;
+        for (k = 0; k < 3; k ++) {
+          if (in & (1<<k)) e[k] = sa[k] = sb[k] = 0;
+          else {
+            sa[k] = SA[k];
+            sb[k] = SB[k];
+            e[k] = (pl_sInt32) Eb[k] + sb[k]*jb;
+          }
+        }
+        cm = (1<<plMin(x1-bx,_PL_HS_BLOCK)) - (1<<plMax(x0-bx,0));
+        _plHalfSpaceBlock(e,sa,sb,bx,cm,jb,je,xs,xe);
+      }
+      Eb[0] += SA8[0]; Eb[1] += SA8[1]; Eb[2] += SA8[2];
+    }
+
+    for (j = jb; j < je; j ++) {
+      pl_sInt32 n, y = by+j;
+      pl_uChar *gmem;
+      pl_ARGB *gmem32;
+      pl_ZBuffer *zbuf;
+      if (fl < fr) {
+        if (fl < xs[j]) xs[j] = fl;
+        if (fr > xe[j]) xe[j] = fr;
+      }
+      x = plMax(xs[j],x0);
+      n = plMin(xe[j],x1) - x;
+      if (n <= 0) continue;
+      spans ++;
+      pixels += n;
+      zbuf = zb ? cam->zBuffer + y*sw + x : 0;
+      if (rgb) {
+        gmem32 = cam->frameBuffer32 + y*sw + x;
+        if (gouraud) {
+          pl_sInt32 c = (pl_sInt32) (co + x*dcx + y*dcy);
+          if (zb) written += _plSpanGouraudZ32(gmem32,zbuf,n,
+                                               (pl_Float) (zo + x*dzx + y*dzy),
+                                               (pl_Float) dzx,mat->_RGBTable,
+                                               c,dc,maxColor);
+          else _plSpanGouraud32(gmem32,n,mat->_RGBTable,c,dc,maxColor);
+        } else {
+          if (zb) written += _plSpanSolidZ32(gmem32,zbuf,n,
+                                             (pl_Float) (zo + x*dzx + y*dzy),
+                                             (pl_Float) dzx,bc32);
+          else _plSpanSolid32(gmem32,n,bc32);
+        }
+        continue;
+      }
+      gmem = cam->frameBuffer + y*sw + x;
+      if (gouraud) {
+        pl_sInt32 c = (pl_sInt32) (co + x*dcx + y*dcy);
+        if (zb) written += _plSpanGouraudZ(gmem,zbuf,n,
+                                           (pl_Float) (zo + x*dzx + y*dzy),
+                                           (pl_Float) dzx,mat->_ReMapTable,
+                                           c,dc,maxColor);
+        else _plSpanGouraud(gmem,n,mat->_ReMapTable,c,dc,maxColor);
+      } else {
+        if (zb) written += _plSpanSolidZ(gmem,zbuf,n,
+                                         (pl_Float) (zo + x*dzx + y*dzy),
+                                         (pl_Float) dzx,bc);
+        else memset(gmem,bc,n);
+      }
+    }
+  }
+  _plFillStats(cam,gouraud ? PL_PF_SOLIDG : PL_PF_SOLIDF,spans,pixels,
+               zb ? written : pixels);
+}
+
+/*
+** The fillers are written once as _plPF_*() templates taking the z-buffer
+** test, the framebuffer (see _plPutPixel()) and for the texture fillers
+** environment mapping as constant arguments, and the plPF_*() entry points
+** expand a copy for each case. That takes the per span z-buffer and per
+** pixel framebuffer branches out of the loops. plMatInit() picks the
+** environment mapped copies directly.
+*/
+
+/* Calls the copy of the textured filler template pf for the z-buffer test of
+   cam, with the rest of its arguments */
+#define _plPF_Textured(pf,cam,TriFace,...) { \
+  if ((cam)->_Ids) pf(cam,TriFace,2,__VA_ARGS__); \
+  else if ((cam)->zBuffer && (TriFace)->Material->zBufferable) \
+    pf(cam,TriFace,1,__VA_ARGS__); \
+  else pf(cam,TriFace,0,__VA_ARGS__); \
+}
+_PL_INLINE void _plPF_PTexF(pl_Cam *cam, pl_Face *TriFace,
+                            const pl_uChar zb, const pl_Bool env,
+                            const pl_Bool rgb) {
+  pl_uInt32 spans = 0, pixels = 0, written = 0;
+  pl_uChar i0, i1, i2;
+  pl_uChar *gmem = _plFrameBuffer(cam,rgb);
+  pl_ARGB *rgbmap = TriFace->Material->_RGBTable;
+  pl_sInt32 ps = _plPixelSize(rgb);
+  pl_uChar *remap = TriFace->Material->_ReMapTable;
+  pl_ZBuffer *zbuf = cam->zBuffer;
+  pl_Float MappingU1, MappingU2, MappingU3;
+  pl_Float MappingV1, MappingV2, MappingV3;
+  pl_sInt32 MappingU_AND, MappingV_AND;
+  pl_uChar *texture;
+  pl_uChar vshift;
+  pl_uInt16 bc;
+  pl_Texture *Texture;
+  pl_sInt32 iShade;
+
+  pl_uChar nm, nmb;
+  pl_sInt n;
+  pl_Float dUL,dVL,UL,VL;
+  pl_sInt32 iUL, iVL, idUL=0, idVL=0, iULnext, iVLnext;
+
+  pl_sInt32 scrwidth = cam->ScreenWidth;
+  pl_sInt32 XL1, Xlen;
+  pl_Float dZL, ZL, pZL, pdZL, zs = _plZScale(cam);
+  double Zr, dZx, dZy, Ur, dUx, dUy, Vr, dVx, dVy;
+  _pl_Fill f;
+
+
+  if (env) Texture = TriFace->Material->Environment;
+  else Texture = TriFace->Material->Texture;
+
+  if (!Texture) return;
+  texture = Texture->Data;
+  iShade = (pl_sInt32)(TriFace->fShade*256.0);
+  if (iShade < 0) iShade=0;
+  if (iShade > 255) iShade=255;
+
+  if (!TriFace->Material->_AddTable) bc=0;
+  else bc = TriFace->Material->_AddTable[iShade];
+  nm = TriFace->Material->PerspectiveCorrect;
+  nmb = 0; while (nm) { nmb++; nm >>= 1; }
+  nmb = plMin(6,nmb);
+  nm = 1<<nmb;
+  MappingV_AND = ((1<<Texture->Height)-1)<<Texture->Width;
+  MappingU_AND = (1<<Texture->Width)-1;
+  vshift = 16 - Texture->Width;
+
+  if (env) {
+    PUTFACE_SORT_ENV();
+  } else {
+    PUTFACE_SORT_TEX();
+  }
+
+  MappingU1 *= TriFace->Scrz[i0]/65536.0f;
+  MappingV1 *= TriFace->Scrz[i0]/65536.0f;
+  MappingU2 *= TriFace->Scrz[i1]/65536.0f;
+  MappingV2 *= TriFace->Scrz[i1]/65536.0f;
+  MappingU3 *= TriFace->Scrz[i2]/65536.0f;
+  MappingV3 *= TriFace->Scrz[i2]/65536.0f;
+
+  if (!_plFillSetup(&f,cam,TriFace,i0,i1,i2)) {
+    _plFillStats(cam,PL_PF_PTEXF,0,0,0);
+    return;
+  }
+  _plFillPlane(&f,TriFace->Scrz[i0],TriFace->Scrz[i1],TriFace->Scrz[i2],
+               &Zr,&dZx,&dZy);
+  _plFillPlane(&f,MappingU1,MappingU2,MappingU3,&Ur,&dUx,&dUy);
+  _plFillPlane(&f,MappingV1,MappingV2,MappingV3,&Vr,&dVx,&dVy);
+  dZL = (pl_Float) dZx;
+  dUL = (pl_Float) dUx;
+  dVL = (pl_Float) dVx;
+
+  pdZL = dZL * nm;
+  dUL *= nm;
+  dVL *= nm;
+
+  gmem += f.Y*cam->ScreenWidth*ps;
+  zbuf += (f.Y * cam->ScreenWidth);
+
+  while (f.Y < f.Yend) {
+    XL1 = _plFillLeft(&f);
+    Xlen = _plFillRight(&f) - XL1;
+    if (Xlen > 0) {
+      register pl_Float t;
+      spans ++;
+      pixels += Xlen;
+      pZL = ZL = (pl_Float) (Zr + XL1*dZx);
+      UL = (pl_Float) (Ur + XL1*dUx);
+      VL = (pl_Float) (Vr + XL1*dVx);
+      gmem += XL1*ps;
+      zbuf += XL1;
+      XL1 += Xlen-scrwidth;
+      t = 65536.0f/ZL;
+      iUL = iULnext = ((pl_sInt32) (UL*t));
+      iVL = iVLnext = ((pl_sInt32) (VL*t));
+      do {
+        UL += dUL;
+        VL += dVL;
+        iUL = iULnext;
         iVL = iVLnext;
         pZL += pdZL;
         t = 65536.0f/pZL;
@@ -2906,46 +5001,69 @@ PL_API void plPF_PTexF(pl_Cam *cam, pl_Face *TriFace) {
         Xlen -= n;
         if (Xlen < 0) n += Xlen;
         if (zb) do {
-            if (*zbuf < ZL) {
-              *zbuf = ZL;
-              *gmem = remap[bc + texture[((iUL>>16)&MappingU_AND) +
-                                   ((iVL>>vshift)&MappingV_AND)]];
+            if (_plZTest(zb,cam,zbuf,_plZ(ZL*zs))) {
+              if (zb == 1) *zbuf = _plZ(ZL*zs);
+              written ++;
+              _plPutPixel(rgb,gmem,remap,rgbmap,
+                          bc + texture[((iUL>>16)&MappingU_AND) +
+                                       ((iVL>>vshift)&MappingV_AND)]);
             }
             zbuf++;
-            gmem++;
+            gmem += ps;
             ZL += dZL;
             iUL += idUL;
             iVL += idVL;
           } while (--n);
         else do {
-            *gmem++ = remap[bc + texture[((iUL>>16)&MappingU_AND) +
-                                   ((iVL>>vshift)&MappingV_AND)]];
+            _plPutPixel(rgb,gmem,remap,rgbmap,
+                        bc + texture[((iUL>>16)&MappingU_AND) +
+                                     ((iVL>>vshift)&MappingV_AND)]);
+            gmem += ps;
             iUL += idUL;
             iVL += idVL;
           } while (--n);
       } while (Xlen > 0);
-      gmem -= XL1;
+      gmem -= XL1*ps;
       zbuf -= XL1;
     } else {
       zbuf += cam->ScreenWidth;
-      gmem += cam->ScreenWidth;
+      gmem += cam->ScreenWidth*ps;
     }
-    Z1 += dZ1;
-    U1 += dU1;
-    V1 += dV1;
-    X1 += dX1;
-    X2 += dX2;
-    Y0++;
+    Zr += dZy;
+    Ur += dUy;
+    Vr += dVy;
+    _plFillNext(&f);
   }
+  _plFillStats(cam,PL_PF_PTEXF,spans,pixels,zb ? written : pixels);
 }
 
-PL_API void plPF_PTexG(pl_Cam *cam, pl_Face *TriFace) {
+/* Environment mapped variant of plPF_PTexF(), picked by plMatInit() */
+static void _plPF_PTexFEnv(pl_Cam *cam, pl_Face *TriFace) {
+  if (cam->frameBuffer32) {
+    _plPF_Textured(_plPF_PTexF,cam,TriFace,1,1);
+  } else {
+    _plPF_Textured(_plPF_PTexF,cam,TriFace,1,0);
+  }
+}
+
+PL_API void plPF_PTexF(pl_Cam *cam, pl_Face *TriFace) {
+  if (TriFace->Material->Environment) _plPF_PTexFEnv(cam,TriFace);
+  else if (cam->frameBuffer32) {
+    _plPF_Textured(_plPF_PTexF,cam,TriFace,0,1);
+  } else {
+    _plPF_Textured(_plPF_PTexF,cam,TriFace,0,0);
+  }
+}
+
+_PL_INLINE void _plPF_PTexG(pl_Cam *cam, pl_Face *TriFace,
+                            const pl_uChar zb, const pl_Bool env,
+                            const pl_Bool rgb) {
+  pl_uInt32 spans = 0, pixels = 0, written = 0;
   pl_uChar i0, i1, i2;
   pl_Float MappingU1, MappingU2, MappingU3;
   pl_Float MappingV1, MappingV2, MappingV3;
 
   pl_Texture *Texture;
-  pl_Bool zb = (cam->zBuffer&&TriFace->Material->zBufferable) ? 1 : 0;
 
   pl_uChar nm, nmb;
   pl_uInt n;
@@ -2955,25 +5073,20 @@ PL_API void plPF_PTexG(pl_Cam *cam, pl_Face *TriFace) {
   pl_uInt16 *addtable;
   pl_uChar *remap = TriFace->Material->_ReMapTable;
   pl_sInt32 iUL, iVL, idUL, idVL, iULnext, iVLnext;
-  pl_Float U2,V2,dU2=0,dV2=0,dUL=0,dVL=0,UL,VL;
+  pl_Float dUL,dVL,UL,VL;
   pl_sInt32 XL1, Xlen;
-  pl_sInt32 C2, dC2=0, CL, dCL=0;
-  pl_Float ZL, Z2, dZ2=0, dZL=0, pdZL, pZL;
-
-  pl_sInt32 Y2, dY;
-  pl_uChar stat;
+  pl_sInt32 CL, dCL;
+  pl_Float ZL, dZL, pdZL, pZL, zs = _plZScale(cam);
+  double Zr, dZx, dZy, Ur, dUx, dUy, Vr, dVx, dVy, Cr, dCx, dCy;
+  _pl_Fill f;
 
-  /* Cache line */
-  pl_sInt32 Y0,Y1;
-  pl_sInt32 C1, dC1=0, X2, dX2=0, X1, dX1=0;
-
-  /* Cache line */
-  pl_Float dU1=0, U1, dZ1=0, Z1, V1, dV1=0;
   pl_sInt32 scrwidth = cam->ScreenWidth;
-  pl_uChar *gmem = cam->frameBuffer;
+  pl_uChar *gmem = _plFrameBuffer(cam,rgb);
+  pl_ARGB *rgbmap = TriFace->Material->_RGBTable;
+  pl_sInt32 ps = _plPixelSize(rgb);
   pl_ZBuffer *zbuf = cam->zBuffer;
 
-  if (TriFace->Material->Environment) Texture = TriFace->Material->Environment;
+  if (env) Texture = TriFace->Material->Environment;
   else Texture = TriFace->Material->Texture;
 
   if (!Texture) return;
@@ -2989,7 +5102,7 @@ PL_API void plPF_PTexG(pl_Cam *cam, pl_Face *TriFace) {
   MappingU_AND = (1<<Texture->Width)-1;
   vshift = 16 - Texture->Width;
 
-  if (TriFace->Material->Environment) {
+  if (env) {
     PUTFACE_SORT_ENV();
   } else {
     PUTFACE_SORT_TEX();
@@ -3001,119 +5114,41 @@ PL_API void plPF_PTexG(pl_Cam *cam, pl_Face *TriFace) {
   MappingV2 *= TriFace->Scrz[i1]/65536.0f;
   MappingU3 *= TriFace->Scrz[i2]/65536.0f;
   MappingV3 *= TriFace->Scrz[i2]/65536.0f;
-  TriFace->Shades[0] *= 65536.0f;
-  TriFace->Shades[1] *= 65536.0f;
-  TriFace->Shades[2] *= 65536.0f;
-
-  C1 = C2 = (pl_sInt32) TriFace->Shades[i0];
-  U1 = U2 = MappingU1;
-  V1 = V2 = MappingV1;
-  X2 = X1 = TriFace->Scrx[i0];
-  Z2 = Z1 = TriFace->Scrz[i0];
-  Y0 = (TriFace->Scry[i0]+(1<<19))>>20;
-  Y1 = (TriFace->Scry[i1]+(1<<19))>>20;
-  Y2 = (TriFace->Scry[i2]+(1<<19))>>20;
-
-  dY = Y2-Y0;
-  if (dY) {
-    dX2 = (TriFace->Scrx[i2] - X1) / dY;
-    dZ2 = (TriFace->Scrz[i2] - Z1) / dY;
-    dC2 = (pl_sInt32) ((TriFace->Shades[i2] - C1) / dY);
-    dU2 = (MappingU3 - U1) / dY;
-    dV2 = (MappingV3 - V1) / dY;
-  }
-  dY = Y1-Y0;
-  if (dY) {
-    dX1 = (TriFace->Scrx[i1] - X1) / dY;
-    dZ1 = (TriFace->Scrz[i1] - Z1) / dY;
-    dC1 = (pl_sInt32) ((TriFace->Shades[i1] - C1) / dY);
-    dU1 = (MappingU2 - U1) / dY;
-    dV1 = (MappingV2 - V1) / dY;
-    if (dX2 < dX1) {
-      dX2 ^= dX1; dX1 ^= dX2; dX2 ^= dX1;
-      dUL = dU1; dU1 = dU2; dU2 = dUL;
-      dVL = dV1; dV1 = dV2; dV2 = dVL;
-      dZL = dZ1; dZ1 = dZ2; dZ2 = dZL;
-      dCL = dC1; dC1 = dC2; dC2 = dCL;
-      stat = 2;
-    } else stat = 1;
-  } else {
-    if (TriFace->Scrx[i1] > X1) {
-      X2 = TriFace->Scrx[i1];
-      Z2 = TriFace->Scrz[i1];
-      C2 = (pl_sInt32)TriFace->Shades[i1];
-      U2 = MappingU2;
-      V2 = MappingV2;
-      stat = 2|4;
-    } else {
-      X1 = TriFace->Scrx[i1];
-      Z1 = TriFace->Scrz[i1];
-      C1 = (pl_sInt32)TriFace->Shades[i1];
-      U1 = MappingU2;
-      V1 = MappingV2;
-      stat = 1|8;
-    }
-  }
-
-  gmem += (Y0 * scrwidth);
-  zbuf += (Y0 * scrwidth);
 
-  XL1 = (((dX1-dX2)*dY+(1<<19))>>20);
-  if (XL1) {
-    dUL = ((dU1-dU2)*dY)/XL1;
-    dVL = ((dV1-dV2)*dY)/XL1;
-    dZL = ((dZ1-dZ2)*dY)/XL1;
-    dCL = ((dC1-dC2)*dY)/XL1;
-  } else {
-    XL1 = ((X2-X1+(1<<19))>>20);
-    if (XL1) {
-      dUL = (U2-U1)/XL1;
-      dVL = (V2-V1)/XL1;
-      dZL = (Z2-Z1)/XL1;
-      dCL = (C2-C1)/XL1;
-    }
+  if (!_plFillSetup(&f,cam,TriFace,i0,i1,i2)) {
+    _plFillStats(cam,PL_PF_PTEXG,0,0,0);
+    return;
   }
+  _plFillPlane(&f,TriFace->Scrz[i0],TriFace->Scrz[i1],TriFace->Scrz[i2],
+               &Zr,&dZx,&dZy);
+  _plFillPlane(&f,MappingU1,MappingU2,MappingU3,&Ur,&dUx,&dUy);
+  _plFillPlane(&f,MappingV1,MappingV2,MappingV3,&Vr,&dVx,&dVy);
+  _plFillPlane(&f,TriFace->Shades[i0]*65536.0f,TriFace->Shades[i1]*65536.0f,
+               TriFace->Shades[i2]*65536.0f,&Cr,&dCx,&dCy);
+  dZL = (pl_Float) dZx;
+  dUL = (pl_Float) dUx;
+  dVL = (pl_Float) dVx;
+  dCL = (pl_sInt32) dCx;
 
   pdZL = dZL * nm;
   dUL *= nm;
   dVL *= nm;
-  Y1 -= Y0;
-  Y0 = Y2-Y0;
-  while (Y0--) {
-    if (!Y1--) {
-      dY = Y2-((TriFace->Scry[i1]+(1<<19))>>20);
-      if (dY) {
-        if (stat & 1) {
-          X1 = TriFace->Scrx[i1];
-          dX1 = (TriFace->Scrx[i2]-TriFace->Scrx[i1])/dY;
-        }
-        if (stat & 2) {
-          X2 = TriFace->Scrx[i1];
-          dX2 = (TriFace->Scrx[i2]-TriFace->Scrx[i1])/dY;
-        }
-        if (stat & 4) {
-          X1 = TriFace->Scrx[i0];
-          dX1 = (TriFace->Scrx[i2]-TriFace->Scrx[i0])/dY;
-        }
-        if (stat & 8) {
-          X2 = TriFace->Scrx[i0];
-          dX2 = (TriFace->Scrx[i2]-TriFace->Scrx[i0])/dY;
-        }
-        dZ1 = (TriFace->Scrz[i2]-Z1)/dY;
-        dC1 = (pl_sInt32)((TriFace->Shades[i2]-C1)/dY);
-        dV1 = (MappingV3 - V1) / dY;
-        dU1 = (MappingU3 - U1) / dY;
-      }
-    }
-    XL1 = (X1+(1<<19))>>20;
-    Xlen = ((X2+(1<<19))>>20) - XL1;
+
+  gmem += f.Y*scrwidth*ps;
+  zbuf += (f.Y * scrwidth);
+
+  while (f.Y < f.Yend) {
+    XL1 = _plFillLeft(&f);
+    Xlen = _plFillRight(&f) - XL1;
     if (Xlen > 0) {
       register pl_Float t;
-      CL = C1;
-      pZL = ZL = Z1;
-      UL = U1;
-      VL = V1;
-      gmem += XL1;
+      spans ++;
+      pixels += Xlen;
+      CL = (pl_sInt32) (Cr + XL1*dCx);
+      pZL = ZL = (pl_Float) (Zr + XL1*dZx);
+      UL = (pl_Float) (Ur + XL1*dUx);
+      VL = (pl_Float) (Vr + XL1*dVx);
+      gmem += XL1*ps;
       zbuf += XL1;
       XL1 += Xlen-scrwidth;
       t = 65536.0f / ZL;
@@ -3134,18 +5169,19 @@ PL_API void plPF_PTexG(pl_Cam *cam, pl_Face *TriFace) {
         Xlen -= n;
         if (Xlen < 0) n += Xlen;
         if (zb) do {
-            if (*zbuf < ZL) {
+            if (_plZTest(zb,cam,zbuf,_plZ(ZL*zs))) {
               int av;
               if (CL < 0) av=addtable[0];
               else if (CL > (255<<8)) av=addtable[255];
               else av=addtable[CL>>8];
-              *zbuf = ZL;
-              *gmem = remap[av +
-                      texture[((iUL>>16)&MappingU_AND) +
-                              ((iVL>>vshift)&MappingV_AND)]];
+              if (zb == 1) *zbuf = _plZ(ZL*zs);
+              written ++;
+              _plPutPixel(rgb,gmem,remap,rgbmap,
+                          av + texture[((iUL>>16)&MappingU_AND) +
+                                       ((iVL>>vshift)&MappingV_AND)]);
             }
             zbuf++;
-            gmem++;
+            gmem += ps;
             ZL += dZL;
             CL += dCL;
             iUL += idUL;
@@ -3156,41 +5192,64 @@ PL_API void plPF_PTexG(pl_Cam *cam, pl_Face *TriFace) {
             if (CL < 0) av=addtable[0];
             else if (CL > (255<<8)) av=addtable[255];
             else av=addtable[CL>>8];
-            *gmem++ = remap[av +
-                      texture[((iUL>>16)&MappingU_AND) +
-                              ((iVL>>vshift)&MappingV_AND)]];
+            _plPutPixel(rgb,gmem,remap,rgbmap,
+                        av + texture[((iUL>>16)&MappingU_AND) +
+                                     ((iVL>>vshift)&MappingV_AND)]);
+            gmem += ps;
             CL += dCL;
             iUL += idUL;
             iVL += idVL;
           } while (--n);
       } while (Xlen > 0);
-      gmem -= XL1;
+      gmem -= XL1*ps;
       zbuf -= XL1;
     } else {
       zbuf += scrwidth;
-      gmem += scrwidth;
+      gmem += scrwidth*ps;
     }
-    Z1 += dZ1;
-    U1 += dU1;
-    V1 += dV1;
-    X1 += dX1;
-    X2 += dX2;
-    C1 += dC1;
+    Zr += dZy;
+    Ur += dUy;
+    Vr += dVy;
+    Cr += dCy;
+    _plFillNext(&f);
   }
+  _plFillStats(cam,PL_PF_PTEXG,spans,pixels,zb ? written : pixels);
 }
 
-PL_API void plPF_SolidF(pl_Cam *cam, pl_Face *TriFace) {
+/* Environment mapped variant of plPF_PTexG(), picked by plMatInit() */
+static void _plPF_PTexGEnv(pl_Cam *cam, pl_Face *TriFace) {
+  if (cam->frameBuffer32) {
+    _plPF_Textured(_plPF_PTexG,cam,TriFace,1,1);
+  } else {
+    _plPF_Textured(_plPF_PTexG,cam,TriFace,1,0);
+  }
+}
+
+PL_API void plPF_PTexG(pl_Cam *cam, pl_Face *TriFace) {
+  if (TriFace->Material->Environment) _plPF_PTexGEnv(cam,TriFace);
+  else if (cam->frameBuffer32) {
+    _plPF_Textured(_plPF_PTexG,cam,TriFace,0,1);
+  } else {
+    _plPF_Textured(_plPF_PTexG,cam,TriFace,0,0);
+  }
+}
+
+_PL_INLINE void _plPF_SolidF(pl_Cam *cam, pl_Face *TriFace,
+                             const pl_Bool zb, const pl_Bool rgb) {
+  pl_uInt32 spans = 0, pixels = 0, written = 0;
   pl_uChar i0, i1, i2;
 
-  pl_uChar *gmem = cam->frameBuffer;
+  pl_uChar *gmem = _plFrameBuffer(cam,rgb);
+  pl_ARGB *rgbmap = TriFace->Material->_RGBTable;
+  pl_sInt32 ps = _plPixelSize(rgb);
   pl_ZBuffer *zbuf = cam->zBuffer;
 
-  pl_sInt32 X1, X2, dX1=0, dX2=0, XL1, XL2;
-  pl_ZBuffer dZL=0, dZ1=0, dZ2=0, Z1, ZL, Z2, Z3;
-  pl_sInt32 Y1, Y2, Y0, dY;
-  pl_uChar stat;
-  pl_Bool zb = (zbuf&&TriFace->Material->zBufferable) ? 1 : 0;
-  pl_uChar bc;
+  pl_sInt32 XL1, XL2;
+  pl_Float dZL=0, ZL;
+  double Zr = 0.0, dZx = 0.0, dZy = 0.0;
+  _pl_Fill f;
+  pl_uChar bc = 0;
+  pl_ARGB bc32 = 0;
   pl_sInt32 shade;
 
   PUTFACE_SORT();
@@ -3198,252 +5257,140 @@ PL_API void plPF_SolidF(pl_Cam *cam, pl_Face *TriFace) {
   shade=(pl_sInt32) (TriFace->fShade*(TriFace->Material->_ColorsUsed-1));
   if (shade < 0) shade=0;
   if (shade > (pl_sInt32) TriFace->Material->_ColorsUsed-1) shade=TriFace->Material->_ColorsUsed-1;
-  bc=TriFace->Material->_ReMapTable[shade];
-
-  X2 = X1 = TriFace->Scrx[i0];
-  Z1 = TriFace->Scrz[i0];
-  Z2 = TriFace->Scrz[i1];
-  Z3 = TriFace->Scrz[i2];
-  Y0 = (TriFace->Scry[i0]+(1<<19)) >> 20;
-  Y1 = (TriFace->Scry[i1]+(1<<19)) >> 20;
-  Y2 = (TriFace->Scry[i2]+(1<<19)) >> 20;
-
-  dY = Y2-Y0;
-  if (dY) {
-    dX2 = (TriFace->Scrx[i2] - X1) / dY;
-    dZ2 = (Z3 - Z1) / dY;
-  }
-  dY = Y1-Y0;
-  if (dY) {
-    dX1 = (TriFace->Scrx[i1] - X1) / dY;
-    dZ1 = (Z2 - Z1) / dY;
-    if (dX2 < dX1) {
-      dX2 ^= dX1; dX1 ^= dX2; dX2 ^= dX1;
-      dZL = dZ1; dZ1 = dZ2; dZ2 = dZL;
-      stat = 2;
-    } else stat = 1;
-    Z2 = Z1;
-  } else {
-    if (TriFace->Scrx[i1] > X1) {
-      X2 = TriFace->Scrx[i1];
-      stat = 2|4;
-    } else {
-      X1 = TriFace->Scrx[i1];
-      ZL = Z1; Z1 = Z2; Z2 = ZL;
-      stat = 1|8;
-    }
-  }
+  if (rgb) bc32=rgbmap[shade];
+  else bc=TriFace->Material->_ReMapTable[shade];
 
+  if (!_plFillSetup(&f,cam,TriFace,i0,i1,i2)) {
+    _plFillStats(cam,PL_PF_SOLIDF,0,0,0);
+    return;
+  }
   if (zb) {
-    XL1 = ((dX1-dX2)*dY+(1<<19))>>20;
-    if (XL1) dZL = ((dZ1-dZ2)*dY)/XL1;
-    else {
-      XL1 = (X2-X1+(1<<19))>>20;
-      if (zb && XL1) dZL = (Z2-Z1)/XL1;
-      else dZL = 0.0;
-    }
+    _plFillZPlane(&f,cam,TriFace,i0,i1,i2,&Zr,&dZx,&dZy);
+    dZL = (pl_Float) dZx;
   }
 
-  gmem += (Y0 * cam->ScreenWidth);
-  zbuf += (Y0 * cam->ScreenWidth);
+  gmem += f.Y*cam->ScreenWidth*ps;
+  zbuf += (f.Y * cam->ScreenWidth);
 
-  while (Y0 < Y2) {
-    if (Y0 == Y1) {
-      dY = Y2 - ((TriFace->Scry[i1]+(1<<19))>>20);
-      if (dY) {
-        if (stat & 1) {
-          X1 = TriFace->Scrx[i1];
-          dX1 = (TriFace->Scrx[i2]-TriFace->Scrx[i1])/dY;
-        }
-        if (stat & 2) {
-          X2 = TriFace->Scrx[i1];
-          dX2 = (TriFace->Scrx[i2]-TriFace->Scrx[i1])/dY;
-        }
-        if (stat & 4) {
-          X1 = TriFace->Scrx[i0];
-          dX1 = (TriFace->Scrx[i2]-TriFace->Scrx[i0])/dY;
-        }
-        if (stat & 8) {
-          X2 = TriFace->Scrx[i0];
-          dX2 = (TriFace->Scrx[i2]-TriFace->Scrx[i0])/dY;
-        }
-        dZ1 = (Z3-Z1)/dY;
-      }
-    }
-    XL1 = (X1+(1<<19))>>20;
-    XL2 = (X2+(1<<19))>>20;
-    ZL = Z1;
-    XL2 -= XL1;
+  while (f.Y < f.Yend) {
+    XL1 = _plFillLeft(&f);
+    XL2 = _plFillRight(&f) - XL1;
     if (XL2 > 0) {
-      zbuf += XL1;
-      gmem += XL1;
-      XL1 += XL2;
-      if (zb) do {
-          if (*zbuf < ZL) {
-            *zbuf = ZL;
-            *gmem = bc;
-          }
-          gmem++;
-          zbuf++;
-          ZL += dZL;
-        } while (--XL2);
-      else do *gmem++ = bc; while (--XL2);
-      gmem -= XL1;
-      zbuf -= XL1;
+      spans ++;
+      pixels += XL2;
+      ZL = (pl_Float) (Zr + XL1*dZx);
+      if (rgb) {
+        if (zb) written += _plSpanSolidZ32((pl_ARGB *) gmem+XL1,zbuf+XL1,
+                                           XL2,ZL,dZL,bc32);
+        else _plSpanSolid32((pl_ARGB *) gmem+XL1,XL2,bc32);
+      } else if (zb) written += _plSpanSolidZ(gmem+XL1,zbuf+XL1,XL2,ZL,dZL,bc);
+      else memset(gmem+XL1,bc,XL2);
     }
-    gmem += cam->ScreenWidth;
+    gmem += cam->ScreenWidth*ps;
     zbuf += cam->ScreenWidth;
-    Z1 += dZ1;
-    X1 += dX1;
-    X2 += dX2;
-    Y0++;
+    Zr += dZy;
+    _plFillNext(&f);
   }
+  _plFillStats(cam,PL_PF_SOLIDF,spans,pixels,zb ? written : pixels);
 }
 
-PL_API void plPF_SolidG(pl_Cam *cam, pl_Face *TriFace) {
+PL_API void plPF_SolidF(pl_Cam *cam, pl_Face *TriFace) {
+  if (cam->frameBuffer32) {
+    if (cam->zBuffer && TriFace->Material->zBufferable) {
+      if (cam->HalfSpace) _plPF_HalfSpace(cam,TriFace,1,0,1);
+      else _plPF_SolidF(cam,TriFace,1,1);
+    } else if (cam->HalfSpace) _plPF_HalfSpace(cam,TriFace,0,0,1);
+    else _plPF_SolidF(cam,TriFace,0,1);
+  } else if (cam->zBuffer && TriFace->Material->zBufferable) {
+    if (cam->HalfSpace) _plPF_HalfSpace(cam,TriFace,1,0,0);
+    else _plPF_SolidF(cam,TriFace,1,0);
+  } else if (cam->HalfSpace) _plPF_HalfSpace(cam,TriFace,0,0,0);
+  else _plPF_SolidF(cam,TriFace,0,0);
+}
+
+_PL_INLINE void _plPF_SolidG(pl_Cam *cam, pl_Face *TriFace,
+                             const pl_Bool zb, const pl_Bool rgb) {
+  pl_uInt32 spans = 0, pixels = 0, written = 0;
   pl_uChar i0, i1, i2;
-  pl_uChar *gmem = cam->frameBuffer;
+  pl_uChar *gmem = _plFrameBuffer(cam,rgb);
+  pl_ARGB *rgbmap = TriFace->Material->_RGBTable;
+  pl_sInt32 ps = _plPixelSize(rgb);
   pl_uChar *remap = TriFace->Material->_ReMapTable;
   pl_ZBuffer *zbuf = cam->zBuffer;
-  pl_ZBuffer dZL=0, dZ1=0, dZ2=0, Z1, Z2, ZL, Z3;
-  pl_sInt32 dX1=0, dX2=0, X1, X2, XL1, XL2;
-  pl_sInt32 C1, C2, dC1=0, dC2=0, dCL=0, CL, C3;
-  pl_sInt32 Y1, Y2, Y0, dY;
-  pl_uChar stat;
-  pl_Bool zb = (zbuf&&TriFace->Material->zBufferable) ? 1 : 0;
+  pl_Float dZL=0, ZL;
+  pl_sInt32 XL1, XL2;
+  pl_sInt32 dCL, CL;
+  double Zr = 0.0, dZx = 0.0, dZy = 0.0, Cr, dCx, dCy;
+  _pl_Fill f;
 
   pl_Float nc = (TriFace->Material->_ColorsUsed-1)*65536.0f;
   pl_sInt32 maxColor=((TriFace->Material->_ColorsUsed-1)<<16);
-  pl_sInt32 maxColorNonShift=TriFace->Material->_ColorsUsed-1;
 
   PUTFACE_SORT();
 
-
-  C1 = (pl_sInt32) (TriFace->Shades[i0]*nc);
-  C2 = (pl_sInt32) (TriFace->Shades[i1]*nc);
-  C3 = (pl_sInt32) (TriFace->Shades[i2]*nc);
-  X2 = X1 = TriFace->Scrx[i0];
-  Z1 = TriFace->Scrz[i0];
-  Z2 = TriFace->Scrz[i1];
-  Z3 = TriFace->Scrz[i2];
-
-  Y0 = (TriFace->Scry[i0]+(1<<19))>>20;
-  Y1 = (TriFace->Scry[i1]+(1<<19))>>20;
-  Y2 = (TriFace->Scry[i2]+(1<<19))>>20;
-
-  dY = Y2 - Y0;
-  if (dY) {
-    dX2 = (TriFace->Scrx[i2] - X1) / dY;
-    dC2 = (C3 - C1) / dY;
-    dZ2 = (Z3 - Z1) / dY;
-  }
-  dY = Y1 - Y0;
-  if (dY) {
-    dX1 = (TriFace->Scrx[i1] - X1) / dY;
-    dC1 = (C2 - C1) / dY;
-    dZ1 = (Z2 - Z1) / dY;
-    if (dX2 < dX1) {
-      dX2 ^= dX1; dX1 ^= dX2; dX2 ^= dX1;
-      dC2 ^= dC1; dC1 ^= dC2; dC2 ^= dC1;
-      dZL = dZ1; dZ1 = dZ2; dZ2 = dZL;
-      stat = 2;
-    } else stat = 1;
-    Z2 = Z1;
-    C2 = C1;
-  } else {
-    if (TriFace->Scrx[i1] > X1) {
-      X2 = TriFace->Scrx[i1];
-      stat = 2|4;
-    } else {
-      X1 = C1; C1 = C2; C2 = X1;
-      ZL = Z1; Z1 = Z2; Z2 = ZL;
-      X1 = TriFace->Scrx[i1];
-      stat = 1|8;
-    }
+  if (!_plFillSetup(&f,cam,TriFace,i0,i1,i2)) {
+    _plFillStats(cam,PL_PF_SOLIDG,0,0,0);
+    return;
   }
-
-  gmem += (Y0 * cam->ScreenWidth);
-  zbuf += (Y0 * cam->ScreenWidth);
-
-  XL1 = (((dX1-dX2)*dY+(1<<19))>>20);
-  if (XL1) {
-    dCL = ((dC1-dC2)*dY)/XL1;
-    dZL = ((dZ1-dZ2)*dY)/XL1;
-  } else {
-    XL1 = ((X2-X1+(1<<19))>>20);
-    if (XL1) {
-      dCL = (C2-C1)/XL1;
-      dZL = (Z2-Z1)/XL1;
-    }
+  _plFillPlane(&f,TriFace->Shades[i0]*nc,TriFace->Shades[i1]*nc,
+               TriFace->Shades[i2]*nc,&Cr,&dCx,&dCy);
+  dCL = (pl_sInt32) dCx;
+  if (zb) {
+    _plFillZPlane(&f,cam,TriFace,i0,i1,i2,&Zr,&dZx,&dZy);
+    dZL = (pl_Float) dZx;
   }
 
-  while (Y0 < Y2) {
-    if (Y0 == Y1) {
-      dY = Y2 - ((TriFace->Scry[i1]+(1<<19))>>20);
-      if (dY) {
-        dZ1 = (Z3-Z1)/dY;
-        dC1 = (C3-C1) / dY;
-        if (stat & 1) {
-          X1 = TriFace->Scrx[i1];
-          dX1 = (TriFace->Scrx[i2]-TriFace->Scrx[i1])/dY;
-        }
-        if (stat & 2) {
-          X2 = TriFace->Scrx[i1];
-          dX2 = (TriFace->Scrx[i2]-TriFace->Scrx[i1])/dY;
-        }
-        if (stat & 4) {
-          X1 = TriFace->Scrx[i0];
-          dX1 = (TriFace->Scrx[i2]-TriFace->Scrx[i0])/dY;
-        }
-        if (stat & 8) {
-          X2 = TriFace->Scrx[i0];
-          dX2 = (TriFace->Scrx[i2]-TriFace->Scrx[i0])/dY;
-        }
-      }
-    }
-    CL = C1;
-    XL1 = (X1+(1<<19))>>20;
-    XL2 = (X2+(1<<19))>>20;
-    ZL = Z1;
-    XL2 -= XL1;
+  gmem += f.Y*cam->ScreenWidth*ps;
+  zbuf += (f.Y * cam->ScreenWidth);
+
+  while (f.Y < f.Yend) {
+    XL1 = _plFillLeft(&f);
+    XL2 = _plFillRight(&f) - XL1;
     if (XL2 > 0) {
-      gmem += XL1;
-      zbuf += XL1;
-      XL1 += XL2;
-      if (zb) do {
-          if (*zbuf < ZL) {
-            *zbuf = ZL;
-            if (CL >= maxColor) *gmem=remap[maxColorNonShift];
-            else if (CL > 0) *gmem = remap[CL>>16];
-            else *gmem = remap[0];
-          }
-          gmem++;
-          zbuf++;
-          ZL += dZL;
-          CL += dCL;
-        } while (--XL2);
-      else do {
-          if (CL >= maxColor) *gmem++=remap[maxColorNonShift];
-          else if (CL > 0) *gmem++ = remap[CL>>16];
-          else *gmem++ = remap[0];
-          CL += dCL;
-        } while (--XL2);
-      gmem -= XL1;
-      zbuf -= XL1;
+      spans ++;
+      pixels += XL2;
+      CL = (pl_sInt32) (Cr + XL1*dCx);
+      ZL = (pl_Float) (Zr + XL1*dZx);
+      if (rgb) {
+        if (zb) written += _plSpanGouraudZ32((pl_ARGB *) gmem+XL1,
+                                             zbuf+XL1,XL2,ZL,dZL,
+                                             rgbmap,CL,dCL,maxColor);
+        else _plSpanGouraud32((pl_ARGB *) gmem+XL1,XL2,rgbmap,CL,dCL,
+                              maxColor);
+      } else if (zb) written += _plSpanGouraudZ(gmem+XL1,zbuf+XL1,XL2,ZL,dZL,
+                                                remap,CL,dCL,maxColor);
+      else _plSpanGouraud(gmem+XL1,XL2,remap,CL,dCL,maxColor);
     }
-    gmem += cam->ScreenWidth;
+    gmem += cam->ScreenWidth*ps;
     zbuf += cam->ScreenWidth;
-    X1 += dX1;
-    X2 += dX2;
-    C1 += dC1;
-    Z1 += dZ1;
-    Y0++;
+    Cr += dCy;
+    Zr += dZy;
+    _plFillNext(&f);
   }
+  _plFillStats(cam,PL_PF_SOLIDG,spans,pixels,zb ? written : pixels);
 }
 
-PL_API void plPF_TexEnv(pl_Cam *cam, pl_Face *TriFace) {
+PL_API void plPF_SolidG(pl_Cam *cam, pl_Face *TriFace) {
+  if (cam->frameBuffer32) {
+    if (cam->zBuffer && TriFace->Material->zBufferable) {
+      if (cam->HalfSpace) _plPF_HalfSpace(cam,TriFace,1,1,1);
+      else _plPF_SolidG(cam,TriFace,1,1);
+    } else if (cam->HalfSpace) _plPF_HalfSpace(cam,TriFace,0,1,1);
+    else _plPF_SolidG(cam,TriFace,0,1);
+  } else if (cam->zBuffer && TriFace->Material->zBufferable) {
+    if (cam->HalfSpace) _plPF_HalfSpace(cam,TriFace,1,1,0);
+    else _plPF_SolidG(cam,TriFace,1,0);
+  } else if (cam->HalfSpace) _plPF_HalfSpace(cam,TriFace,0,1,0);
+  else _plPF_SolidG(cam,TriFace,0,0);
+}
+
+_PL_INLINE void _plPF_TexEnv(pl_Cam *cam, pl_Face *TriFace,
+                             const pl_uChar zb, const pl_Bool rgb) {
+  pl_uInt32 spans = 0, pixels = 0, written = 0;
   pl_uChar i0, i1, i2;
-  pl_uChar *gmem = cam->frameBuffer;
+  pl_uChar *gmem = _plFrameBuffer(cam,rgb);
+  pl_ARGB *rgbmap = TriFace->Material->_RGBTable;
+  pl_sInt32 ps = _plPixelSize(rgb);
   pl_uChar *remap;
   pl_ZBuffer *zbuf = cam->zBuffer;
 
@@ -3459,15 +5406,14 @@ PL_API void plPF_TexEnv(pl_Cam *cam, pl_Face *TriFace) {
   pl_uChar evshift;
   pl_uInt16 *addtable;
   pl_Texture *Texture, *Environment;
-  pl_uChar stat;
-  pl_Bool zb = (zbuf&&TriFace->Material->zBufferable) ? 1 : 0;
 
-  pl_sInt32 U1, V1, U2, V2, dU1=0, dU2=0, dV1=0, dV2=0, dUL=0, dVL=0, UL, VL;
-  pl_sInt32 eU1, eV1, eU2, eV2, edU1=0, edU2=0, edV1=0,
-            edV2=0, edUL=0, edVL=0, eUL, eVL;
-  pl_sInt32 X1, X2, dX1=0, dX2=0, XL1, XL2;
-  pl_Float Z1, ZL, dZ1=0, dZ2=0, dZL=0, Z2;
-  pl_sInt32 Y1, Y2, Y0, dY;
+  pl_sInt32 dUL, dVL, UL, VL;
+  pl_sInt32 edUL, edVL, eUL, eVL;
+  pl_sInt32 XL1, XL2;
+  pl_Float ZL, dZL=0;
+  double Zr = 0.0, dZx = 0.0, dZy = 0.0, Ur, dUx, dUy, Vr, dVx, dVy;
+  double eUr, edUx, edUy, eVr, edVx, edVy;
+  _pl_Fill f;
 
   Environment = TriFace->Material->Environment;
   Texture = TriFace->Material->Texture;
@@ -3494,132 +5440,52 @@ PL_API void plPF_TexEnv(pl_Cam *cam, pl_Face *TriFace) {
   eMappingU3=(pl_sInt32) (TriFace->eMappingU[i2]*Environment->uScale*TriFace->Material->EnvScaling);
   eMappingV3=(pl_sInt32) (TriFace->eMappingV[i2]*Environment->vScale*TriFace->Material->EnvScaling);
 
-  U1 = U2 = MappingU1;
-  V1 = V2 = MappingV1;
-  eU1 = eU2 = eMappingU1;
-  eV1 = eV2 = eMappingV1;
-  X2 = X1 = TriFace->Scrx[i0];
-  Z2 = Z1 = TriFace->Scrz[i0];
-  Y0 = (TriFace->Scry[i0]+(1<<19))>>20;
-  Y1 = (TriFace->Scry[i1]+(1<<19))>>20;
-  Y2 = (TriFace->Scry[i2]+(1<<19))>>20;
-
-  dY = Y2 - Y0;
-  if (dY) {
-    dU2 = (MappingU3 - U1) / dY;
-    dV2 = (MappingV3 - V1) / dY;
-    edU2 = (eMappingU3 - eU1) / dY;
-    edV2 = (eMappingV3 - eV1) / dY;
-    dX2 = (TriFace->Scrx[i2] - X1) / dY;
-    dZ2 = (TriFace->Scrz[i2] - Z1) / dY;
-  }
-  dY = Y1-Y0;
-  if (dY) {
-    dX1 = (TriFace->Scrx[i1] - X1) / dY;
-    dU1 = (MappingU2 - U1) / dY;
-    dV1 = (MappingV2 - V1) / dY;
-    edU1 = (eMappingU2 - eU1) / dY;
-    edV1 = (eMappingV2 - eV1) / dY;
-    dZ1 = (TriFace->Scrz[i1] - Z1) / dY;
-    if (dX2 < dX1) {
-      dX2 ^= dX1; dX1 ^= dX2; dX2 ^= dX1;
-      dU2 ^= dU1; dU1 ^= dU2; dU2 ^= dU1;
-      dV2 ^= dV1; dV1 ^= dV2; dV2 ^= dV1;
-      edU2 ^= edU1; edU1 ^= edU2; edU2 ^= edU1;
-      edV2 ^= edV1; edV1 ^= edV2; edV2 ^= edV1;
-      dZL = dZ1; dZ1 = dZ2; dZ2 = dZL;
-      stat = 2;
-    } else stat = 1;
-  } else {
-    if (TriFace->Scrx[i1] > X1) {
-      X2 = TriFace->Scrx[i1];
-      Z2 = TriFace->Scrz[i1];
-      U2 = MappingU2;
-      V2 = MappingV2;
-      eU2 = eMappingU2;
-      eV2 = eMappingV2;
-      stat = 2|4;
-    } else {
-      X1 = TriFace->Scrx[i1];
-      Z1 = TriFace->Scrz[i1];
-      U1 = MappingU2;
-      V1 = MappingV2;
-      eU1 = eMappingU2;
-      eV1 = eMappingV2;
-      stat = 1|8;
-    }
+  if (!_plFillSetup(&f,cam,TriFace,i0,i1,i2)) {
+    _plFillStats(cam,PL_PF_TEXENV,0,0,0);
+    return;
   }
-
-  gmem += (Y0 * cam->ScreenWidth);
-  zbuf += (Y0 * cam->ScreenWidth);
-
-  XL1 = (((dX1-dX2)*dY+(1<<19))>>20);
-  if (XL1) {
-    dUL = ((dU1-dU2)*dY)/XL1;
-    dVL = ((dV1-dV2)*dY)/XL1;
-    edUL = ((edU1-edU2)*dY)/XL1;
-    edVL = ((edV1-edV2)*dY)/XL1;
-    dZL = ((dZ1-dZ2)*dY)/XL1;
-  } else {
-    XL1 = ((X2-X1+(1<<19))>>20);
-    if (XL1) {
-      edUL = (eU2-eU1)/XL1;
-      edVL = (eV2-eV1)/XL1;
-      dUL = (U2-U1)/XL1;
-      dVL = (V2-V1)/XL1;
-      dZL = (Z2-Z1)/XL1;
-    }
+  _plFillPlane(&f,MappingU1,MappingU2,MappingU3,&Ur,&dUx,&dUy);
+  _plFillPlane(&f,MappingV1,MappingV2,MappingV3,&Vr,&dVx,&dVy);
+  _plFillPlane(&f,eMappingU1,eMappingU2,eMappingU3,&eUr,&edUx,&edUy);
+  _plFillPlane(&f,eMappingV1,eMappingV2,eMappingV3,&eVr,&edVx,&edVy);
+  dUL = (pl_sInt32) dUx;
+  dVL = (pl_sInt32) dVx;
+  edUL = (pl_sInt32) edUx;
+  edVL = (pl_sInt32) edVx;
+  if (zb) {
+    _plFillZPlane(&f,cam,TriFace,i0,i1,i2,&Zr,&dZx,&dZy);
+    dZL = (pl_Float) dZx;
   }
 
-  while (Y0 < Y2) {
-    if (Y0 == Y1) {
-      dY = Y2 - ((TriFace->Scry[i1]+(1<<19))>>20);
-      if (dY) {
-        if (stat & 1) {
-          X1 = TriFace->Scrx[i1];
-          dX1 = (TriFace->Scrx[i2]-TriFace->Scrx[i1])/dY;
-        }
-        if (stat & 2) {
-          X2 = TriFace->Scrx[i1];
-          dX2 = (TriFace->Scrx[i2]-TriFace->Scrx[i1])/dY;
-        }
-        if (stat & 4) {
-          X1 = TriFace->Scrx[i0];
-          dX1 = (TriFace->Scrx[i2]-TriFace->Scrx[i0])/dY;
-        }
-        if (stat & 8) {
-          X2 = TriFace->Scrx[i0];
-          dX2 = (TriFace->Scrx[i2]-TriFace->Scrx[i0])/dY;
-        }
-        dZ1 = (TriFace->Scrz[i2]-Z1)/dY;
-        dV1 = (MappingV3 - V1) / dY;
-        dU1 = (MappingU3 - U1) / dY;
-        edV1 = (eMappingV3 - eV1) / dY;
-        edU1 = (eMappingU3 - eU1) / dY;
-      }
-    }
-    XL1 = (X1+(1<<19))>>20;
-    XL2 = (X2+(1<<19))>>20;
-    ZL = Z1;
-    UL = U1;
-    VL = V1;
-    eUL = eU1;
-    eVL = eV1;
+  gmem += f.Y*cam->ScreenWidth*ps;
+  zbuf += (f.Y * cam->ScreenWidth);
+
+  while (f.Y < f.Yend) {
+    XL1 = _plFillLeft(&f);
+    XL2 = _plFillRight(&f);
     if ((XL2-XL1) > 0) {
+      ZL = (pl_Float) (Zr + XL1*dZx);
+      UL = (pl_sInt32) (Ur + XL1*dUx);
+      VL = (pl_sInt32) (Vr + XL1*dVx);
+      eUL = (pl_sInt32) (eUr + XL1*edUx);
+      eVL = (pl_sInt32) (eVr + XL1*edVx);
       XL2 -= XL1;
-      gmem += XL1;
+      spans ++;
+      pixels += XL2;
+      gmem += XL1*ps;
       zbuf += XL1;
       XL1 += XL2;
       if (zb) do {
-          if (*zbuf < ZL) {
-            *zbuf = ZL;
-            *gmem = remap[addtable[environment[
-                ((eUL>>16)&eMappingU_AND)+((eVL>>evshift)&eMappingV_AND)]] +
-                            texture[((UL>>16)&MappingU_AND) +
-                                    ((VL>>vshift)&MappingV_AND)]];
+          if (_plZTest(zb,cam,zbuf,_plZ(ZL))) {
+            if (zb == 1) *zbuf = _plZ(ZL);
+            written ++;
+            _plPutPixel(rgb,gmem,remap,rgbmap,addtable[environment[
+              ((eUL>>16)&eMappingU_AND)+((eVL>>evshift)&eMappingV_AND)]] +
+                        texture[((UL>>16)&MappingU_AND) +
+                                ((VL>>vshift)&MappingV_AND)]);
           }
           zbuf++;
-          gmem++;
+          gmem += ps;
           ZL += dZL;
           UL += dUL;
           VL += dVL;
@@ -3627,34 +5493,47 @@ PL_API void plPF_TexEnv(pl_Cam *cam, pl_Face *TriFace) {
           eVL += edVL;
         } while (--XL2);
       else do {
-          *gmem++ = remap[addtable[environment[
-              ((eUL>>16)&eMappingU_AND)+((eVL>>evshift)&eMappingV_AND)]] +
-                          texture[((UL>>16)&MappingU_AND) +
-                                  ((VL>>vshift)&MappingV_AND)]];
+          _plPutPixel(rgb,gmem,remap,rgbmap,addtable[environment[
+            ((eUL>>16)&eMappingU_AND)+((eVL>>evshift)&eMappingV_AND)]] +
+                      texture[((UL>>16)&MappingU_AND) +
+                              ((VL>>vshift)&MappingV_AND)]);
+          gmem += ps;
           UL += dUL;
           VL += dVL;
           eUL += edUL;
           eVL += edVL;
         } while (--XL2);
-      gmem -= XL1;
+      gmem -= XL1*ps;
       zbuf -= XL1;
     }
     zbuf += cam->ScreenWidth;
-    gmem += cam->ScreenWidth;
-    Z1 += dZ1;
-    X1 += dX1;
-    X2 += dX2;
-    U1 += dU1;
-    V1 += dV1;
-    eU1 += edU1;
-    eV1 += edV1;
-    Y0++;
+    gmem += cam->ScreenWidth*ps;
+    Zr += dZy;
+    Ur += dUy;
+    Vr += dVy;
+    eUr += edUy;
+    eVr += edVy;
+    _plFillNext(&f);
+  }
+  _plFillStats(cam,PL_PF_TEXENV,spans,pixels,zb ? written : pixels);
+}
+
+PL_API void plPF_TexEnv(pl_Cam *cam, pl_Face *TriFace) {
+  if (cam->frameBuffer32) {
+    _plPF_Textured(_plPF_TexEnv,cam,TriFace,1);
+  } else {
+    _plPF_Textured(_plPF_TexEnv,cam,TriFace,0);
   }
 }
 
-PL_API void plPF_TexF(pl_Cam *cam, pl_Face *TriFace) {
+_PL_INLINE void _plPF_TexF(pl_Cam *cam, pl_Face *TriFace,
+                           const pl_uChar zb, const pl_Bool env,
+                           const pl_Bool rgb) {
+  pl_uInt32 spans = 0, pixels = 0, written = 0;
   pl_uChar i0, i1, i2;
-  pl_uChar *gmem = cam->frameBuffer;
+  pl_uChar *gmem = _plFrameBuffer(cam,rgb);
+  pl_ARGB *rgbmap = TriFace->Material->_RGBTable;
+  pl_sInt32 ps = _plPixelSize(rgb);
   pl_ZBuffer *zbuf = cam->zBuffer;
   pl_sInt32 MappingU1, MappingU2, MappingU3;
   pl_sInt32 MappingV1, MappingV2, MappingV3;
@@ -3664,17 +5543,15 @@ PL_API void plPF_TexF(pl_Cam *cam, pl_Face *TriFace) {
   pl_uInt bc;
   pl_uChar *remap;
   pl_Texture *Texture;
-  pl_uChar stat;
-
-  pl_ZBuffer Z1, ZL, dZ1=0, dZL=0, Z2, dZ2=0;
-  pl_sInt32 dU1=0, dV1=0, dU2=0, dV2=0, U1, V1, U2, V2;
-  pl_sInt32 dUL=0, dVL=0, UL, VL;
-  pl_sInt32 X1, X2, dX1=0, dX2=0, XL1, XL2;
-  pl_sInt32 Y1, Y2, Y0, dY;
-  pl_Bool zb = (zbuf&&TriFace->Material->zBufferable) ? 1 : 0;
+
+  pl_Float ZL, dZL=0;
+  pl_sInt32 dUL, dVL, UL, VL;
+  pl_sInt32 XL1, XL2;
+  double Zr = 0.0, dZx = 0.0, dZy = 0.0, Ur, dUx, dUy, Vr, dVx, dVy;
+  _pl_Fill f;
   pl_sInt shade;
 
-  if (TriFace->Material->Environment) Texture = TriFace->Material->Environment;
+  if (env) Texture = TriFace->Material->Environment;
   else Texture = TriFace->Material->Texture;
 
   if (!Texture) return;
@@ -3692,143 +5569,102 @@ PL_API void plPF_TexF(pl_Cam *cam, pl_Face *TriFace) {
   MappingV_AND = ((1<<Texture->Height)-1)<<Texture->Width;
   MappingU_AND = (1<<Texture->Width)-1;
 
-  if (TriFace->Material->Environment) {
+  if (env) {
     PUTFACE_SORT_ENV();
   } else {
     PUTFACE_SORT_TEX();
   }
 
-  U1 = U2 = MappingU1;
-  V1 = V2 = MappingV1;
-  X2 = X1 = TriFace->Scrx[i0];
-  Z2 = Z1 = TriFace->Scrz[i0];
-  Y0 = (TriFace->Scry[i0]+(1<<19))>>20;
-  Y1 = (TriFace->Scry[i1]+(1<<19))>>20;
-  Y2 = (TriFace->Scry[i2]+(1<<19))>>20;
-
-  dY = Y2 - Y0;
-  if (dY) {
-    dX2 = (TriFace->Scrx[i2] - X1) / dY;
-    dV2 = (MappingV3 - V1) / dY;
-    dU2 = (MappingU3 - U1) / dY;
-    dZ2 = (TriFace->Scrz[i2] - Z1) / dY;
-  }
-  dY = Y1-Y0;
-  if (dY) {
-    dX1 = (TriFace->Scrx[i1] - X1) / dY;
-    dZ1 = (TriFace->Scrz[i1] - Z1) / dY;
-    dU1 = (MappingU2 - U1) / dY;
-    dV1 = (MappingV2 - V1) / dY;
-    if (dX2 < dX1) {
-      dX2 ^= dX1; dX1 ^= dX2; dX2 ^= dX1;
-      dU2 ^= dU1; dU1 ^= dU2; dU2 ^= dU1;
-      dV2 ^= dV1; dV1 ^= dV2; dV2 ^= dV1;
-      dZL = dZ1; dZ1 = dZ2; dZ2 = dZL;
-      stat = 2;
-    } else stat = 1;
-  } else {
-    if (TriFace->Scrx[i1] > X1) {
-      X2 = TriFace->Scrx[i1];
-      Z2 = TriFace->Scrz[i1];
-      U2 = MappingU2;
-      V2 = MappingV2;
-      stat = 2|4;
-    } else {
-      X1 = TriFace->Scrx[i1];
-      Z1 = TriFace->Scrz[i1];
-      U1 = MappingU2;
-      V1 = MappingV2;
-      stat = 1|8;
-    }
+  if (!_plFillSetup(&f,cam,TriFace,i0,i1,i2)) {
+    _plFillStats(cam,PL_PF_TEXF,0,0,0);
+    return;
   }
-
-  gmem += (Y0 * cam->ScreenWidth);
-  zbuf += (Y0 * cam->ScreenWidth);
-
-  XL1 = (((dX1-dX2)*dY+(1<<19))>>20);
-  if (XL1) {
-    dUL = ((dU1-dU2)*dY)/XL1;
-    dVL = ((dV1-dV2)*dY)/XL1;
-    dZL = ((dZ1-dZ2)*dY)/XL1;
-  } else {
-    XL1 = ((X2-X1+(1<<19))>>20);
-    if (XL1) {
-      dUL = (U2-U1)/XL1;
-      dVL = (V2-V1)/XL1;
-      dZL = (Z2-Z1)/XL1;
-    }
+  _plFillPlane(&f,MappingU1,MappingU2,MappingU3,&Ur,&dUx,&dUy);
+  _plFillPlane(&f,MappingV1,MappingV2,MappingV3,&Vr,&dVx,&dVy);
+  dUL = (pl_sInt32) dUx;
+  dVL = (pl_sInt32) dVx;
+  if (zb) {
+    _plFillZPlane(&f,cam,TriFace,i0,i1,i2,&Zr,&dZx,&dZy);
+    dZL = (pl_Float) dZx;
   }
 
-  while (Y0 < Y2) {
-    if (Y0 == Y1) {
-      dY = Y2 - ((TriFace->Scry[i1]+(1<<19))>>20);
-      if (dY) {
-        if (stat & 1) {
-          X1 = TriFace->Scrx[i1];
-          dX1 = (TriFace->Scrx[i2]-TriFace->Scrx[i1])/dY;
-        }
-        if (stat & 2) {
-          X2 = TriFace->Scrx[i1];
-          dX2 = (TriFace->Scrx[i2]-TriFace->Scrx[i1])/dY;
-        }
-        if (stat & 4) {
-          X1 = TriFace->Scrx[i0];
-          dX1 = (TriFace->Scrx[i2]-TriFace->Scrx[i0])/dY;
-        }
-        if (stat & 8) {
-          X2 = TriFace->Scrx[i0];
-          dX2 = (TriFace->Scrx[i2]-TriFace->Scrx[i0])/dY;
-        }
-        dZ1 = (TriFace->Scrz[i2]-Z1) / dY;
-        dV1 = (MappingV3 - V1) / dY;
-        dU1 = (MappingU3 - U1) / dY;
-      }
-    }
-    XL1 = (X1+(1<<19))>>20;
-    XL2 = (X2+(1<<19))>>20;
-    ZL = Z1;
-    UL = U1;
-    VL = V1;
+  gmem += f.Y*cam->ScreenWidth*ps;
+  zbuf += (f.Y * cam->ScreenWidth);
+
+  while (f.Y < f.Yend) {
+    XL1 = _plFillLeft(&f);
+    XL2 = _plFillRight(&f);
     if ((XL2-XL1) > 0) {
+      ZL = (pl_Float) (Zr + XL1*dZx);
+      UL = (pl_sInt32) (Ur + XL1*dUx);
+      VL = (pl_sInt32) (Vr + XL1*dVx);
       XL2 -= XL1;
-      gmem += XL1;
+      spans ++;
+      pixels += XL2;
+      gmem += XL1*ps;
       zbuf += XL1;
       XL1 += XL2;
       if (zb) do {
-          if (*zbuf < ZL) {
-            *zbuf = ZL;
-            *gmem = remap[bc + texture[((UL >> 16)&MappingU_AND) +
-                                ((VL>>vshift)&MappingV_AND)]];
+          if (_plZTest(zb,cam,zbuf,_plZ(ZL))) {
+            if (zb == 1) *zbuf = _plZ(ZL);
+            written ++;
+            _plPutPixel(rgb,gmem,remap,rgbmap,
+                        bc + texture[((UL >> 16)&MappingU_AND) +
+                                     ((VL>>vshift)&MappingV_AND)]);
           }
           zbuf++;
-          gmem++;
+          gmem += ps;
           ZL += dZL;
           UL += dUL;
           VL += dVL;
         } while (--XL2);
       else do {
-          *gmem++ = remap[bc + texture[((UL >> 16)&MappingU_AND) +
-                                ((VL>>vshift)&MappingV_AND)]];
+          _plPutPixel(rgb,gmem,remap,rgbmap,
+                      bc + texture[((UL >> 16)&MappingU_AND) +
+                                   ((VL>>vshift)&MappingV_AND)]);
+          gmem += ps;
           UL += dUL;
           VL += dVL;
         } while (--XL2);
-      gmem -= XL1;
+      gmem -= XL1*ps;
       zbuf -= XL1;
     }
     zbuf += cam->ScreenWidth;
-    gmem += cam->ScreenWidth;
-    X1 += dX1;
-    X2 += dX2;
-    U1 += dU1;
-    V1 += dV1;
-    Z1 += dZ1;
-    Y0++;
+    gmem += cam->ScreenWidth*ps;
+    Zr += dZy;
+    Ur += dUy;
+    Vr += dVy;
+    _plFillNext(&f);
   }
+  _plFillStats(cam,PL_PF_TEXF,spans,pixels,zb ? written : pixels);
 }
 
-PL_API void plPF_TexG(pl_Cam *cam, pl_Face *TriFace) {
+/* Environment mapped variant of plPF_TexF(), picked by plMatInit() */
+static void _plPF_TexFEnv(pl_Cam *cam, pl_Face *TriFace) {
+  if (cam->frameBuffer32) {
+    _plPF_Textured(_plPF_TexF,cam,TriFace,1,1);
+  } else {
+    _plPF_Textured(_plPF_TexF,cam,TriFace,1,0);
+  }
+}
+
+PL_API void plPF_TexF(pl_Cam *cam, pl_Face *TriFace) {
+  if (TriFace->Material->Environment) _plPF_TexFEnv(cam,TriFace);
+  else if (cam->frameBuffer32) {
+    _plPF_Textured(_plPF_TexF,cam,TriFace,0,1);
+  } else {
+    _plPF_Textured(_plPF_TexF,cam,TriFace,0,0);
+  }
+}
+
+_PL_INLINE void _plPF_TexG(pl_Cam *cam, pl_Face *TriFace,
+                           const pl_uChar zb, const pl_Bool env,
+                           const pl_Bool rgb) {
+  pl_uInt32 spans = 0, pixels = 0, written = 0;
   pl_uChar i0, i1, i2;
-  pl_uChar *gmem = cam->frameBuffer;
+  pl_uChar *gmem = _plFrameBuffer(cam,rgb);
+  pl_ARGB *rgbmap = TriFace->Material->_RGBTable;
+  pl_sInt32 ps = _plPixelSize(rgb);
   pl_ZBuffer *zbuf = cam->zBuffer;
   pl_sInt32 MappingU1, MappingU2, MappingU3;
   pl_sInt32 MappingV1, MappingV2, MappingV3;
@@ -3839,16 +5675,16 @@ PL_API void plPF_TexG(pl_Cam *cam, pl_Face *TriFace) {
   pl_uInt16 *addtable;
   pl_Texture *Texture;
 
-  pl_sInt32 U1, V1, U2, V2, dU1=0, dU2=0, dV1=0, dV2=0, dUL=0, dVL=0, UL, VL;
-  pl_sInt32 X1, X2, dX1=0, dX2=0, XL1, XL2;
-  pl_sInt32 C1, C2, dC1=0, dC2=0, CL, dCL=0;
-  pl_ZBuffer Z1, ZL, dZ1=0, dZ2=0, dZL=0, Z2;
-  pl_sInt32 Y1, Y2, Y0, dY;
-  pl_uChar stat;
+  pl_sInt32 dUL, dVL, UL, VL;
+  pl_sInt32 XL1, XL2;
+  pl_sInt32 CL, dCL;
+  pl_Float ZL, dZL=0;
+  double Zr = 0.0, dZx = 0.0, dZy = 0.0, Ur, dUx, dUy, Vr, dVx, dVy;
+  double Cr, dCx, dCy;
+  _pl_Fill f;
 
-  pl_Bool zb = (zbuf&&TriFace->Material->zBufferable) ? 1 : 0;
 
-  if (TriFace->Material->Environment) Texture = TriFace->Material->Environment;
+  if (env) Texture = TriFace->Material->Environment;
   else Texture = TriFace->Material->Texture;
 
   if (!Texture) return;
@@ -3859,130 +5695,59 @@ PL_API void plPF_TexG(pl_Cam *cam, pl_Face *TriFace) {
   MappingV_AND = ((1<<Texture->Height)-1)<<Texture->Width;
   MappingU_AND = (1<<Texture->Width)-1;
 
-  if (TriFace->Material->Environment) {
+  if (env) {
     PUTFACE_SORT_ENV();
   } else {
     PUTFACE_SORT_TEX();
   }
 
-  C1 = C2 = TriFace->Shades[i0]*65535.0f;
-  U1 = U2 = MappingU1;
-  V1 = V2 = MappingV1;
-  X2 = X1 = TriFace->Scrx[i0];
-  Z2 = Z1 = TriFace->Scrz[i0];
-  Y0 = (TriFace->Scry[i0]+(1<<19))>>20;
-  Y1 = (TriFace->Scry[i1]+(1<<19))>>20;
-  Y2 = (TriFace->Scry[i2]+(1<<19))>>20;
-
-  dY = Y2 - Y0;
-  if (dY) {
-    dX2 = (TriFace->Scrx[i2] - X1) / dY;
-    dZ2 = (TriFace->Scrz[i2] - Z1) / dY;
-    dC2 = (TriFace->Shades[i2]*65535.0f - C1) / dY;
-    dU2 = (MappingU3 - U1) / dY;
-    dV2 = (MappingV3 - V1) / dY;
-  }
-  dY = Y1-Y0;
-  if (dY) {
-    dX1 = (TriFace->Scrx[i1] - X1) / dY;
-    dZ1 = (TriFace->Scrz[i1] - Z1) / dY;
-    dC1 = (TriFace->Shades[i1]*65535.0f - C1) / dY;
-    dU1 = (MappingU2 - U1) / dY;
-    dV1 = (MappingV2 - V1) / dY;
-    if (dX2 < dX1) {
-      dX2 ^= dX1; dX1 ^= dX2; dX2 ^= dX1;
-      dU2 ^= dU1; dU1 ^= dU2; dU2 ^= dU1;
-      dV2 ^= dV1; dV1 ^= dV2; dV2 ^= dV1;
-      dC2 ^= dC1; dC1 ^= dC2; dC2 ^= dC1;
-      dZL = dZ1; dZ1 = dZ2; dZ2 = dZL;
-      stat = 2;
-    } else stat = 1;
-  } else {
-    if (TriFace->Scrx[i1] > X1) {
-      X2 = TriFace->Scrx[i1];
-      Z2 = TriFace->Scrz[i1];
-      C2 = TriFace->Shades[i1]*65535.0f;
-      U2 = MappingU2;
-      V2 = MappingV2;
-      stat = 2|4;
-    } else {
-      X1 = TriFace->Scrx[i1];
-      Z1 = TriFace->Scrz[i1];
-      C1 = TriFace->Shades[i1]*65535.0f;
-      U1 = MappingU2;
-      V1 = MappingV2;
-      stat = 1|8;
-    }
+  if (!_plFillSetup(&f,cam,TriFace,i0,i1,i2)) {
+    _plFillStats(cam,PL_PF_TEXG,0,0,0);
+    return;
+  }
+  _plFillPlane(&f,MappingU1,MappingU2,MappingU3,&Ur,&dUx,&dUy);
+  _plFillPlane(&f,MappingV1,MappingV2,MappingV3,&Vr,&dVx,&dVy);
+  _plFillPlane(&f,TriFace->Shades[i0]*65535.0f,TriFace->Shades[i1]*65535.0f,
+               TriFace->Shades[i2]*65535.0f,&Cr,&dCx,&dCy);
+  dUL = (pl_sInt32) dUx;
+  dVL = (pl_sInt32) dVx;
+  dCL = (pl_sInt32) dCx;
+  if (zb) {
+    _plFillZPlane(&f,cam,TriFace,i0,i1,i2,&Zr,&dZx,&dZy);
+    dZL = (pl_Float) dZx;
   }
 
-  gmem += (Y0 * cam->ScreenWidth);
-  zbuf += (Y0 * cam->ScreenWidth);
+  gmem += f.Y*cam->ScreenWidth*ps;
+  zbuf += (f.Y * cam->ScreenWidth);
 
-  XL1 = (((dX1-dX2)*dY+(1<<19))>>20);
-  if (XL1) {
-    dUL = ((dU1-dU2)*dY)/XL1;
-    dVL = ((dV1-dV2)*dY)/XL1;
-    if (zb) dZL = ((dZ1-dZ2)*dY)/XL1;
-    dCL = ((dC1-dC2)*dY)/XL1;
-  } else {
-    XL1 = ((X2-X1+(1<<19))>>20);
-    if (XL1) {
-      dUL = (U2-U1)/XL1;
-      dVL = (V2-V1)/XL1;
-      if (zb) dZL = (Z2-Z1)/XL1;
-      dCL = (C2-C1)/(XL1);
-    }
-  }
-  while (Y0 < Y2) {
-    if (Y0 == Y1) {
-      dY = Y2 - ((TriFace->Scry[i1]+(1<<19))>>20);
-      if (dY) {
-        if (stat & 1) {
-          X1 = TriFace->Scrx[i1];
-          dX1 = (TriFace->Scrx[i2]-TriFace->Scrx[i1])/dY;
-        }
-        if (stat & 2) {
-          X2 = TriFace->Scrx[i1];
-          dX2 = (TriFace->Scrx[i2]-TriFace->Scrx[i1])/dY;
-        }
-        if (stat & 4) {
-          X1 = TriFace->Scrx[i0];
-          dX1 = (TriFace->Scrx[i2]-TriFace->Scrx[i0])/dY;
-        }
-        if (stat & 8) {
-          X2 = TriFace->Scrx[i0];
-          dX2 = (TriFace->Scrx[i2]-TriFace->Scrx[i0])/dY;
-        }
-        dZ1 = (TriFace->Scrz[i2]-Z1)/dY;
-        dV1 = (MappingV3 - V1) / dY;
-        dU1 = (MappingU3 - U1) / dY;
-        dC1 = (TriFace->Shades[i2]*65535.0f-C1)/dY;
-      }
-    }
-    XL1 = (X1+(1<<19))>>20;
-    XL2 = (X2+(1<<19))>>20;
-    CL = C1;
-    ZL = Z1;
-    UL = U1;
-    VL = V1;
+  while (f.Y < f.Yend) {
+    XL1 = _plFillLeft(&f);
+    XL2 = _plFillRight(&f);
     if ((XL2-XL1) > 0) {
+      CL = (pl_sInt32) (Cr + XL1*dCx);
+      ZL = (pl_Float) (Zr + XL1*dZx);
+      UL = (pl_sInt32) (Ur + XL1*dUx);
+      VL = (pl_sInt32) (Vr + XL1*dVx);
       XL2 -= XL1;
-      gmem += XL1;
+      spans ++;
+      pixels += XL2;
+      gmem += XL1*ps;
       zbuf += XL1;
       XL1 += XL2;
       if (zb) do {
-          if (*zbuf < ZL) {
+          if (_plZTest(zb,cam,zbuf,_plZ(ZL))) {
             int av;
             if (CL < 0) av=addtable[0];
             else if (CL > (255<<8)) av=addtable[255];
             else av=addtable[CL>>8];
-            *zbuf = ZL;
-            *gmem = remap[av +
-                            texture[((UL>>16)&MappingU_AND) +
-                                    ((VL>>vshift)&MappingV_AND)]];
+            if (zb == 1) *zbuf = _plZ(ZL);
+            written ++;
+            _plPutPixel(rgb,gmem,remap,rgbmap,
+                        av + texture[((UL>>16)&MappingU_AND) +
+                                     ((VL>>vshift)&MappingV_AND)]);
           }
           zbuf++;
-          gmem++;
+          gmem += ps;
           ZL += dZL;
           CL += dCL;
           UL += dUL;
@@ -3993,257 +5758,191 @@ PL_API void plPF_TexG(pl_Cam *cam, pl_Face *TriFace) {
           if (CL < 0) av=addtable[0];
           else if (CL > (255<<8)) av=addtable[255];
           else av=addtable[CL>>8];
-          *gmem++ = remap[av +
-                          texture[((UL>>16)&MappingU_AND) +
-                                  ((VL>>vshift)&MappingV_AND)]];
+          _plPutPixel(rgb,gmem,remap,rgbmap,
+                      av + texture[((UL>>16)&MappingU_AND) +
+                                   ((VL>>vshift)&MappingV_AND)]);
+          gmem += ps;
           CL += dCL;
           UL += dUL;
           VL += dVL;
         } while (--XL2);
-      gmem -= XL1;
+      gmem -= XL1*ps;
       zbuf -= XL1;
     }
     zbuf += cam->ScreenWidth;
-    gmem += cam->ScreenWidth;
-    Z1 += dZ1;
-    X1 += dX1;
-    X2 += dX2;
-    C1 += dC1;
-    U1 += dU1;
-    V1 += dV1;
-    Y0++;
+    gmem += cam->ScreenWidth*ps;
+    Zr += dZy;
+    Cr += dCy;
+    Ur += dUy;
+    Vr += dVy;
+    _plFillNext(&f);
+  }
+  _plFillStats(cam,PL_PF_TEXG,spans,pixels,zb ? written : pixels);
+}
+
+/* Environment mapped variant of plPF_TexG(), picked by plMatInit() */
+static void _plPF_TexGEnv(pl_Cam *cam, pl_Face *TriFace) {
+  if (cam->frameBuffer32) {
+    _plPF_Textured(_plPF_TexG,cam,TriFace,1,1);
+  } else {
+    _plPF_Textured(_plPF_TexG,cam,TriFace,1,0);
   }
 }
 
-PL_API void plPF_TransF(pl_Cam *cam, pl_Face *TriFace) {
+PL_API void plPF_TexG(pl_Cam *cam, pl_Face *TriFace) {
+  if (TriFace->Material->Environment) _plPF_TexGEnv(cam,TriFace);
+  else if (cam->frameBuffer32) {
+    _plPF_Textured(_plPF_TexG,cam,TriFace,0,1);
+  } else {
+    _plPF_Textured(_plPF_TexG,cam,TriFace,0,0);
+  }
+}
+
+_PL_INLINE void _plPF_TransF(pl_Cam *cam, pl_Face *TriFace,
+                             const pl_Bool zb, const pl_Bool rgb) {
+  pl_uInt32 spans = 0, pixels = 0, written = 0;
   pl_uChar i0, i1, i2;
-  pl_uChar *gmem = cam->frameBuffer;
+  pl_uChar *gmem = _plFrameBuffer(cam,rgb);
+  pl_ARGB *rgbmap = TriFace->Material->_RGBTable;
+  pl_sInt32 ps = _plPixelSize(rgb);
   pl_uChar *remap = TriFace->Material->_ReMapTable;
   pl_ZBuffer *zbuf = cam->zBuffer;
-  pl_sInt32 X1, X2, dX1=0, dX2=0, XL1, XL2;
-  pl_ZBuffer Z1, ZL, dZ1=0, dZL=0, dZ2=0, Z2;
-  pl_sInt32 Y1, Y2, Y0, dY;
+  pl_sInt32 XL1, XL2;
+  pl_Float ZL, dZL=0;
+  double Zr = 0.0, dZx = 0.0, dZy = 0.0;
+  _pl_Fill f;
   pl_uInt16 *lookuptable = TriFace->Material->_AddTable;
-  pl_uChar stat;
+  pl_uInt nb = TriFace->Material->_ColorsUsed-TriFace->Material->_tsfact;
   pl_sInt32 bc = (pl_sInt32) TriFace->fShade*TriFace->Material->_tsfact;
-  pl_Bool zb = (zbuf&&TriFace->Material->zBufferable) ? 1 : 0;
 
   PUTFACE_SORT();
 
   if (bc < 0) bc=0;
   if (bc > (pl_sInt32) TriFace->Material->_tsfact-1) bc=TriFace->Material->_tsfact-1;
-  remap+=bc;
-
-  X2 = X1 = TriFace->Scrx[i0];
-  Z2 = Z1 = TriFace->Scrz[i0];
-  Y0 = (TriFace->Scry[i0]+(1<<19))>>20;
-  Y1 = (TriFace->Scry[i1]+(1<<19))>>20;
-  Y2 = (TriFace->Scry[i2]+(1<<19))>>20;
-
-  dY = Y2 - Y0;
-  if (dY) {
-    dX2 = (TriFace->Scrx[i2] - X1) / dY;
-    dZ2 = (TriFace->Scrz[i2] - Z1) / dY;
-  }
-  dY = Y1-Y0;
-  if (dY) {
-    dX1 = (TriFace->Scrx[i1] - X1) / dY;
-    dZ1 = (TriFace->Scrz[i1] - Z1) / dY;
-    if (dX2 < dX1) {
-      dX2 ^= dX1; dX1 ^= dX2; dX2 ^= dX1;
-      dZL = dZ1; dZ1 = dZ2; dZ2 = dZL;
-      stat = 2;
-    } else stat = 1;
-  } else {
-    if (TriFace->Scrx[i1] > X1) {
-      X2 = TriFace->Scrx[i1];
-      Z2 = TriFace->Scrz[i1];
-      stat= 2|4;
-    } else {
-      X1 = TriFace->Scrx[i1];
-      Z1 = TriFace->Scrz[i1];
-      stat= 1|8;
-    }
-  }
+  if (rgb) rgbmap+=bc;
+  else remap+=bc;
 
-  gmem += (Y0 * cam->ScreenWidth);
-  zbuf += (Y0 * cam->ScreenWidth);
+  if (!_plFillSetup(&f,cam,TriFace,i0,i1,i2)) {
+    _plFillStats(cam,PL_PF_TRANSF,0,0,0);
+    return;
+  }
   if (zb) {
-    XL1 = (((dX1-dX2)*dY+(1<<19))>>20);
-    if (XL1) dZL = ((dZ1-dZ2)*dY)/XL1;
-    else {
-      XL1 = ((X2-X1+(1<<19))>>20);
-      if (XL1) dZL = (Z2-Z1)/XL1;
-    }
+    _plFillZPlane(&f,cam,TriFace,i0,i1,i2,&Zr,&dZx,&dZy);
+    dZL = (pl_Float) dZx;
   }
 
-  while (Y0 < Y2) {
-    if (Y0 == Y1) {
-      dY = Y2 - ((TriFace->Scry[i1]+(1<<19))>>20);
-      if (dY) {
-        if (stat & 1) {
-          X1 = TriFace->Scrx[i1];
-          dX1 = (TriFace->Scrx[i2]-TriFace->Scrx[i1])/dY;
-        }
-        if (stat & 2) {
-          X2 = TriFace->Scrx[i1];
-          dX2 = (TriFace->Scrx[i2]-TriFace->Scrx[i1])/dY;
-        }
-        if (stat & 4) {
-          X1 = TriFace->Scrx[i0];
-          dX1 = (TriFace->Scrx[i2]-TriFace->Scrx[i0])/dY;
-        }
-        if (stat & 8) {
-          X2 = TriFace->Scrx[i0];
-          dX2 = (TriFace->Scrx[i2]-TriFace->Scrx[i0])/dY;
-        }
-        dZ1 = (TriFace->Scrz[i2]- Z1)/dY;
-      }
-    }
-    XL1 = (X1+(1<<19))>>20;
-    XL2 = (X2+(1<<19))>>20;
-    ZL = Z1;
+  gmem += f.Y*cam->ScreenWidth*ps;
+  zbuf += (f.Y * cam->ScreenWidth);
+
+  while (f.Y < f.Yend) {
+    XL1 = _plFillLeft(&f);
+    XL2 = _plFillRight(&f);
     if ((XL2-XL1) > 0) {
+      ZL = (pl_Float) (Zr + XL1*dZx);
       XL2 -= XL1;
+      spans ++;
+      pixels += XL2;
       zbuf += XL1;
-      gmem += XL1;
+      gmem += XL1*ps;
       XL1 += XL2;
       if (zb) do {
-          if (*zbuf < ZL) {
-            *zbuf = ZL;
-            *gmem = remap[lookuptable[*gmem]];
+          if (*zbuf < _plZ(ZL)) {
+            *zbuf = _plZ(ZL);
+            written ++;
+            _plPutPixel(rgb,gmem,remap,rgbmap,
+                        _plBehind(rgb,gmem,lookuptable,nb));
           }
-          gmem++;
+          gmem += ps;
           zbuf++;
           ZL += dZL;
         } while (--XL2);
-      else do { *gmem = remap[lookuptable[*gmem]]; gmem++; } while (--XL2);
-      gmem -= XL1;
+      else do {
+          _plPutPixel(rgb,gmem,remap,rgbmap,
+                      _plBehind(rgb,gmem,lookuptable,nb));
+          gmem += ps;
+        } while (--XL2);
+      gmem -= XL1*ps;
       zbuf -= XL1;
     }
-    gmem += cam->ScreenWidth;
+    gmem += cam->ScreenWidth*ps;
     zbuf += cam->ScreenWidth;
-    Z1 += dZ1;
-    X1 += dX1;
-    X2 += dX2;
-    Y0 ++;
+    Zr += dZy;
+    _plFillNext(&f);
   }
+  _plFillStats(cam,PL_PF_TRANSF,spans,pixels,zb ? written : pixels);
 }
 
-PL_API void plPF_TransG(pl_Cam *cam, pl_Face *TriFace) {
+PL_API void plPF_TransF(pl_Cam *cam, pl_Face *TriFace) {
+  pl_Bool zb = cam->zBuffer && TriFace->Material->zBufferable;
+  if (cam->frameBuffer32) {
+    if (zb) _plPF_TransF(cam,TriFace,1,1);
+    else _plPF_TransF(cam,TriFace,0,1);
+  } else if (zb) _plPF_TransF(cam,TriFace,1,0);
+  else _plPF_TransF(cam,TriFace,0,0);
+}
+
+_PL_INLINE void _plPF_TransG(pl_Cam *cam, pl_Face *TriFace,
+                             const pl_Bool zb, const pl_Bool rgb) {
+  pl_uInt32 spans = 0, pixels = 0, written = 0;
   pl_uChar i0, i1, i2;
-  pl_uChar *gmem = cam->frameBuffer;
+  pl_uChar *gmem = _plFrameBuffer(cam,rgb);
+  pl_ARGB *rgbmap = TriFace->Material->_RGBTable;
+  pl_sInt32 ps = _plPixelSize(rgb);
   pl_uChar *remap = TriFace->Material->_ReMapTable;
   pl_ZBuffer *zbuf = cam->zBuffer;
-  pl_sInt32 X1, X2, dX1=0, dX2=0, XL1, XL2;
-  pl_ZBuffer Z1, ZL, dZ1=0, dZL=0, dZ2=0, Z2;
-  pl_sInt32 dC1=0, dCL=0, CL, C1, C2, dC2=0;
-  pl_sInt32 Y1, Y2, Y0, dY;
+  pl_sInt32 XL1, XL2;
+  pl_Float ZL, dZL=0;
+  pl_sInt32 dCL, CL;
+  double Zr = 0.0, dZx = 0.0, dZy = 0.0, Cr, dCx, dCy;
+  _pl_Fill f;
   pl_Float nc = (TriFace->Material->_tsfact*65536.0f);
   pl_uInt16 *lookuptable = TriFace->Material->_AddTable;
-  pl_Bool zb = (zbuf&&TriFace->Material->zBufferable) ? 1 : 0;
-  pl_uChar stat;
+  pl_uInt nb = TriFace->Material->_ColorsUsed-TriFace->Material->_tsfact;
 
   pl_sInt32 maxColor=((TriFace->Material->_tsfact-1)<<16);
   pl_sInt32 maxColorNonShift=TriFace->Material->_tsfact-1;
 
   PUTFACE_SORT();
 
-  C1 = C2 = (pl_sInt32) (TriFace->Shades[i0]*nc);
-  X2 = X1 = TriFace->Scrx[i0];
-  Z2 = Z1 = TriFace->Scrz[i0];
-  Y0 = (TriFace->Scry[i0]+(1<<19))>>20;
-  Y1 = (TriFace->Scry[i1]+(1<<19))>>20;
-  Y2 = (TriFace->Scry[i2]+(1<<19))>>20;
-
-  dY = Y2 - Y0;
-  if (dY) {
-    dX2 = (TriFace->Scrx[i2] - X1) / dY;
-    dC2 = (pl_sInt32) ((TriFace->Shades[i2]*nc - C1) / dY);
-    dZ2 = (TriFace->Scrz[i2] - Z1) / dY;
-  }
-  dY = Y1-Y0;
-  if (dY) {
-    dX1 = (TriFace->Scrx[i1] - X1) / dY;
-    dZ1 = (TriFace->Scrz[i1] - Z1) / dY;
-    dC1 = (pl_sInt32) ((TriFace->Shades[i1]*nc - C1) / dY);
-    if (dX2 < dX1) {
-      dX2 ^= dX1; dX1 ^= dX2; dX2 ^= dX1;
-      dC2 ^= dC1; dC1 ^= dC2; dC2 ^= dC1;
-      dZL = dZ1; dZ1 = dZ2; dZ2 = dZL;
-      stat = 2;
-    } else stat = 1;
-  } else {
-    if (TriFace->Scrx[i1] > X1) {
-      X2 = TriFace->Scrx[i1];
-      Z2 = TriFace->Scrz[i1];
-      C2 = (pl_sInt32) (TriFace->Shades[i1]*nc);
-      stat = 2|4;
-    } else {
-      X1 = TriFace->Scrx[i1];
-      Z1 = TriFace->Scrz[i1];
-      C1 = (pl_sInt32) (TriFace->Shades[i1]*nc);
-      stat = 1|8;
-    }
+  if (!_plFillSetup(&f,cam,TriFace,i0,i1,i2)) {
+    _plFillStats(cam,PL_PF_TRANSG,0,0,0);
+    return;
   }
-
-  gmem += (Y0 * cam->ScreenWidth);
-  zbuf += (Y0 * cam->ScreenWidth);
-  XL1 = (((dX1-dX2)*dY+(1<<19))>>20);
-  if (XL1) {
-    dCL = ((dC1-dC2)*dY)/XL1;
-    dZL = ((dZ1-dZ2)*dY)/XL1;
-  } else {
-    XL1 = ((X2-X1+(1<<19))>>20);
-    if (XL1) {
-      dCL = (C2-C1)/XL1;
-      dZL = (Z2-Z1)/XL1;
-    }
+  _plFillPlane(&f,TriFace->Shades[i0]*nc,TriFace->Shades[i1]*nc,
+               TriFace->Shades[i2]*nc,&Cr,&dCx,&dCy);
+  dCL = (pl_sInt32) dCx;
+  if (zb) {
+    _plFillZPlane(&f,cam,TriFace,i0,i1,i2,&Zr,&dZx,&dZy);
+    dZL = (pl_Float) dZx;
   }
 
-  while (Y0 < Y2) {
-    if (Y0 == Y1) {
-      dY = Y2 - ((TriFace->Scry[i1]+(1<<19))>>20);
-      if (dY) {
-        if (stat & 1) {
-          X1 = TriFace->Scrx[i1];
-          dX1 = (TriFace->Scrx[i2]-TriFace->Scrx[i1])/dY;
-        }
-        if (stat & 2) {
-          X2 = TriFace->Scrx[i1];
-          dX2 = (TriFace->Scrx[i2]-TriFace->Scrx[i1])/dY;
-        }
-        if (stat & 4) {
-          X1 = TriFace->Scrx[i0];
-          dX1 = (TriFace->Scrx[i2]-TriFace->Scrx[i0])/dY;
-        }
-        if (stat & 8) {
-          X2 = TriFace->Scrx[i0];
-          dX2 = (TriFace->Scrx[i2]-TriFace->Scrx[i0])/dY;
-        }
-        dZ1 = (TriFace->Scrz[i2]-Z1)/dY;
-        dC1 = (pl_sInt32) ((TriFace->Shades[i2]*nc - C1) / dY);
-      }
-    }
-    CL = C1;
-    XL1 = (X1+(1<<19))>>20;
-    XL2 = (X2+(1<<19))>>20;
-    ZL = Z1;
+  gmem += f.Y*cam->ScreenWidth*ps;
+  zbuf += (f.Y * cam->ScreenWidth);
+
+  while (f.Y < f.Yend) {
+    XL1 = _plFillLeft(&f);
+    XL2 = _plFillRight(&f);
     if ((XL2-XL1) > 0) {
+      CL = (pl_sInt32) (Cr + XL1*dCx);
+      ZL = (pl_Float) (Zr + XL1*dZx);
       XL2 -= XL1;
+      spans ++;
+      pixels += XL2;
       zbuf += XL1;
-      gmem += XL1;
+      gmem += XL1*ps;
       XL1 += XL2;
       if (zb) do {
-          if (*zbuf < ZL) {
+          if (*zbuf < _plZ(ZL)) {
             int av;
             if (CL >= maxColor) av=maxColorNonShift;
             else if (CL > 0) av=CL>>16;
             else av=0;
-            *zbuf = ZL;
-            *gmem = remap[av + lookuptable[*gmem]];
+            *zbuf = _plZ(ZL);
+            written ++;
+            _plPutPixel(rgb,gmem,remap,rgbmap,
+                        av + _plBehind(rgb,gmem,lookuptable,nb));
           }
-          gmem++;
+          gmem += ps;
           CL += dCL;
           zbuf++;
           ZL += dZL;
@@ -4253,21 +5952,30 @@ PL_API void plPF_TransG(pl_Cam *cam, pl_Face *TriFace) {
           if (CL >= maxColor) av=maxColorNonShift;
           else if (CL > 0) av=CL>>16;
           else av=0;
-          *gmem = remap[av + lookuptable[*gmem]];
-		  gmem++;
+          _plPutPixel(rgb,gmem,remap,rgbmap,
+                      av + _plBehind(rgb,gmem,lookuptable,nb));
+          gmem += ps;
           CL += dCL;
         } while (--XL2);
-      gmem -= XL1;
+      gmem -= XL1*ps;
       zbuf -= XL1;
     }
-    gmem += cam->ScreenWidth;
+    gmem += cam->ScreenWidth*ps;
     zbuf += cam->ScreenWidth;
-    Z1 += dZ1;
-    X1 += dX1;
-    X2 += dX2;
-    C1 += dC1;
-    Y0++;
+    Zr += dZy;
+    Cr += dCy;
+    _plFillNext(&f);
   }
+  _plFillStats(cam,PL_PF_TRANSG,spans,pixels,zb ? written : pixels);
+}
+
+PL_API void plPF_TransG(pl_Cam *cam, pl_Face *TriFace) {
+  pl_Bool zb = cam->zBuffer && TriFace->Material->zBufferable;
+  if (cam->frameBuffer32) {
+    if (zb) _plPF_TransG(cam,TriFace,1,1);
+    else _plPF_TransG(cam,TriFace,0,1);
+  } else if (zb) _plPF_TransG(cam,TriFace,1,0);
+  else _plPF_TransG(cam,TriFace,0,0);
 }
 
 /* Can't find another place to put this... */
@@ -4902,16 +6610,6 @@ static void _plRescaleImage(pl_uChar *in, pl_uChar *out, pl_uInt inx,
   } while (--outy);
 }
 
-typedef struct {
-  pl_Float zd;
-  pl_Face *face;
-} _faceInfo;
-
-typedef struct {
-  pl_Light *light;
-  pl_Float l[3];
-} _lightInfo;
-
 #define MACRO_plMatrixApply(m,x,y,z,outx,outy,outz) \
       ( outx ) = ( x )*( m )[0] + ( y )*( m )[1] + ( z )*( m )[2] + ( m )[3];\
       ( outy ) = ( x )*( m )[4] + ( y )*( m )[5] + ( z )*( m )[6] + ( m )[7];\
@@ -4931,59 +6629,983 @@ typedef struct {
   } \
 }
 
-static pl_uInt32 _numfaces;
-static _faceInfo _faces[PL_MAX_TRIANGLES];
-
-static pl_Float _cMatrix[16];
-static pl_uInt32 _numlights;
-static _lightInfo _lights[PL_MAX_LIGHTS];
-static pl_Cam *_cam;
-static void _RenderObj(pl_Obj *, pl_Float *, pl_Float *);
-static void _sift_down(int L, int U, int dir);
+static void _RenderObj(pl_RenderContext *, pl_Obj *, pl_Float *, pl_Float *,
+                       pl_Bool);
+static void _sift_down(_faceInfo *Base, int L, int U, int dir);
 static void _hsort(_faceInfo *base, int nel, int dir);
+static void _plRadixSort(_faceInfo *base, _faceInfo *scratch, pl_uInt32 nel,
+                         int dir);
+static void _plRunJobs(pl_RenderContext *ctx,
+                       void (*func)(pl_RenderContext *, pl_uInt),
+                       pl_uInt count);
+static void _plRasterBins(pl_RenderContext *ctx);
+static void _plXformJob(pl_RenderContext *ctx, pl_uInt index);
+static void _plLightJob(pl_RenderContext *ctx, pl_uInt index);
+
+/* Minimum number of vertices or faces per chunk of the parallel front end */
+#define _PL_XFORM_CHUNK 1024
+
+/*
+** Hierarchical z-buffer. Level 0 holds the farthest (smallest) 1/Z of each
+** 8x8 pixel tile of the camera z-buffer, level 1 the farthest of each 8x8
+** block of level 0 tiles. Drawing only brings pixels nearer, so a tile that
+** hasn't been recomputed since it was drawn to (a dirty one) is still a
+** safe lower bound; it is only recomputed when it fails a test.
+*/
+static void _plHiZBegin(pl_RenderContext *ctx, pl_Cam *cam) {
+  pl_uInt32 n0, n1, size;
+  pl_ZBuffer *buf;
+  ctx->hizOn = 0;
+  if (!cam->OcclusionCull || !cam->zBuffer) return;
+  ctx->hizW[0] = (cam->ScreenWidth+7)>>3;
+  ctx->hizH[0] = (cam->ScreenHeight+7)>>3;
+  ctx->hizW[1] = (ctx->hizW[0]+7)>>3;
+  ctx->hizH[1] = (ctx->hizH[0]+7)>>3;
+  n0 = ctx->hizW[0]*ctx->hizH[0];
+  n1 = ctx->hizW[1]*ctx->hizH[1];
+  size = (n0+n1)*(sizeof(pl_ZBuffer)+1);
+  if (size > ctx->hizSize) {
+    buf = (pl_ZBuffer *) realloc(ctx->hiz[0],size);
+    if (!buf) return;
+    ctx->hiz[0] = buf;
+    ctx->hizSize = size;
+  }
+  ctx->hiz[1] = ctx->hiz[0]+n0;
+  ctx->hizDirty[0] = (pl_uChar *) (ctx->hiz[1]+n1);
+  ctx->hizDirty[1] = ctx->hizDirty[0]+n0;
+  for (size = 0; size < n0+n1; size ++) ctx->hiz[0][size] = 0;
+  memset(ctx->hizDirty[0],1,n0+n1);
+  ctx->hizOn = 1;
+}
+
+static pl_ZBuffer _plHiZTile(pl_RenderContext *ctx, pl_uInt tx, pl_uInt ty,
+                             pl_Float zt) {
+  pl_uInt i = ty*ctx->hizW[0]+tx, x, y, w, h;
+  pl_uInt sw = ctx->clipCam->ScreenWidth;
+  pl_ZBuffer *zb, z;
+  if (ctx->hizDirty[0][i] && ctx->hiz[0][i] < zt) {
+    zb = ctx->clipCam->zBuffer + (ty<<3)*sw + (tx<<3);
+    w = plMin(8,sw-(tx<<3));
+    h = plMin(8,ctx->clipCam->ScreenHeight-(ty<<3));
+    z = zb[0];
+    for (y = 0; y < h; y ++) {
+      for (x = 0; x < w; x ++) if (zb[x] < z) z = zb[x];
+      zb += sw;
+    }
+    ctx->hiz[0][i] = z;
+    ctx->hizDirty[0][i] = 0;
+  }
+  return ctx->hiz[0][i];
+}
+
+static pl_ZBuffer _plHiZBlock(pl_RenderContext *ctx, pl_uInt bx, pl_uInt by,
+                              pl_Float zt) {
+  pl_uInt i = by*ctx->hizW[1]+bx, tx, ty, tx1, ty1;
+  pl_ZBuffer z, t;
+  if (ctx->hizDirty[1][i] && ctx->hiz[1][i] < zt) {
+    tx1 = plMin((bx+1)<<3,ctx->hizW[0]);
+    ty1 = plMin((by+1)<<3,ctx->hizH[0]);
+    z = _plHiZTile(ctx,bx<<3,by<<3,1e30f);
+    for (ty = by<<3; ty < ty1; ty ++)
+      for (tx = bx<<3; tx < tx1; tx ++)
+        if ((t = _plHiZTile(ctx,tx,ty,1e30f)) < z) z = t;
+    ctx->hiz[1][i] = z;
+    ctx->hizDirty[1][i] = 0;
+  }
+  return ctx->hiz[1][i];
+}
+
+/* Returns 1 if every pixel of x0..x1, y0..y1 (inclusive, on screen) is at
+   least as near as the 1/Z iz */
+static pl_Bool _plHiZOccluded(pl_RenderContext *ctx, pl_sInt32 x0,
+                              pl_sInt32 y0, pl_sInt32 x1, pl_sInt32 y1,
+                              double iz, pl_Bool level1) {
+  pl_Float zs = (pl_Float) (iz*_plZScale(ctx->clipCam)), z = _plZ(zs);
+  pl_uInt tx, ty, bx, by, tx0 = x0>>3, ty0 = y0>>3, tx1 = x1>>3, ty1 = y1>>3;
+  if (level1) {
+    for (by = ty0>>3; by <= ty1>>3; by ++)
+      for (bx = tx0>>3; bx <= tx1>>3; bx ++) {
+        if (_plHiZBlock(ctx,bx,by,z) >= z) continue;
+        for (ty = plMax(ty0,by<<3); ty <= plMin(ty1,(by<<3)+7); ty ++)
+          for (tx = plMax(tx0,bx<<3); tx <= plMin(tx1,(bx<<3)+7); tx ++)
+            if (_plHiZTile(ctx,tx,ty,z) < z) return 0;
+      }
+    return 1;
+  }
+  for (ty = ty0; ty <= ty1; ty ++)
+    for (tx = tx0; tx <= tx1; tx ++)
+      if (_plHiZTile(ctx,tx,ty,z) < z) return 0;
+  return 1;
+}
+
+static void _plHiZMarkDirty(pl_RenderContext *ctx, pl_sInt32 x0, pl_sInt32 y0,
+                            pl_sInt32 x1, pl_sInt32 y1, pl_Bool level1) {
+  pl_uInt ty;
+  for (ty = y0>>3; ty <= (pl_uInt) y1>>3; ty ++)
+    memset(ctx->hizDirty[0]+ty*ctx->hizW[0]+(x0>>3),1,(x1>>3)-(x0>>3)+1);
+  if (level1)
+    for (ty = y0>>6; ty <= (pl_uInt) y1>>6; ty ++)
+      memset(ctx->hizDirty[1]+ty*ctx->hizW[1]+(x0>>6),1,(x1>>6)-(x0>>6)+1);
+}
+
+static pl_Bool _plHiZCullFace(pl_RenderContext *ctx, pl_Face *face,
+                              pl_sInt top, pl_sInt bottom, pl_Bool level1) {
+  pl_sInt32 x0, y0, x1, y1;
+  double ax, ay, bx, by, az, bz, area, zmax, dzdx, dzdy;
+  _plFaceRows(face,y0,y1);
+  y0 = plMax(y0,top);
+  y1 = plMin(y1,bottom)-1;
+  x0 = plMin(face->Scrx[0],plMin(face->Scrx[1],face->Scrx[2]));
+  x1 = plMax(face->Scrx[0],plMax(face->Scrx[1],face->Scrx[2]));
+  x0 = plMax(_plFillPixel(x0),0);
+  x1 = plMin((x1+(1<<19))>>20,(pl_sInt32) ctx->clipCam->ScreenWidth-1);
+  if (y1 < y0 || x1 < x0) return 0;
+
+  /* The fillers step 1/Z incrementally in single precision along each span,
+     so allow for about two pixels of slope */
+  ax = (face->Scrx[1]-face->Scrx[0])*(1.0/(1<<20));
+  ay = (face->Scry[1]-face->Scry[0])*(1.0/(1<<20));
+  bx = (face->Scrx[2]-face->Scrx[0])*(1.0/(1<<20));
+  by = (face->Scry[2]-face->Scry[0])*(1.0/(1<<20));
+  az = face->Scrz[1]-face->Scrz[0];
+  bz = face->Scrz[2]-face->Scrz[0];
+  area = ax*by-bx*ay;
+  zmax = plMax(face->Scrz[0],plMax(face->Scrz[1],face->Scrz[2]));
+  if (area > 0.25 || area < -0.25) {
+    dzdx = (az*by-bz*ay)/area;
+    dzdy = (bz*ax-az*bx)/area;
+    zmax += 2.0*(fabs(dzdx)+fabs(dzdy)) + zmax*(1.0/1024);
+    if (_plHiZOccluded(ctx,x0,y0,x1,y1,zmax,0)) return 1;
+  }
+  _plHiZMarkDirty(ctx,x0,y0,x1,y1,level1);
+  return 0;
+}
+
+/* Tests a transformed object against the z-buffer pyramid */
+static pl_Bool _plHiZCullObj(pl_RenderContext *ctx, pl_Obj *obj) {
+  pl_Vertex *v = ctx->xfVerts;
+  pl_Face *f = obj->Faces;
+  pl_uInt32 i;
+  double x0 = 1e30, y0 = 1e30, x1 = -1e30, y1 = -1e30, z, zmin, zmax = 0.0;
+  double sx, sy, fy = ctx->fov*ctx->adj_asp;
+  pl_Cam *cam = ctx->clipCam;
+  for (i = 0; i < obj->NumFaces; i ++)
+    if (!(f++)->Material->zBufferable) return 0;
+  zmin = 1e30;
+  for (i = 0; i < obj->NumVertices; i ++) {
+    if (v->xformedz < 0.001) return 0;
+    z = 1.0/v->xformedz;
+    sx = cam->CenterX + ctx->fov*v->xformedx*z;
+    sy = cam->CenterY - fy*v->xformedy*z;
+    if (sx < x0) x0 = sx;
+    if (sx > x1) x1 = sx;
+    if (sy < y0) y0 = sy;
+    if (sy > y1) y1 = sy;
+    if (z > zmax) zmax = z;
+    if (z < zmin) zmin = z;
+    v++;
+  }
+  /* Same allowance as _plHiZCullFace(), without the per-face slopes: pad by
+     two pixels and by the depth range of the object */
+  x0 = plMax(x0-2.0,cam->ClipLeft);
+  y0 = plMax(y0-2.0,cam->ClipTop);
+  x1 = plMin(x1+2.0,cam->ClipRight-1);
+  y1 = plMin(y1+2.0,cam->ClipBottom-1);
+  if (x1 < x0 || y1 < y0) return 0;
+  zmax += (zmax-zmin) + zmax*(1.0/1024);
+  return _plHiZOccluded(ctx,(pl_sInt32) x0,(pl_sInt32) y0,
+                        (pl_sInt32) x1,(pl_sInt32) y1,zmax,1);
+}
+
+PL_API pl_RenderContext *plRenderContextCreate() {
+  pl_RenderContext *ctx;
+  ctx = (pl_RenderContext *) malloc(sizeof(pl_RenderContext));
+  if (!ctx) return 0;
+  memset(ctx,0,sizeof(pl_RenderContext));
+  ctx->TriStats = ctx->_TriStats;
+  ctx->numThreads = 1;
+  return ctx;
+}
+
+PL_API void plRenderContextDelete(pl_RenderContext *ctx) {
+  if (ctx) {
+    plRenderContextSetThreads(ctx,1);
+    if (ctx->faces) free(ctx->faces);
+    if (ctx->sortScratch) free(ctx->sortScratch);
+    if (ctx->hiz[0]) free(ctx->hiz[0]);
+    if (ctx->visIds) free(ctx->visIds);
+    if (ctx->visFaces) free(ctx->visFaces);
+    if (ctx->binFaces) free(ctx->binFaces);
+    if (ctx->binStart) free(ctx->binStart);
+    if (ctx->binIndex) free(ctx->binIndex);
+    if (ctx->binStats) free(ctx->binStats);
+    while (ctx->scratch) {
+      ctx->scratchCur = ctx->scratch->next;
+      free(ctx->scratch);
+      ctx->scratch = ctx->scratchCur;
+    }
+    free(ctx);
+  }
+}
+
+#ifdef PL_THREADS
+static void *_plWorkerThread(void *arg) {
+  pl_RenderContext *ctx = (pl_RenderContext *) arg;
+  pl_uInt generation = 0, i;
+  pthread_mutex_lock(&ctx->jobMutex);
+  for (;;) {
+    while (!ctx->jobQuit && ctx->jobGeneration == generation)
+      pthread_cond_wait(&ctx->jobCond,&ctx->jobMutex);
+    if (ctx->jobQuit) break;
+    generation = ctx->jobGeneration;
+    while (ctx->jobNext < ctx->jobCount) {
+      i = ctx->jobNext++;
+      pthread_mutex_unlock(&ctx->jobMutex);
+      ctx->jobFunc(ctx,i);
+      pthread_mutex_lock(&ctx->jobMutex);
+      if (++ctx->jobDone == ctx->jobCount) pthread_cond_signal(&ctx->doneCond);
+    }
+  }
+  pthread_mutex_unlock(&ctx->jobMutex);
+  return 0;
+}
+#endif
+
+PL_API pl_uInt plRenderContextSetThreads(pl_RenderContext *ctx,
+                                         pl_uInt threads) {
+#ifdef PL_THREADS
+  pl_uInt i;
+  if (threads < 1) threads = 1;
+  if (threads > PL_MAX_THREADS) threads = PL_MAX_THREADS;
+  if (threads == ctx->numThreads) return threads;
+  if (ctx->numThreads > 1) {
+    pthread_mutex_lock(&ctx->jobMutex);
+    ctx->jobQuit = 1;
+    pthread_cond_broadcast(&ctx->jobCond);
+    pthread_mutex_unlock(&ctx->jobMutex);
+    for (i = 1; i < ctx->numThreads; i ++) pthread_join(ctx->threads[i],0);
+    pthread_cond_destroy(&ctx->doneCond);
+    pthread_cond_destroy(&ctx->jobCond);
+    pthread_mutex_destroy(&ctx->jobMutex);
+  }
+  ctx->numThreads = 1;
+  if (threads > 1) {
+    pthread_mutex_init(&ctx->jobMutex,0);
+    pthread_cond_init(&ctx->jobCond,0);
+    pthread_cond_init(&ctx->doneCond,0);
+    ctx->jobQuit = 0;
+    ctx->jobGeneration = ctx->jobNext = ctx->jobDone = ctx->jobCount = 0;
+    for (i = 1; i < threads; i ++) {
+      if (pthread_create(&ctx->threads[i],0,_plWorkerThread,ctx)) break;
+      ctx->numThreads++;
+    }
+  }
+#else
+  (void) threads;
+#endif
+  return ctx->numThreads;
+}
+
+PL_API void plRenderContextSetBinning(pl_RenderContext *ctx,
+                                      pl_uInt binHeight) {
+  ctx->binHeight = binHeight;
+}
+
+/* Runs func(ctx,0..count-1) on the worker threads and the calling thread,
+   and waits for all of them to finish */
+static void _plRunJobs(pl_RenderContext *ctx,
+                       void (*func)(pl_RenderContext *, pl_uInt),
+                       pl_uInt count) {
+  pl_uInt i;
+#ifdef PL_THREADS
+  if (ctx->numThreads > 1 && count > 1) {
+    pthread_mutex_lock(&ctx->jobMutex);
+    ctx->jobFunc = func;
+    ctx->jobCount = count;
+    ctx->jobNext = ctx->jobDone = 0;
+    ctx->jobGeneration++;
+    pthread_cond_broadcast(&ctx->jobCond);
+    while (ctx->jobNext < ctx->jobCount) {
+      i = ctx->jobNext++;
+      pthread_mutex_unlock(&ctx->jobMutex);
+      func(ctx,i);
+      pthread_mutex_lock(&ctx->jobMutex);
+      ctx->jobDone++;
+    }
+    while (ctx->jobDone < ctx->jobCount)
+      pthread_cond_wait(&ctx->doneCond,&ctx->jobMutex);
+    pthread_mutex_unlock(&ctx->jobMutex);
+    return;
+  }
+#endif
+  ctx->jobFunc = func;
+  for (i = 0; i < count; i ++) func(ctx,i);
+}
+
+/* Looks up n pixels of in in pal, writing each one scale times to out */
+static void _plConvertRow(pl_ARGB *out, const pl_uChar *in, pl_uInt n,
+                          const pl_ARGB *pal, pl_uInt scale) {
+  pl_uInt i = 0, k;
+  pl_ARGB c;
+  if (scale == 1) {
+#if defined(_PL_AVX2)
+    for (; i + 8 <= n; i += 8)
+      _mm256_storeu_si256((__m256i *) (out+i),_mm256_i32gather_epi32(
+        (const int *) pal,_mm256_cvtepu8_epi32(
+          _mm_loadl_epi64((const __m128i *) (in+i))),4));
+#elif defined(_PL_SSE2)
+    for (; i + 4 <= n; i += 4)
+      _mm_storeu_si128((__m128i *) (out+i),_mm_setr_epi32(
+        (int) pal[in[i]],(int) pal[in[i+1]],
+        (int) pal[in[i+2]],(int) pal[in[i+3]]));
+#endif
+    for (; i < n; i ++) out[i] = pal[in[i]];
+    return;
+  }
+  if (scale == 2) {
+#if defined(_PL_AVX2)
+    for (; i + 8 <= n; i += 8) {
+      __m256i v = _mm256_i32gather_epi32((const int *) pal,
+        _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *) (in+i))),4);
+      __m256i lo = _mm256_unpacklo_epi32(v,v), hi = _mm256_unpackhi_epi32(v,v);
+      _mm256_storeu_si256((__m256i *) (out+2*i),
+                          _mm256_permute2x128_si256(lo,hi,0x20));
+      _mm256_storeu_si256((__m256i *) (out+2*i+8),
+                          _mm256_permute2x128_si256(lo,hi,0x31));
+    }
+#elif defined(_PL_SSE2)
+    for (; i + 4 <= n; i += 4) {
+      __m128i v = _mm_setr_epi32((int) pal[in[i]],(int) pal[in[i+1]],
+                                 (int) pal[in[i+2]],(int) pal[in[i+3]]);
+      _mm_storeu_si128((__m128i *) (out+2*i),_mm_unpacklo_epi32(v,v));
+      _mm_storeu_si128((__m128i *) (out+2*i+4),_mm_unpackhi_epi32(v,v));
+    }
+#endif
+  }
+  for (out += i*scale; i < n; i ++) {
+    c = pal[in[i]];
+    for (k = 0; k < scale; k ++) *out++ = c;
+  }
+}
+
+/* Converts band index of the framebuffer for plFramebufferToARGBCtx(), each
+   row once and then copied to the scale-1 rows below it */
+static void _plConvertJob(pl_RenderContext *ctx, pl_uInt index) {
+  pl_Cam *cam = ctx->cvtCam;
+  pl_uInt w = cam->ScreenWidth, s = ctx->cvtScale, y, k;
+  pl_uInt y1 = plMin((index+1)*ctx->cvtRows,cam->ScreenHeight);
+  pl_ARGB *out;
+  for (y = index*ctx->cvtRows; y < y1; y ++) {
+    out = ctx->cvtOut + (size_t) y*s*ctx->cvtStride;
+    _plConvertRow(out,cam->frameBuffer + (size_t) y*w,w,ctx->cvtPalette,s);
+    for (k = 1; k < s; k ++)
+      memcpy(out + (size_t) k*ctx->cvtStride,out,w*s*sizeof(pl_ARGB));
+  }
+}
+
+PL_API void plFramebufferToARGB(pl_Cam *cam, const pl_uChar *palette,
+                                pl_ARGB *out, pl_uInt stride) {
+  plFramebufferToARGBCtx(0,cam,palette,out,stride,1);
+}
+
+PL_API void plFramebufferToARGBCtx(pl_RenderContext *ctx, pl_Cam *cam,
+                                   const pl_uChar *palette, pl_ARGB *out,
+                                   pl_uInt stride, pl_uInt scale) {
+  pl_uInt i, bands = 1;
+  if (!ctx) ctx = _plDefault();
+  if (scale < 1) scale = 1;
+  for (i = 0; i < 256; i ++)
+    ctx->cvtPalette[i] = 0xFF000000 | ((pl_ARGB) palette[i*3]<<16) |
+                         ((pl_ARGB) palette[i*3+1]<<8) | palette[i*3+2];
+  ctx->cvtCam = cam;
+  ctx->cvtOut = out;
+  ctx->cvtStride = stride ? stride : cam->ScreenWidth*scale;
+  ctx->cvtScale = scale;
+  if (ctx->numThreads > 1) bands = ctx->numThreads*4;
+  ctx->cvtRows = plMax((cam->ScreenHeight+bands-1)/bands,16);
+  _plRunJobs(ctx,_plConvertJob,
+             (cam->ScreenHeight+ctx->cvtRows-1)/ctx->cvtRows);
+}
+
+/*
+** Visibility buffer (see pl_Cam.VisBuffer and pl_Cam.DepthPrepass).
+** _plVisSetup() picks the faces to defer as they are binned, and sets up
+** their planes for the visibility buffer. The first pass, _plVisFill(),
+** writes the depth and id of the faces of a bin. The second is either
+** _plVisResolve(), which shades each pixel that has an id with
+** _plVisShade(), or the fillers, with the test of _plZTest() on the ids.
+** _plVisClear() then puts the ids back to 0.
+*/
+static void _plVisBegin(pl_RenderContext *ctx, pl_Cam *cam) {
+  pl_uInt32 n = cam->ScreenWidth*cam->ScreenHeight, size;
+  pl_uInt *ids;
+  ctx->visOn = 0;
+  if ((!cam->VisBuffer && !cam->DepthPrepass) || !cam->zBuffer || !n) return;
+  size = n*sizeof(pl_uInt) + cam->ScreenHeight*2*sizeof(pl_sInt32);
+  if (size > ctx->visSize) {
+    ids = (pl_uInt *) realloc(ctx->visIds,size);
+    if (!ids) return;
+    ctx->visIds = ids;
+    ctx->visSize = size;
+    ctx->visPixels = 0;
+  }
+  /* _plVisClear() puts back to 0 what the first pass wrote, so this is
+     only needed when the ids move over the row spans */
+  if (n != ctx->visPixels) {
+    memset(ctx->visIds,0,n*sizeof(pl_uInt));
+    ctx->visPixels = n;
+  }
+  ctx->visX0 = (pl_sInt32 *) (ctx->visIds+n);
+  ctx->visX1 = ctx->visX0+cam->ScreenHeight;
+  ctx->visPrepass = !cam->VisBuffer;
+  ctx->visOn = 1;
+}
+
+/* The value of plane p on pixel x of row y */
+#define _plVisAt(p,x,y) ((p)[0] + (x)*(p)[1] + (y)*(p)[2])
+
+/* Sets up v for face, with its planes if planes is set, or leaves it to its
+   filler if that is not one of the textured ones. The planes are set up the
+   same way as the fillers set up their values. */
+static void _plVisSetup(_plVisFace *v, pl_Face *face, pl_Bool planes) {
+  pl_Mat *m = face->Material;
+  void (*putface)(pl_Cam *, pl_Face *) = m->_PutFace;
+  pl_Texture *Texture, *Environment = m->Environment;
+  pl_Float mu[3], mv[3], eu[3], ev[3], cs = 65535.0f;
+  pl_Bool env, persp = 0;
+  pl_sInt shade;
+  pl_uInt a;
+  _pl_Fill f;
+
+  v->pf = PL_NUM_PF;
+  if (!m->zBufferable) return;
+  env = Environment && putface != plPF_TexEnv;
+  if (putface == plPF_TexF || putface == _plPF_TexFEnv) v->pf = PL_PF_TEXF;
+  else if (putface == plPF_TexG || putface == _plPF_TexGEnv)
+    v->pf = PL_PF_TEXG;
+  else if (putface == plPF_PTexF || putface == _plPF_PTexFEnv)
+    v->pf = PL_PF_PTEXF;
+  else if (putface == plPF_PTexG || putface == _plPF_PTexGEnv)
+    v->pf = PL_PF_PTEXG;
+  else if (putface == plPF_TexEnv) v->pf = PL_PF_TEXENV;
+  else return;
+  Texture = env ? Environment : m->Texture;
+  /* Without their tables the fillers draw nothing, or can't draw at all */
+  if (!Texture || (v->pf == PL_PF_TEXENV && !Environment) ||
+      (!m->_AddTable && (v->pf == PL_PF_TEXG || v->pf == PL_PF_PTEXG ||
+                         v->pf == PL_PF_TEXENV))) {
+    v->pf = PL_NUM_PF;
+    return;
+  }
+  if (!planes) return;
+  v->texture = Texture->Data;
+  v->remap = m->_ReMapTable;
+  v->rgbmap = m->_RGBTable;
+  v->addtable = m->_AddTable;
+  v->uAnd = (1<<Texture->Width)-1;
+  v->vAnd = ((1<<Texture->Height)-1)<<Texture->Width;
+  v->vshift = 16 - Texture->Width;
+  v->bc = 0;
+  if (v->pf == PL_PF_TEXF || v->pf == PL_PF_PTEXF) {
+    if (v->pf == PL_PF_TEXF) shade = (pl_sInt) (face->fShade*255.0f);
+    else shade = (pl_sInt) (face->fShade*256.0);
+    if (shade < 0) shade = 0;
+    if (shade > 255) shade = 255;
+    if (m->_AddTable) v->bc = m->_AddTable[shade];
+  }
+  if (v->pf == PL_PF_PTEXF || v->pf == PL_PF_PTEXG) {
+    persp = 1;
+    cs = 65536.0f;
+  }
+  for (a = 0; a < 3; a ++) {
+    if (env) {
+      mu[a] = face->eMappingU[a]*Texture->uScale*m->EnvScaling;
+      mv[a] = face->eMappingV[a]*Texture->vScale*m->EnvScaling;
+    } else {
+      mu[a] = face->MappingU[a]*Texture->uScale*m->TexScaling;
+      mv[a] = face->MappingV[a]*Texture->vScale*m->TexScaling;
+    }
+    if (persp) {
+      mu[a] *= face->Scrz[a]/65536.0f;
+      mv[a] *= face->Scrz[a]/65536.0f;
+    } else {
+      mu[a] = (pl_Float) (pl_sInt32) mu[a];
+      mv[a] = (pl_Float) (pl_sInt32) mv[a];
+    }
+  }
+  _plFillBasis(&f,face,0,1,2);
+  f.Y = 0;
+  _plFillPlane(&f,mu[0],mu[1],mu[2],v->u,v->u+1,v->u+2);
+  _plFillPlane(&f,mv[0],mv[1],mv[2],v->v,v->v+1,v->v+2);
+  _plFillPlane(&f,face->Shades[0]*cs,face->Shades[1]*cs,face->Shades[2]*cs,
+               v->c,v->c+1,v->c+2);
+  _plFillPlane(&f,face->Scrz[0],face->Scrz[1],face->Scrz[2],
+               v->z,v->z+1,v->z+2);
+  if (v->pf == PL_PF_TEXENV) {
+    for (a = 0; a < 3; a ++) {
+      eu[a] = (pl_Float) (pl_sInt32) (face->eMappingU[a]*Environment->uScale*
+                                      m->EnvScaling);
+      ev[a] = (pl_Float) (pl_sInt32) (face->eMappingV[a]*Environment->vScale*
+                                      m->EnvScaling);
+    }
+    _plFillPlane(&f,eu[0],eu[1],eu[2],v->eu,v->eu+1,v->eu+2);
+    _plFillPlane(&f,ev[0],ev[1],ev[2],v->ev,v->ev+1,v->ev+2);
+    v->environment = Environment->Data;
+    v->euAnd = (1<<Environment->Width)-1;
+    v->evAnd = ((1<<Environment->Height)-1)<<Environment->Width;
+    v->evshift = 16 - Environment->Width;
+  }
+}
+
+/*
+** First pass: fills face TriFace with id, writing only the z-buffer and the
+** ids and row spans of ctx, and counts it for pl_RenderStats as filler pf,
+** with no pixels written.
+** Returns: the number of pixels that passed the z-buffer test
+*/
+static pl_uInt32 _plVisFill(pl_Cam *cam, pl_Face *TriFace,
+                            pl_RenderContext *ctx, pl_uInt id, pl_uInt pf) {
+  pl_uInt32 spans = 0, pixels = 0, written = 0;
+  pl_uChar i0, i1, i2;
+  pl_ZBuffer *zbuf = cam->zBuffer;
+  pl_uInt *ids = ctx->visIds;
+  pl_sInt32 XL1, XL2;
+  pl_Float ZL, dZL, zs = 1.0f;
+  double Zr, dZx, dZy;
+  _pl_Fill f;
+
+  PUTFACE_SORT();
+
+  if (!_plFillSetup(&f,cam,TriFace,i0,i1,i2)) {
+    _plFillStats(cam,pf,0,0,0);
+    return 0;
+  }
+  /* The same z as the filler would write */
+  if (pf == PL_PF_PTEXF || pf == PL_PF_PTEXG) {
+    zs = _plZScale(cam);
+    _plFillPlane(&f,TriFace->Scrz[i0],TriFace->Scrz[i1],TriFace->Scrz[i2],
+                 &Zr,&dZx,&dZy);
+  } else _plFillZPlane(&f,cam,TriFace,i0,i1,i2,&Zr,&dZx,&dZy);
+  dZL = (pl_Float) dZx;
+
+  zbuf += (f.Y * cam->ScreenWidth);
+  ids += (f.Y * cam->ScreenWidth);
+
+  while (f.Y < f.Yend) {
+    XL1 = _plFillLeft(&f);
+    XL2 = _plFillRight(&f);
+    if ((XL2-XL1) > 0) {
+      spans ++;
+      pixels += XL2-XL1;
+      if (XL1 < ctx->visX0[f.Y]) ctx->visX0[f.Y] = XL1;
+      if (XL2 > ctx->visX1[f.Y]) ctx->visX1[f.Y] = XL2;
+      ZL = (pl_Float) (Zr + XL1*dZx);
+      do {
+        if (zbuf[XL1] < _plZ(ZL*zs)) {
+          zbuf[XL1] = _plZ(ZL*zs);
+          ids[XL1] = id;
+          written ++;
+        }
+        ZL += dZL;
+      } while (++XL1 < XL2);
+    }
+    zbuf += cam->ScreenWidth;
+    ids += cam->ScreenWidth;
+    Zr += dZy;
+    _plFillNext(&f);
+  }
+  _plFillStats(cam,pf,spans,pixels-written,0);
+  return written;
+}
+
+/* Shades the n pixels from gmem on, x to x+n-1 of row y, as face v with
+   filler pf, to frameBuffer32 if rgb is set. The texture perspective is
+   corrected on every pixel. */
+_PL_INLINE void _plVisShade(const _plVisFace *v, pl_uChar *gmem,
+                            pl_sInt32 x, pl_sInt32 y, pl_sInt32 n,
+                            const pl_uInt pf, const pl_Bool rgb) {
+  pl_uChar *texture = v->texture, *remap = v->remap;
+  pl_ARGB *rgbmap = v->rgbmap;
+  pl_uInt16 *addtable = v->addtable;
+  pl_sInt32 MappingU_AND = v->uAnd, MappingV_AND = v->vAnd;
+  pl_uChar vshift = v->vshift;
+  pl_uInt av = v->bc;
+  pl_sInt32 CL = 0, dCL = 0;
+  const pl_Bool gouraud = pf == PL_PF_TEXG || pf == PL_PF_PTEXG;
+
+  if (gouraud) {
+    CL = (pl_sInt32) _plVisAt(v->c,x,y);
+    dCL = (pl_sInt32) v->c[1];
+  }
+  if (pf == PL_PF_PTEXF || pf == PL_PF_PTEXG) {
+    pl_Float ZL = (pl_Float) _plVisAt(v->z,x,y), dZL = (pl_Float) v->z[1];
+    pl_Float UL = (pl_Float) _plVisAt(v->u,x,y), dUL = (pl_Float) v->u[1];
+    pl_Float VL = (pl_Float) _plVisAt(v->v,x,y), dVL = (pl_Float) v->v[1];
+    pl_Float t;
+    do {
+      if (gouraud) {
+        if (CL < 0) av=addtable[0];
+        else if (CL > (255<<8)) av=addtable[255];
+        else av=addtable[CL>>8];
+        CL += dCL;
+      }
+      t = 65536.0f/ZL;
+      _plPutPixel(rgb,gmem,remap,rgbmap,av +
+                  texture[((((pl_sInt32) (UL*t))>>16)&MappingU_AND) +
+                          ((((pl_sInt32) (VL*t))>>vshift)&MappingV_AND)]);
+      gmem += _plPixelSize(rgb);
+      ZL += dZL;
+      UL += dUL;
+      VL += dVL;
+    } while (--n);
+  } else {
+    pl_sInt32 UL = (pl_sInt32) _plVisAt(v->u,x,y), dUL = (pl_sInt32) v->u[1];
+    pl_sInt32 VL = (pl_sInt32) _plVisAt(v->v,x,y), dVL = (pl_sInt32) v->v[1];
+    pl_sInt32 eUL = 0, eVL = 0, edUL = 0, edVL = 0;
+    if (pf == PL_PF_TEXENV) {
+      eUL = (pl_sInt32) _plVisAt(v->eu,x,y);
+      eVL = (pl_sInt32) _plVisAt(v->ev,x,y);
+      edUL = (pl_sInt32) v->eu[1];
+      edVL = (pl_sInt32) v->ev[1];
+    }
+    do {
+      if (gouraud) {
+        if (CL < 0) av=addtable[0];
+        else if (CL > (255<<8)) av=addtable[255];
+        else av=addtable[CL>>8];
+        CL += dCL;
+      } else if (pf == PL_PF_TEXENV) {
+        av = addtable[v->environment[((eUL>>16)&v->euAnd) +
+                                     ((eVL>>v->evshift)&v->evAnd)]];
+        eUL += edUL;
+        eVL += edVL;
+      }
+      _plPutPixel(rgb,gmem,remap,rgbmap,
+                  av + texture[((UL>>16)&MappingU_AND) +
+                               ((VL>>vshift)&MappingV_AND)]);
+      gmem += _plPixelSize(rgb);
+      UL += dUL;
+      VL += dVL;
+    } while (--n);
+  }
+}
+
+/* _plVisShade() with the filler of face v */
+_PL_INLINE void _plVisShadeFace(const _plVisFace *v, pl_uChar *gmem,
+                                pl_sInt32 x, pl_sInt32 y, pl_sInt32 n,
+                                const pl_Bool rgb) {
+  switch (v->pf) {
+    case PL_PF_TEXF: _plVisShade(v,gmem,x,y,n,PL_PF_TEXF,rgb); break;
+    case PL_PF_TEXG: _plVisShade(v,gmem,x,y,n,PL_PF_TEXG,rgb); break;
+    case PL_PF_TEXENV: _plVisShade(v,gmem,x,y,n,PL_PF_TEXENV,rgb); break;
+    case PL_PF_PTEXF: _plVisShade(v,gmem,x,y,n,PL_PF_PTEXF,rgb); break;
+    case PL_PF_PTEXG: _plVisShade(v,gmem,x,y,n,PL_PF_PTEXG,rgb); break;
+  }
+}
+
+/* Second pass of VisBuffer: shades rows y0 to y1-1, a run of pixels of the
+   same face at a time, and adds the pixels shaded to stats.
+   Returns: the number of pixels shaded */
+static pl_uInt32 _plVisResolve(pl_RenderContext *ctx, pl_Cam *cam,
+                               pl_sInt32 y0, pl_sInt32 y1,
+                               _plBinStats *stats) {
+  pl_sInt32 w = cam->ScreenWidth, x, x1, n;
+  pl_uInt32 shaded = 0;
+  pl_uInt *ids, id;
+  pl_uChar *gmem;
+  _plVisFace *v;
+  for (; y0 < y1; y0 ++) {
+    ids = ctx->visIds + y0*w;
+    x1 = ctx->visX1[y0];
+    for (x = ctx->visX0[y0]; x < x1; x += n) {
+      n = 1;
+      if (!(id = ids[x])) continue;
+      while (x+n < x1 && ids[x+n] == id) n++;
+      v = ctx->visFaces + id - 1;
+      if (cam->frameBuffer32) {
+        gmem = (pl_uChar *) (cam->frameBuffer32 + y0*w + x);
+        _plVisShadeFace(v,gmem,x,y0,n,1);
+      } else _plVisShadeFace(v,cam->frameBuffer + y0*w + x,x,y0,n,0);
+      if (stats) stats->Fill[v->pf].Pixels += n;
+      shaded += n;
+    }
+  }
+  return shaded;
+}
+
+/* Puts the ids of rows y0 to y1-1 back to 0 */
+static void _plVisClear(pl_RenderContext *ctx, pl_uInt w,
+                        pl_sInt32 y0, pl_sInt32 y1) {
+  for (; y0 < y1; y0 ++)
+    if (ctx->visX0[y0] < ctx->visX1[y0])
+      memset(ctx->visIds+y0*w+ctx->visX0[y0],0,
+             (ctx->visX1[y0]-ctx->visX0[y0])*sizeof(pl_uInt));
+}
+
+static pl_Bool _plBinFace(pl_RenderContext *ctx, pl_Face *face) {
+  if (ctx->numBinFaces >= ctx->maxBinFaces) {
+    pl_uInt32 n = ctx->maxBinFaces ? ctx->maxBinFaces*2 : 4096;
+    pl_Face *f = (pl_Face *) realloc(ctx->binFaces,n*sizeof(pl_Face));
+    if (!f) return 0;
+    ctx->binFaces = f;
+    ctx->maxBinFaces = n;
+  }
+  if (ctx->visOn) {
+    if (ctx->numBinFaces >= ctx->maxVisFaces) {
+      _plVisFace *v = (_plVisFace *)
+        realloc(ctx->visFaces,ctx->maxBinFaces*sizeof(_plVisFace));
+      if (!v) return 0;
+      ctx->visFaces = v;
+      ctx->maxVisFaces = ctx->maxBinFaces;
+    }
+    _plVisSetup(ctx->visFaces+ctx->numBinFaces,face,!ctx->visPrepass);
+  }
+  ctx->binFaces[ctx->numBinFaces++] = *face;
+  return 1;
+}
+
+/* Rows per bin. The visibility buffer needs the faces binned, so without
+   binning it puts them all in one bin, whose height is kept a multiple of
+   the tiles of the z-buffer pyramid */
+#define _plBinRows(ctx) ((ctx)->binHeight ? (ctx)->binHeight : \
+                         ((ctx)->clipCam->ScreenHeight+7)&~7)
+
+static void _plRasterBin(pl_RenderContext *ctx, pl_uInt bin) {
+  pl_Cam cam = *ctx->clipCam;
+  _plBinStats *stats = 0;
+  pl_uInt32 i, passed = 0, shaded = 0;
+  pl_sInt32 y0;
+  pl_uInt rows = _plBinRows(ctx), pass, k;
+  pl_Face *f;
+  pl_Bool hiz;
+  cam.ClipTop = plMax(cam.ClipTop,(pl_sInt) (bin*rows));
+  cam.ClipBottom = plMin(cam.ClipBottom,(pl_sInt) ((bin+1)*rows));
+  if (ctx->binStats) {
+    stats = ctx->binStats + bin;
+    memset(stats,0,sizeof(_plBinStats));
+  }
+  /* The 8x8 tiles of the z-buffer pyramid belong to one bin only if the bins
+     are aligned to them; the 64x64 level is shared, and left to
+     _plRasterBins() */
+  hiz = ctx->hizOn && !(rows & 7);
+  if (ctx->visOn) for (y0 = cam.ClipTop; y0 < cam.ClipBottom; y0 ++) {
+    ctx->visX0[y0] = cam.ScreenWidth;
+    ctx->visX1[y0] = 0;
+  }
+  /* With the id buffer its faces go first, in pass 0, to the z-buffer and
+     the ids only. Pass 1 shades the pixels they were left, with the
+     fillers for DepthPrepass, and pass 2 draws the other faces. */
+  for (pass = ctx->visOn ? 0 : 2; pass < 3; pass ++) {
+    if (pass == 1) {
+      if (!ctx->visPrepass) {
+        shaded = _plVisResolve(ctx,&cam,cam.ClipTop,cam.ClipBottom,stats);
+        continue;
+      }
+      cam._Ids = ctx->visIds;
+    } else if (pass == 2 && ctx->visOn) {
+      if (ctx->visPrepass && stats)
+        for (k = 0; k < PL_NUM_PF; k ++) shaded += stats->shade[k].Pixels;
+      if (stats) stats->saved = passed - shaded;
+      _plVisClear(ctx,cam.ScreenWidth,cam.ClipTop,cam.ClipBottom);
+      cam._Ids = 0;
+    }
+    for (i = ctx->binStart[bin]; i < ctx->binStart[bin+1]; i ++) {
+      k = ctx->binIndex[i];
+      f = ctx->binFaces + k;
+      if (ctx->visOn && (ctx->visFaces[k].pf == PL_NUM_PF) != (pass == 2))
+        continue;
+      if (hiz && f->Material->zBufferable &&
+          _plHiZCullFace(ctx,f,cam.ClipTop,cam.ClipBottom,0)) {
+        if (stats && pass != 1) stats->occluded ++;
+        continue;
+      }
+      if (stats) {
+        y0 = f->Scry[0];
+        if (f->Scry[1] < y0) y0 = f->Scry[1];
+        if (f->Scry[2] < y0) y0 = f->Scry[2];
+        y0 = _plFillPixel(y0);
+        if (pass == 1) cam._Stats = stats->shade;
+        else cam._Stats = y0 < (pl_sInt32) (bin*rows) ? stats->cont :
+                                                        stats->Fill;
+      }
+      if (!pass) passed += _plVisFill(&cam,f,ctx,k+1,ctx->visFaces[k].pf);
+      else {
+        cam._Id = k+1;
+        f->Material->_PutFace(&cam,f);
+      }
+    }
+  }
+}
+
+static void _plRasterBins(pl_RenderContext *ctx) {
+  pl_uInt32 i, total, *start;
+  pl_sInt32 y0, y1, b, b0, b1;
+  pl_uInt numBins, rows = _plBinRows(ctx);
+  pl_Face *f;
+
+  numBins = (ctx->clipCam->ScreenHeight+rows-1)/rows;
+  if (!numBins || !ctx->numBinFaces) {
+    ctx->numBinFaces = 0;
+    return;
+  }
+  if (numBins > ctx->numBins || !ctx->binStart) {
+    start = (pl_uInt32 *) realloc(ctx->binStart,
+                                  (numBins+1)*sizeof(pl_uInt32));
+    if (!start) {
+      ctx->numBinFaces = 0;
+      return;
+    }
+    ctx->binStart = start;
+  }
+  ctx->numBins = numBins;
+  start = ctx->binStart;
+  if (numBins > ctx->maxBinStats) {
+    /* Without them the bins are just not counted */
+    if (ctx->binStats) free(ctx->binStats);
+    ctx->binStats = (_plBinStats *) malloc(numBins*sizeof(_plBinStats));
+    ctx->maxBinStats = ctx->binStats ? numBins : 0;
+  }
+
+  /* Count the faces in each bin, then turn the counts into offsets */
+  memset(start,0,(numBins+1)*sizeof(pl_uInt32));
+  for (i = 0, f = ctx->binFaces; i < ctx->numBinFaces; i ++, f ++) {
+    _plFaceRows(f,y0,y1);
+    if (y1 <= y0) continue;
+    b0 = plMax(y0,0)/rows;
+    b1 = plMin((y1-1)/(pl_sInt32)rows,(pl_sInt32)numBins-1);
+    for (b = b0; b <= b1; b ++) start[b+1]++;
+  }
+  for (b = 0; b < (pl_sInt32) numBins; b ++) start[b+1] += start[b];
+  total = start[numBins];
+  if (total > ctx->maxBinIndex) {
+    pl_uInt32 *index = (pl_uInt32 *) realloc(ctx->binIndex,
+                                             total*sizeof(pl_uInt32));
+    if (!index) {
+      ctx->numBinFaces = 0;
+      return;
+    }
+    ctx->binIndex = index;
+    ctx->maxBinIndex = total;
+  }
+
+  /* Fill the bins in drawing order, using start[b] as the write position of
+     bin b, which leaves it at the start of bin b+1 */
+  for (i = 0, f = ctx->binFaces; i < ctx->numBinFaces; i ++, f ++) {
+    _plFaceRows(f,y0,y1);
+    if (y1 <= y0) continue;
+    b0 = plMax(y0,0)/rows;
+    b1 = plMin((y1-1)/(pl_sInt32)rows,(pl_sInt32)numBins-1);
+    for (b = b0; b <= b1; b ++) ctx->binIndex[start[b]++] = i;
+  }
+  for (b = numBins; b > 0; b --) start[b] = start[b-1];
+  start[0] = 0;
+
+  _plRunJobs(ctx,_plRasterBin,numBins);
+  if (ctx->binStats) for (b = 0; b < (pl_sInt32) numBins; b ++) {
+    pl_FillStats *fs = ctx->binStats[b].Fill, *cs = ctx->binStats[b].cont;
+    for (i = 0; i < PL_NUM_PF; i ++) {
+      ctx->stats.Fill[i].Triangles += fs[i].Triangles;
+      ctx->stats.Fill[i].Spans += fs[i].Spans + cs[i].Spans;
+      ctx->stats.Fill[i].Pixels += fs[i].Pixels + cs[i].Pixels +
+                                   ctx->binStats[b].shade[i].Pixels;
+      ctx->stats.Fill[i].ZFails += fs[i].ZFails + cs[i].ZFails;
+    }
+    ctx->stats.OcclusionCulled += ctx->binStats[b].occluded;
+    ctx->stats.ShadesSaved += ctx->binStats[b].saved;
+  }
+  if (ctx->hizOn)
+    memset(ctx->hizDirty[1],1,ctx->hizW[1]*ctx->hizH[1]);
+  ctx->numBinFaces = 0;
+}
+
+PL_API pl_uInt32 *plRenderContextTriStats(pl_RenderContext *ctx) {
+  return ctx->TriStats;
+}
+
+PL_API pl_Bool plRenderContextReserve(pl_RenderContext *ctx, pl_uInt32 faces) {
+  pl_uInt32 n;
+  _faceInfo *f;
+  if (!ctx) ctx = _plDefault();
+  if (faces <= ctx->maxfaces) return 1;
+  n = ctx->maxfaces ? ctx->maxfaces : PL_MAX_TRIANGLES;
+  while (n < faces) n *= 2;
+  f = (_faceInfo *) realloc(ctx->faces,n*sizeof(_faceInfo));
+  if (!f) return 0;
+  ctx->faces = f;
+  ctx->maxfaces = n;
+  return 1;
+}
+
+PL_API pl_uInt32 plRenderContextHighWater(pl_RenderContext *ctx) {
+  if (!ctx) ctx = _plDefault();
+  return ctx->highWater;
+}
+
+PL_API pl_RenderStats *plRenderContextStats(pl_RenderContext *ctx) {
+  if (!ctx) ctx = _plDefault();
+  return &ctx->stats;
+}
 
 PL_API void plRenderBegin(pl_Cam *Camera) {
+  plRenderBeginCtx(_plDefault(),Camera);
+}
+
+PL_API void plRenderLight(pl_Light *light) {
+  plRenderLightCtx(_plDefault(),light);
+}
+
+PL_API void plRenderObj(pl_Obj *obj) {
+  plRenderObjCtx(_plDefault(),obj);
+}
+
+PL_API void plRenderEnd() {
+  plRenderEndCtx(_plDefault());
+}
+
+PL_API void plRenderBeginCtx(pl_RenderContext *ctx, pl_Cam *Camera) {
   pl_Float tempMatrix[16];
-  memset(plRender_TriStats,0,sizeof(plRender_TriStats));
-  _cam = Camera;
-  _numlights = 0;
-  _numfaces = 0;
-  plMatrixRotate(_cMatrix,2,-Camera->Pan);
+  pl_Bool timers = ctx->stats.Timers;
+  memset(ctx->TriStats,0,sizeof(ctx->_TriStats));
+  memset(&ctx->stats,0,sizeof(ctx->stats));
+  ctx->stats.Timers = timers;
+  ctx->cam = Camera;
+  ctx->numlights = 0;
+  ctx->numfaces = 0;
+  ctx->scratchCur = ctx->scratch;
+  if (ctx->scratch) ctx->scratch->used = 0;
+  plMatrixRotate(ctx->cMatrix,2,-Camera->Pan);
   plMatrixRotate(tempMatrix,1,-Camera->Pitch);
-  plMatrixMultiply(_cMatrix,tempMatrix);
+  plMatrixMultiply(ctx->cMatrix,tempMatrix);
   plMatrixRotate(tempMatrix,3,-Camera->Roll);
-  plMatrixMultiply(_cMatrix,tempMatrix);
-  plClipSetFrustum(_cam);
+  plMatrixMultiply(ctx->cMatrix,tempMatrix);
+  plClipSetFrustumCtx(ctx,Camera);
+  _plHiZBegin(ctx,Camera);
+  _plVisBegin(ctx,Camera);
 }
 
-PL_API void plRenderLight(pl_Light *light) {
+PL_API void plRenderLightCtx(pl_RenderContext *ctx, pl_Light *light) {
   pl_Float *pl, xp, yp, zp;
-  if (light->Type == PL_LIGHT_NONE || _numlights >= PL_MAX_LIGHTS) return;
-  pl = _lights[_numlights].l;
+  if (light->Type == PL_LIGHT_NONE || ctx->numlights >= PL_MAX_LIGHTS) return;
+  pl = ctx->lights[ctx->numlights].l;
   if (light->Type == PL_LIGHT_VECTOR) {
     xp = light->Xp;
     yp = light->Yp;
     zp = light->Zp;
-    MACRO_plMatrixApply(_cMatrix,xp,yp,zp,pl[0],pl[1],pl[2]);
+    MACRO_plMatrixApply(ctx->cMatrix,xp,yp,zp,pl[0],pl[1],pl[2]);
   } else if (light->Type & PL_LIGHT_POINT) {
-    xp = light->Xp-_cam->X;
-    yp = light->Yp-_cam->Y;
-    zp = light->Zp-_cam->Z;
-    MACRO_plMatrixApply(_cMatrix,xp,yp,zp,pl[0],pl[1],pl[2]);
+    xp = light->Xp-ctx->cam->X;
+    yp = light->Yp-ctx->cam->Y;
+    zp = light->Zp-ctx->cam->Z;
+    MACRO_plMatrixApply(ctx->cMatrix,xp,yp,zp,pl[0],pl[1],pl[2]);
   }
-  _lights[_numlights++].light = light;
+  ctx->lights[ctx->numlights++].light = light;
 }
 
-static void _RenderObj(pl_Obj *obj, pl_Float *bmatrix, pl_Float *bnmatrix) {
-  pl_uInt32 i, x, facepos;
-  pl_Float nx = 0.0, ny = 0.0, nz = 0.0;
-  double tmp, tmp2;
-  pl_Float oMatrix[16], nMatrix[16], tempMatrix[16];
-
-  pl_Vertex *vertex;
-  pl_Face *face;
-  pl_Light *light;
-
+/* Computes the world matrix of an object, and the matrix of its normals,
+   under those of its parent (bmatrix and bnmatrix, 0 at the top) */
+static void _plObjMatrices(pl_Obj *obj, pl_Float *bmatrix, pl_Float *bnmatrix,
+                           pl_Float *oMatrix, pl_Float *nMatrix) {
+  pl_Float tempMatrix[16];
   if (obj->GenMatrix) {
     plMatrixRotate(nMatrix,1,obj->Xa);
     plMatrixRotate(tempMatrix,2,obj->Ya);
@@ -5000,40 +7622,381 @@ static void _RenderObj(pl_Obj *obj, pl_Float *bmatrix, pl_Float *bnmatrix) {
     plMatrixMultiply(oMatrix,tempMatrix);
   } else memcpy(oMatrix,obj->Matrix,sizeof(pl_Float)*16);
   if (bmatrix) plMatrixMultiply(oMatrix,bmatrix);
+}
+
+/* How far outside of a plane bounds must be to be sure that no vertex is
+   inside, after the rounding of the transforms */
+#define _plBoundsMargin(c,r) \
+  ((r)*0.001 + (fabs((c)[0])+fabs((c)[1])+fabs((c)[2]))*1e-5 + 1e-4)
+
+/* Returns 1 if a camera space sphere is entirely outside of one of the
+   frustum planes */
+static pl_Bool _plSphereOutside(pl_RenderContext *ctx, double *c, double r) {
+  pl_uInt a = (ctx->clipPlanes[0][3] < 0.0 ? 0 : 1);
+  double *p;
+  r += _plBoundsMargin(c,r);
+  for (; a < NUM_CLIP_PLANES; a ++) {
+    p = ctx->clipPlanes[a];
+    if (c[0]*p[0] + c[1]*p[1] + c[2]*p[2] - p[3] < -r*ctx->clipPlaneLen[a])
+      return 1;
+  }
+  return 0;
+}
+
+/* Gets the bounding sphere of an object transformed by the matrix m (its
+   camera matrix, in _RenderObj()). The radius is scaled by a bound on the
+   largest stretch of m: the largest row sum of the magnitudes of the upper
+   3x3 of m transposed times m, which is exact for rotations with uniform
+   scaling. */
+static void _plObjCamSphere(pl_Obj *obj, pl_Float *m, double *c, double *r) {
+  double b[3][3], l = 0.0, t;
+  pl_uInt i, j;
+  pl_Float x, y, z;
+  MACRO_plMatrixApply(m,obj->BoundCenter[0],obj->BoundCenter[1],
+                      obj->BoundCenter[2],x,y,z);
+  c[0] = x; c[1] = y; c[2] = z;
+  for (i = 0; i < 3; i ++)
+    for (j = 0; j < 3; j ++)
+      b[i][j] = (double) m[i]*m[j] + (double) m[4+i]*m[4+j] +
+                (double) m[8+i]*m[8+j];
+  for (i = 0; i < 3; i ++) {
+    t = fabs(b[i][0]) + fabs(b[i][1]) + fabs(b[i][2]);
+    if (t > l) l = t;
+  }
+  *r = obj->BoundRadius*sqrt(l);
+}
+
+/* Returns 1 if the bounds of an object with camera matrix m are outside of
+   the frustum: its sphere, or else all 8 corners of its box, are outside of
+   one plane */
+static pl_Bool _plObjOutside(pl_RenderContext *ctx, pl_Obj *obj,
+                             pl_Float *m) {
+  double c[3], r, e;
+  pl_Float x, y, z, ex, ey, ez;
+  pl_uInt a, i;
+  double *p;
+  _plObjCamSphere(obj,m,c,&r);
+  if (_plSphereOutside(ctx,c,r)) return 1;
+  e = _plBoundsMargin(c,r);
+  a = (ctx->clipPlanes[0][3] < 0.0 ? 0 : 1);
+  for (; a < NUM_CLIP_PLANES; a ++) {
+    p = ctx->clipPlanes[a];
+    for (i = 0; i < 8; i ++) {
+      ex = (i&1) ? obj->BoundMax[0] : obj->BoundMin[0];
+      ey = (i&2) ? obj->BoundMax[1] : obj->BoundMin[1];
+      ez = (i&4) ? obj->BoundMax[2] : obj->BoundMin[2];
+      MACRO_plMatrixApply(m,ex,ey,ez,x,y,z);
+      if (x*p[0] + y*p[1] + z*p[2] - p[3] >= -e*ctx->clipPlaneLen[a]) break;
+    }
+    if (i == 8) return 1;
+  }
+  return 0;
+}
+
+/* Gets the bounding sphere of an object and its subobjects, given its world
+   matrix, in camera space if vMatrix (the world to camera matrix) is set,
+   otherwise in world space. Returns 0 if any of them has unknown bounds. */
+static pl_Bool _plObjTreeSphere(pl_Float *vMatrix, pl_Obj *obj,
+                                pl_Float *oMatrix, double *c, double *r) {
+  pl_Float m[16], cm[16], nm[16];
+  double cc[3], cr, d;
+  pl_Bool got = 0;
+  pl_uInt i, k;
+  if (obj->NumFaces && obj->NumVertices) {
+    if (obj->BoundRadius < 0.0) return 0;
+    memcpy(cm,oMatrix,sizeof(pl_Float)*16);
+    if (vMatrix) plMatrixMultiply(cm,vMatrix);
+    _plObjCamSphere(obj,cm,c,r);
+    got = 1;
+  }
+  for (i = 0; i < PL_MAX_CHILDREN; i ++) if (obj->Children[i]) {
+    _plObjMatrices(obj->Children[i],oMatrix,0,m,nm);
+    if (!_plObjTreeSphere(vMatrix,obj->Children[i],m,cc,&cr)) return 0;
+    if (!got) {
+      c[0] = cc[0]; c[1] = cc[1]; c[2] = cc[2]; *r = cr;
+      got = 1;
+      continue;
+    }
+    d = sqrt((cc[0]-c[0])*(cc[0]-c[0]) + (cc[1]-c[1])*(cc[1]-c[1]) +
+             (cc[2]-c[2])*(cc[2]-c[2]));
+    if (d + cr <= *r) continue;
+    if (d + *r <= cr) {
+      c[0] = cc[0]; c[1] = cc[1]; c[2] = cc[2]; *r = cr;
+      continue;
+    }
+    /* Smallest sphere around both */
+    for (k = 0; k < 3; k ++)
+      c[k] += (cc[k]-c[k])*((d + cr - *r)*0.5/d);
+    *r = (d + cr + *r)*0.5;
+  }
+  return got;
+}
+
+static pl_uInt32 _plObjTreeFaces(pl_Obj *obj) {
+  pl_uInt32 n = obj->NumFaces;
+  pl_uInt i;
+  for (i = 0; i < PL_MAX_CHILDREN; i ++)
+    if (obj->Children[i]) n += _plObjTreeFaces(obj->Children[i]);
+  return n;
+}
+
+#define _PL_SCRATCH_BLOCK (1<<18)
+
+/* Allocates bytes of scratch memory, valid until the next plRender*() block,
+   or returns 0 if out of memory */
+static void *_plScratchAlloc(pl_RenderContext *ctx, pl_uInt32 bytes) {
+  _plScratch *s = ctx->scratchCur, **link;
+  void *p;
+  bytes = (bytes+15)&~15;
+  while (s && s->size - s->used < bytes) {
+    s = s->next;
+    if (s) s->used = 0;
+  }
+  if (!s) {
+    s = (_plScratch *) malloc(sizeof(_plScratch) +
+                              plMax(bytes,_PL_SCRATCH_BLOCK));
+    if (!s) return 0;
+    s->next = 0;
+    s->size = plMax(bytes,_PL_SCRATCH_BLOCK);
+    s->used = 0;
+    for (link = &ctx->scratch; *link; link = &(*link)->next) ;
+    *link = s;
+  }
+  ctx->scratchCur = s;
+  p = (pl_uChar *) (s+1) + s->used;
+  s->used += bytes;
+  return p;
+}
+
+/* Gives back the end of the last scratch allocation, from end on */
+static void _plScratchTrim(pl_RenderContext *ctx, void *end) {
+  _plScratch *s = ctx->scratchCur;
+  s->used = ((pl_uChar *) end - (pl_uChar *) (s+1) + 15)&~15;
+}
+
+static void _plRenderTree(pl_RenderContext *ctx, pl_Obj *obj,
+                          pl_Float *oMatrix, pl_Float *nMatrix, pl_Bool inst);
+
+/* Renders an object and its subobjects under the matrices of its parent. If
+   inst is set, the object is left untouched, and its transformed vertices
+   and lit faces are put in scratch memory instead. */
+static void _RenderObj(pl_RenderContext *ctx, pl_Obj *obj,
+                       pl_Float *bmatrix, pl_Float *bnmatrix, pl_Bool inst) {
+  pl_Float oMatrix[16], nMatrix[16];
+  _plObjMatrices(obj,bmatrix,bnmatrix,oMatrix,nMatrix);
+  _plRenderTree(ctx,obj,oMatrix,nMatrix,inst);
+}
+
+/* Same as _RenderObj(), given the world matrices of the object */
+static void _plRenderTree(pl_RenderContext *ctx, pl_Obj *obj,
+                          pl_Float *oMatrix, pl_Float *nMatrix, pl_Bool inst) {
+  pl_uInt32 i, n, facepos, chunks;
+  pl_Float tempMatrix[16], vMatrix[16];
+  pl_Face *face;
+  _faceInfo *f;
+  double c[3], r;
+  pl_Bool tree = 0;
 
+  /* Skip the whole hierarchy if it's out of view */
   for (i = 0; i < PL_MAX_CHILDREN; i ++)
-    if (obj->Children[i]) _RenderObj(obj->Children[i],oMatrix,nMatrix);
+    if (obj->Children[i]) tree = 1;
+  if (tree) {
+    plMatrixTranslate(vMatrix, -ctx->cam->X, -ctx->cam->Y, -ctx->cam->Z);
+    plMatrixMultiply(vMatrix,ctx->cMatrix);
+  }
+  if (tree && _plObjTreeSphere(vMatrix,obj,oMatrix,c,&r) &&
+      _plSphereOutside(ctx,c,r)) {
+    ctx->TriStats[0] += _plObjTreeFaces(obj);
+    ctx->stats.FrustumCulled += _plObjTreeFaces(obj);
+    return;
+  }
+
+  for (i = 0; i < PL_MAX_CHILDREN; i ++)
+    if (obj->Children[i])
+      _RenderObj(ctx,obj->Children[i],oMatrix,nMatrix,inst);
   if (!obj->NumFaces || !obj->NumVertices) return;
 
-  plMatrixTranslate(tempMatrix, -_cam->X, -_cam->Y, -_cam->Z);
+  plMatrixTranslate(tempMatrix, -ctx->cam->X, -ctx->cam->Y, -ctx->cam->Z);
   plMatrixMultiply(oMatrix,tempMatrix);
-  plMatrixMultiply(oMatrix,_cMatrix);
-  plMatrixMultiply(nMatrix,_cMatrix);
+  plMatrixMultiply(oMatrix,ctx->cMatrix);
+  plMatrixMultiply(nMatrix,ctx->cMatrix);
 
-  x = obj->NumVertices;
-  vertex = obj->Vertices;
+  if (obj->BoundRadius >= 0.0 && _plObjOutside(ctx,obj,oMatrix)) {
+    ctx->TriStats[0] += obj->NumFaces;
+    ctx->stats.FrustumCulled += obj->NumFaces;
+    return;
+  }
 
-  do {
+  ctx->xfObj = obj;
+  ctx->xfMatrix = oMatrix;
+  ctx->xfnMatrix = nMatrix;
+  ctx->xfVerts = obj->Vertices;
+  ctx->xfFaces = 0;
+  if (inst) {
+    ctx->xfVerts = (pl_Vertex *)
+      _plScratchAlloc(ctx,obj->NumVertices*sizeof(pl_Vertex) +
+                          obj->NumFaces*sizeof(pl_Face));
+    if (!ctx->xfVerts) return;
+    ctx->xfFaces = (pl_Face *) (ctx->xfVerts + obj->NumVertices);
+  }
+
+  chunks = 1;
+  if (ctx->numThreads > 1)
+    chunks = plMin(ctx->numThreads*4,
+                   (obj->NumVertices+_PL_XFORM_CHUNK-1)/_PL_XFORM_CHUNK);
+  if (chunks < 1) chunks = 1;
+  ctx->xfChunks = chunks;
+  _plTimeStage(ctx,PL_STAGE_TRANSFORM,_plRunJobs(ctx,_plXformJob,chunks));
+
+  if (ctx->hizOn && _plHiZCullObj(ctx,obj)) {
+    ctx->TriStats[0] += obj->NumFaces;
+    ctx->stats.OcclusionCulled += obj->NumFaces;
+    if (inst) _plScratchTrim(ctx,ctx->xfVerts);
+    return;
+  }
+  if (!plRenderContextReserve(ctx,ctx->numfaces + obj->NumFaces)) {
+    ctx->TriStats[0] += obj->NumFaces;
+    if (inst) _plScratchTrim(ctx,ctx->xfVerts);
+    return;
+  }
+
+  facepos = ctx->numfaces;
+
+  ctx->TriStats[0] += obj->NumFaces;
+
+  chunks = 1;
+  if (ctx->numThreads > 1)
+    chunks = plMin(ctx->numThreads*4,
+                   (obj->NumFaces+_PL_XFORM_CHUNK-1)/_PL_XFORM_CHUNK);
+  if (chunks < 1) chunks = 1;
+  ctx->xfChunks = chunks;
+  _plTimeStage(ctx,PL_STAGE_LIGHT,_plRunJobs(ctx,_plLightJob,chunks));
+
+  /* Merge the face lists of the chunks, in order. Faces that are neither
+     visible nor backfacing were outside the frustum. */
+  n = (obj->NumFaces+chunks-1)/chunks;
+  ctx->stats.FrustumCulled += obj->NumFaces;
+  for (i = 0; i < chunks; i ++) {
+    ctx->stats.BackfaceCulled += ctx->xfBackface[i];
+    ctx->stats.FrustumCulled -= ctx->xfCount[i] + ctx->xfBackface[i];
+    if (ctx->xfCount[i] && facepos != ctx->numfaces + i*n)
+      memmove(ctx->faces + facepos, ctx->faces + ctx->numfaces + i*n,
+              ctx->xfCount[i]*sizeof(_faceInfo));
+    facepos += ctx->xfCount[i];
+  }
+
+  /* Pack the copies of the visible faces, and give back the rest */
+  if (inst) {
+    f = ctx->faces + ctx->numfaces;
+    face = ctx->xfFaces;
+    for (i = ctx->numfaces; i < facepos; i ++) {
+      if (f->face != face) {
+        *face = *f->face;
+        f->face = face;
+      }
+      f++;
+      face++;
+    }
+    _plScratchTrim(ctx,facepos == ctx->numfaces ? (void *) ctx->xfVerts :
+                                                  (void *) face);
+  }
+  ctx->TriStats[1] += facepos - ctx->numfaces;
+  ctx->numfaces = facepos;
+  if (facepos > ctx->highWater) ctx->highWater = facepos;
+}
+
+#ifdef _PL_SSE2
+/* Stores the x, y and z of p (a vertex loaded from its x or nx) times the
+   columns c0 to c2 of a matrix, plus c3, to ox, oy and oz. The operations
+   and their order are those of MACRO_plMatrixApply(), so unless the
+   compiler fuses multiply-adds the results are the same. */
+#define _PL_XFORM3(p,c0,c1,c2,c3,ox,oz) { \
+  __m128 _r = _mm_add_ps(_mm_add_ps(_mm_add_ps( \
+    _mm_mul_ps(_mm_shuffle_ps((p),(p),0x00),(c0)), \
+    _mm_mul_ps(_mm_shuffle_ps((p),(p),0x55),(c1))), \
+    _mm_mul_ps(_mm_shuffle_ps((p),(p),0xAA),(c2))),(c3)); \
+  _mm_storel_pi((__m64 *) &(ox),_r); \
+  _mm_store_ss(&(oz),_mm_movehl_ps(_r,_r)); \
+}
+#endif
+
+/* Transforms chunk index of ctx->xfObj's vertices into ctx->xfVerts */
+static void _plXformJob(pl_RenderContext *ctx, pl_uInt index) {
+  pl_Obj *obj = ctx->xfObj;
+  pl_Float *oMatrix = ctx->xfMatrix, *nMatrix = ctx->xfnMatrix;
+  pl_uInt32 x, n = (obj->NumVertices+ctx->xfChunks-1)/ctx->xfChunks;
+  pl_Vertex *vertex, *out;
+
+  if (index*n >= obj->NumVertices) return;
+  x = plMin(n,obj->NumVertices-index*n);
+  vertex = obj->Vertices + index*n;
+  out = ctx->xfVerts + index*n;
+
+#ifdef _PL_SSE2
+  {
+    __m128 m0 = _mm_setr_ps(oMatrix[0],oMatrix[4],oMatrix[8],0.0f);
+    __m128 m1 = _mm_setr_ps(oMatrix[1],oMatrix[5],oMatrix[9],0.0f);
+    __m128 m2 = _mm_setr_ps(oMatrix[2],oMatrix[6],oMatrix[10],0.0f);
+    __m128 m3 = _mm_setr_ps(oMatrix[3],oMatrix[7],oMatrix[11],0.0f);
+    __m128 n0 = _mm_setr_ps(nMatrix[0],nMatrix[4],nMatrix[8],0.0f);
+    __m128 n1 = _mm_setr_ps(nMatrix[1],nMatrix[5],nMatrix[9],0.0f);
+    __m128 n2 = _mm_setr_ps(nMatrix[2],nMatrix[6],nMatrix[10],0.0f);
+    __m128 n3 = _mm_setr_ps(nMatrix[3],nMatrix[7],nMatrix[11],0.0f);
+    __m128 p;
+    for (; x; x --) {
+      p = _mm_loadu_ps(&vertex->x);
+      _PL_XFORM3(p,m0,m1,m2,m3,out->xformedx,out->xformedz);
+      p = _mm_loadu_ps(&vertex->nx);
+      _PL_XFORM3(p,n0,n1,n2,n3,out->xformednx,out->xformednz);
+      vertex++;
+      out++;
+    }
+  }
+#endif
+  for (; x; x --) {
     MACRO_plMatrixApply(oMatrix,vertex->x,vertex->y,vertex->z,
-                  vertex->xformedx, vertex->xformedy, vertex->xformedz);
+                  out->xformedx, out->xformedy, out->xformedz);
     MACRO_plMatrixApply(nMatrix,vertex->nx,vertex->ny,vertex->nz,
-                  vertex->xformednx,vertex->xformedny,vertex->xformednz);
+                  out->xformednx,out->xformedny,out->xformednz);
     vertex++;
-  } while (--x);
+    out++;
+  }
+}
 
-  face = obj->Faces;
-  facepos = _numfaces;
+/* Culls and lights chunk index of ctx->xfObj's faces. The visible ones are
+   put in ctx->faces at the chunk's own offset, and counted in xfCount[].
+   If ctx->xfFaces is set, the faces are copied there first, pointing at
+   ctx->xfVerts, and the copies are lit instead. */
+static void _plLightJob(pl_RenderContext *ctx, pl_uInt index) {
+  pl_Obj *obj = ctx->xfObj;
+  pl_Float *nMatrix = ctx->xfnMatrix;
+  pl_uInt32 i, x, n = (obj->NumFaces+ctx->xfChunks-1)/ctx->xfChunks;
+  pl_Float nx = 0.0, ny = 0.0, nz = 0.0;
+  double tmp, tmp2;
+  _faceInfo *out;
+  pl_Face *face, *src = 0;
+  pl_Light *light;
 
-  if (_numfaces + obj->NumFaces >= PL_MAX_TRIANGLES) // exceeded maximum face coutn
-  {
-    return;
+  ctx->xfCount[index] = 0;
+  ctx->xfBackface[index] = 0;
+  if (index*n >= obj->NumFaces) return;
+  x = plMin(n,obj->NumFaces-index*n);
+  face = obj->Faces + index*n;
+  if (ctx->xfFaces) {
+    src = face;
+    face = ctx->xfFaces + index*n;
   }
-
-  plRender_TriStats[0] += obj->NumFaces;
-  _numfaces += obj->NumFaces;
-  x = obj->NumFaces;
+  out = ctx->faces + ctx->numfaces + index*n;
+  n = 0;
 
   do {
+    if (src) {
+      *face = *src;
+      face->Vertices[0] = ctx->xfVerts + (src->Vertices[0] - obj->Vertices);
+      face->Vertices[1] = ctx->xfVerts + (src->Vertices[1] - obj->Vertices);
+      face->Vertices[2] = ctx->xfVerts + (src->Vertices[2] - obj->Vertices);
+      src++;
+    }
     if (obj->BackfaceCull || face->Material->_st & PL_SHADE_FLAT)
     {
       MACRO_plMatrixApply(nMatrix,face->nx,face->ny,face->nz,nx,ny,nz);
@@ -5041,24 +8004,24 @@ static void _RenderObj(pl_Obj *obj, pl_Float *bmatrix, pl_Float *bnmatrix) {
     if (!obj->BackfaceCull || (MACRO_plDotProduct(nx,ny,nz,
         face->Vertices[0]->xformedx, face->Vertices[0]->xformedy,
         face->Vertices[0]->xformedz) < 0.0000001)) {
-      if (plClipNeeded(face)) {
+      if (plClipNeededCtx(ctx,face)) {
         if (face->Material->_st & (PL_SHADE_FLAT|PL_SHADE_FLAT_DISTANCE)) {
           tmp = face->sLighting;
           if (face->Material->_st & PL_SHADE_FLAT) {
-            for (i = 0; i < _numlights; i ++) {
+            for (i = 0; i < ctx->numlights; i ++) {
               tmp2 = 0.0;
-              light = _lights[i].light;
+              light = ctx->lights[i].light;
               if (light->Type & PL_LIGHT_POINT_ANGLE) {
-                double nx2 = _lights[i].l[0] - face->Vertices[0]->xformedx;
-                double ny2 = _lights[i].l[1] - face->Vertices[0]->xformedy;
-                double nz2 = _lights[i].l[2] - face->Vertices[0]->xformedz;
+                double nx2 = ctx->lights[i].l[0] - face->Vertices[0]->xformedx;
+                double ny2 = ctx->lights[i].l[1] - face->Vertices[0]->xformedy;
+                double nz2 = ctx->lights[i].l[2] - face->Vertices[0]->xformedz;
                 MACRO_plNormalizeVector(nx2,ny2,nz2);
                 tmp2 = MACRO_plDotProduct(nx,ny,nz,nx2,ny2,nz2)*light->Intensity;
               }
               if (light->Type & PL_LIGHT_POINT_DISTANCE) {
-                double nx2 = _lights[i].l[0] - face->Vertices[0]->xformedx;
-                double ny2 = _lights[i].l[1] - face->Vertices[0]->xformedy;
-                double nz2 = _lights[i].l[2] - face->Vertices[0]->xformedz;
+                double nx2 = ctx->lights[i].l[0] - face->Vertices[0]->xformedx;
+                double ny2 = ctx->lights[i].l[1] - face->Vertices[0]->xformedy;
+                double nz2 = ctx->lights[i].l[2] - face->Vertices[0]->xformedz;
                 if (light->Type & PL_LIGHT_POINT_ANGLE) {
                    nx2 = (1.0 - 0.5*((nx2*nx2+ny2*ny2+nz2*nz2)/
                            light->HalfDistSquared));
@@ -5070,7 +8033,7 @@ static void _RenderObj(pl_Obj *obj, pl_Float *bmatrix, pl_Float *bnmatrix) {
                 }
               }
               if (light->Type == PL_LIGHT_VECTOR)
-                tmp2 = MACRO_plDotProduct(nx,ny,nz,_lights[i].l[0],_lights[i].l[1],_lights[i].l[2])
+                tmp2 = MACRO_plDotProduct(nx,ny,nz,ctx->lights[i].l[0],ctx->lights[i].l[1],ctx->lights[i].l[2])
                   * light->Intensity;
               if (tmp2 > 0.0) tmp += tmp2;
               else if (obj->BackfaceIllumination) tmp -= tmp2;
@@ -5095,13 +8058,13 @@ static void _RenderObj(pl_Obj *obj, pl_Float *bmatrix, pl_Float *bnmatrix) {
           for (a = 0; a < 3; a ++) {
             tmp = face->vsLighting[a];
             if (face->Material->_st & PL_SHADE_GOURAUD) {
-              for (i = 0; i < _numlights ; i++) {
+              for (i = 0; i < ctx->numlights ; i++) {
                 tmp2 = 0.0;
-                light = _lights[i].light;
+                light = ctx->lights[i].light;
                 if (light->Type & PL_LIGHT_POINT_ANGLE) {
-                  nx = _lights[i].l[0] - face->Vertices[a]->xformedx;
-                  ny = _lights[i].l[1] - face->Vertices[a]->xformedy;
-                  nz = _lights[i].l[2] - face->Vertices[a]->xformedz;
+                  nx = ctx->lights[i].l[0] - face->Vertices[a]->xformedx;
+                  ny = ctx->lights[i].l[1] - face->Vertices[a]->xformedy;
+                  nz = ctx->lights[i].l[2] - face->Vertices[a]->xformedz;
                   MACRO_plNormalizeVector(nx,ny,nz);
                   tmp2 = MACRO_plDotProduct(face->Vertices[a]->xformednx,
                                       face->Vertices[a]->xformedny,
@@ -5109,9 +8072,9 @@ static void _RenderObj(pl_Obj *obj, pl_Float *bmatrix, pl_Float *bnmatrix) {
                                       nx,ny,nz) * light->Intensity;
                 }
                 if (light->Type & PL_LIGHT_POINT_DISTANCE) {
-                  double nx2 = _lights[i].l[0] - face->Vertices[a]->xformedx;
-                  double ny2 = _lights[i].l[1] - face->Vertices[a]->xformedy;
-                  double nz2 = _lights[i].l[2] - face->Vertices[a]->xformedz;
+                  double nx2 = ctx->lights[i].l[0] - face->Vertices[a]->xformedx;
+                  double ny2 = ctx->lights[i].l[1] - face->Vertices[a]->xformedy;
+                  double nz2 = ctx->lights[i].l[2] - face->Vertices[a]->xformedz;
                   if (light->Type & PL_LIGHT_POINT_ANGLE) {
                      double t= (1.0 - 0.5*((nx2*nx2+ny2*ny2+nz2*nz2)/light->HalfDistSquared));
                      tmp2 *= plMax(0,plMin(1.0,t))*light->Intensity;
@@ -5124,7 +8087,7 @@ static void _RenderObj(pl_Obj *obj, pl_Float *bmatrix, pl_Float *bnmatrix) {
                   tmp2 = MACRO_plDotProduct(face->Vertices[a]->xformednx,
                                       face->Vertices[a]->xformedny,
                                       face->Vertices[a]->xformednz,
-                                      _lights[i].l[0],_lights[i].l[1],_lights[i].l[2])
+                                      ctx->lights[i].l[0],ctx->lights[i].l[1],ctx->lights[i].l[2])
                                         * light->Intensity;
                 if (tmp2 > 0.0) tmp += tmp2;
                 else if (obj->BackfaceIllumination) tmp -= tmp2;
@@ -5135,53 +8098,463 @@ static void _RenderObj(pl_Obj *obj, pl_Float *bmatrix, pl_Float *bnmatrix) {
             face->Shades[a] = (pl_Float) tmp;
           } /* End of vertex loop for */
         } /* End of gouraud shading mask if */
-        _faces[facepos].zd = face->Vertices[0]->xformedz+
+        out[n].zd = face->Vertices[0]->xformedz+
         face->Vertices[1]->xformedz+face->Vertices[2]->xformedz;
-        _faces[facepos++].face = face;
-        plRender_TriStats[1] ++;
+        out[n++].face = face;
       } /* Is it in our area Check */
     } /* Backface Check */
-    _numfaces = facepos;
+    else ctx->xfBackface[index] ++;
     face++;
   } while (--x); /* Face loop */
+  ctx->xfCount[index] = n;
 }
 
-PL_API void plRenderObj(pl_Obj *obj) {
-  _RenderObj(obj,0,0);
+PL_API void plRenderObjCtx(pl_RenderContext *ctx, pl_Obj *obj) {
+  _RenderObj(ctx,obj,0,0,0);
 }
 
-PL_API void plRenderEnd() {
+PL_API void plRenderObjInstanced(pl_Obj *obj, pl_Float *matrices,
+                                 pl_uInt32 count) {
+  plRenderObjInstancedCtx(_plDefault(),obj,matrices,count);
+}
+
+PL_API void plRenderObjInstancedCtx(pl_RenderContext *ctx, pl_Obj *obj,
+                                    pl_Float *matrices, pl_uInt32 count) {
+  pl_Float oMatrix[16], nMatrix[16];
+  double s;
+  pl_uInt i;
+  while (count--) {
+    memcpy(oMatrix,matrices,sizeof(pl_Float)*16);
+    memcpy(nMatrix,matrices,sizeof(pl_Float)*16);
+    /* Normals only get the rotation */
+    nMatrix[3] = nMatrix[7] = nMatrix[11] = 0.0;
+    s = sqrt(nMatrix[0]*nMatrix[0]+nMatrix[4]*nMatrix[4]+nMatrix[8]*nMatrix[8]);
+    if (s > 0.0) for (i = 0; i < 11; i ++) nMatrix[i] /= (pl_Float) s;
+    _plRenderTree(ctx,obj,oMatrix,nMatrix,1);
+    matrices += 16;
+  }
+}
+
+PL_API void plRenderEndCtx(pl_RenderContext *ctx) {
   _faceInfo *f;
-  if (_cam->Sort > 0) _hsort(_faces,_numfaces,0);
-  else if (_cam->Sort < 0) _hsort(_faces,_numfaces,1);
-  f = _faces;
-  while (_numfaces--) {
+  pl_uInt i;
+  double t = 0.0, raster = 0.0;
+  if (ctx->stats.Timers) t = _plTimer();
+  if (ctx->cam->Sort && ctx->numfaces >= PL_RADIX_SORT_MIN) {
+    if (ctx->sortScratchSize < ctx->maxfaces) {
+      f = (_faceInfo *) realloc(ctx->sortScratch,
+                                ctx->maxfaces*sizeof(_faceInfo));
+      if (f) {
+        ctx->sortScratch = f;
+        ctx->sortScratchSize = ctx->maxfaces;
+      }
+    }
+    if (ctx->sortScratchSize >= ctx->numfaces)
+      _plRadixSort(ctx->faces,ctx->sortScratch,ctx->numfaces,
+                   ctx->cam->Sort > 0 ? 0 : 1);
+    else _hsort(ctx->faces,ctx->numfaces,ctx->cam->Sort > 0 ? 0 : 1);
+  }
+  else if (ctx->cam->Sort > 0) _hsort(ctx->faces,ctx->numfaces,0);
+  else if (ctx->cam->Sort < 0) _hsort(ctx->faces,ctx->numfaces,1);
+  if (ctx->stats.Timers) {
+    /* The clipper adds the time of each triangle it fills to the raster
+       stage, so take that back out of the clipping time */
+    double now = _plTimer();
+    ctx->stats.StageTime[PL_STAGE_SORT] += now - t;
+    raster = ctx->stats.StageTime[PL_STAGE_RASTER];
+    t = now;
+  }
+  f = ctx->faces;
+  while (ctx->numfaces--) {
     if (f->face->Material && f->face->Material->_PutFace)
     {
-      plClipRenderFace(f->face);
+      plClipRenderFaceCtx(ctx,f->face);
     }
     f++;
   }
-  _numfaces=0;
-  _numlights = 0;
+  if (ctx->stats.Timers)
+    ctx->stats.StageTime[PL_STAGE_CLIP] += _plTimer() - t -
+      (ctx->stats.StageTime[PL_STAGE_RASTER] - raster);
+  if (ctx->binHeight || ctx->visOn)
+    _plTimeStage(ctx,PL_STAGE_RASTER,_plRasterBins(ctx));
+  for (i = 0; i < PL_NUM_PF; i ++) {
+    ctx->stats.PixelsWritten += ctx->stats.Fill[i].Pixels;
+    ctx->stats.ZFails += ctx->stats.Fill[i].ZFails;
+  }
+  ctx->numfaces=0;
+  ctx->numlights = 0;
+  /* plClipRenderFace() on its own draws straight away */
+  ctx->visOn = 0;
+}
+
+/* A node of the bounding volume hierarchy of a pl_Scene. Leaves hold one
+   object, and their ids are the ones given out by plSceneAdd(). */
+typedef struct {
+  pl_Float Min[3], Max[3];           /* Box around the subtree, with room to
+                                        spare at the leaves */
+  pl_sInt32 parent;                  /* -1 at the root; next free node for
+                                        unused nodes */
+  pl_sInt32 child[2];                /* -1 for leaves */
+  pl_Obj *obj;                       /* Object, 0 if not a leaf */
+  pl_sInt32 loose;                   /* Index in loose[] for objects with
+                                        unknown bounds, otherwise -1 */
+  pl_uInt32 faces;                   /* Triangles in the subtree */
+} _plSceneNode;
+
+typedef struct {
+  pl_sInt32 node;
+  pl_uInt32 planes;                  /* Frustum planes still to test */
+} _plSceneVisit;
+
+struct _pl_Scene {
+  _plSceneNode *nodes;
+  pl_uInt32 maxNodes;
+  pl_sInt32 freeNode, root;
+  pl_uInt32 numObjs;
+  pl_sInt32 *loose;                  /* Leaves which are not in the tree */
+  pl_uInt32 numLoose, maxLoose;
+  _plSceneVisit *stack;              /* maxNodes entries, for traversal */
+};
+
+/* Leaves are inserted with their boxes grown by this fraction of the radius
+   of the object on each side */
+#define _PL_SCENE_MARGIN 0.5f
+
+#define _plSceneArea(n) \
+  (((n)->Max[0]-(n)->Min[0])*((n)->Max[1]-(n)->Min[1]) + \
+   ((n)->Max[1]-(n)->Min[1])*((n)->Max[2]-(n)->Min[2]) + \
+   ((n)->Max[2]-(n)->Min[2])*((n)->Max[0]-(n)->Min[0]))
+
+static void _plSceneUnion(_plSceneNode *out, _plSceneNode *a,
+                          _plSceneNode *b) {
+  pl_uInt i;
+  for (i = 0; i < 3; i ++) {
+    out->Min[i] = plMin(a->Min[i],b->Min[i]);
+    out->Max[i] = plMax(a->Max[i],b->Max[i]);
+  }
+}
+
+static pl_sInt32 _plSceneAllocNode(pl_Scene *scene) {
+  _plSceneNode *nodes;
+  _plSceneVisit *stack;
+  pl_uInt32 i, n;
+  pl_sInt32 id;
+  if (scene->freeNode < 0) {
+    n = scene->maxNodes ? scene->maxNodes*2 : 64;
+    nodes = (_plSceneNode *) realloc(scene->nodes,n*sizeof(_plSceneNode));
+    if (!nodes) return -1;
+    scene->nodes = nodes;
+    stack = (_plSceneVisit *) realloc(scene->stack,n*sizeof(_plSceneVisit));
+    if (!stack) return -1;
+    scene->stack = stack;
+    for (i = scene->maxNodes; i < n; i ++) {
+      memset(nodes+i,0,sizeof(_plSceneNode));
+      nodes[i].parent = i+1 < n ? (pl_sInt32) i+1 : -1;
+    }
+    scene->freeNode = scene->maxNodes;
+    scene->maxNodes = n;
+  }
+  id = scene->freeNode;
+  scene->freeNode = scene->nodes[id].parent;
+  memset(scene->nodes+id,0,sizeof(_plSceneNode));
+  scene->nodes[id].parent = -1;
+  scene->nodes[id].child[0] = scene->nodes[id].child[1] = -1;
+  scene->nodes[id].loose = -1;
+  return id;
+}
+
+static void _plSceneFreeNode(pl_Scene *scene, pl_sInt32 id) {
+  scene->nodes[id].obj = 0;
+  scene->nodes[id].child[0] = scene->nodes[id].child[1] = -1;
+  scene->nodes[id].parent = scene->freeNode;
+  scene->freeNode = id;
+}
+
+/* Recomputes the boxes and triangle counts from a node up towards the root,
+   until they stop changing */
+static void _plSceneRefit(pl_Scene *scene, pl_sInt32 id) {
+  _plSceneNode *n, *a, *b, t;
+  while (id >= 0) {
+    n = scene->nodes+id;
+    a = scene->nodes+n->child[0];
+    b = scene->nodes+n->child[1];
+    _plSceneUnion(&t,a,b);
+    if (n->faces == a->faces + b->faces &&
+        !memcmp(n->Min,t.Min,sizeof(t.Min)) &&
+        !memcmp(n->Max,t.Max,sizeof(t.Max))) break;
+    memcpy(n->Min,t.Min,sizeof(t.Min));
+    memcpy(n->Max,t.Max,sizeof(t.Max));
+    n->faces = a->faces + b->faces;
+    id = n->parent;
+  }
+}
+
+/* Puts a leaf into the tree, next to the node for which it grows the
+   surface area of the tree the least. Returns 0 if out of memory. */
+static pl_Bool _plSceneInsert(pl_Scene *scene, pl_sInt32 leaf) {
+  _plSceneNode *nodes, t;
+  pl_sInt32 id = scene->root, parent, best;
+  float area, cost, inherit, c[2];
+  pl_uInt i;
+
+  if (id < 0) {
+    scene->root = leaf;
+    scene->nodes[leaf].parent = -1;
+    return 1;
+  }
+  parent = _plSceneAllocNode(scene);
+  if (parent < 0) return 0;
+  nodes = scene->nodes;
+  while (nodes[id].child[0] >= 0) {
+    area = _plSceneArea(nodes+id);
+    _plSceneUnion(&t,nodes+id,nodes+leaf);
+    /* Cost of pairing with this node, or of going down into a child */
+    cost = 2.0f*_plSceneArea(&t);
+    inherit = 2.0f*(_plSceneArea(&t) - area);
+    for (i = 0; i < 2; i ++) {
+      best = nodes[id].child[i];
+      _plSceneUnion(&t,nodes+best,nodes+leaf);
+      c[i] = _plSceneArea(&t) + inherit;
+      if (nodes[best].child[0] >= 0) c[i] -= _plSceneArea(nodes+best);
+    }
+    if (cost < c[0] && cost < c[1]) break;
+    id = nodes[id].child[c[1] < c[0]];
+  }
+
+  /* The new node takes the place of id, with id and leaf as its children */
+  nodes[parent].parent = nodes[id].parent;
+  nodes[parent].child[0] = id;
+  nodes[parent].child[1] = leaf;
+  if (nodes[id].parent < 0) scene->root = parent;
+  else {
+    i = nodes[nodes[id].parent].child[1] == id;
+    nodes[nodes[id].parent].child[i] = parent;
+  }
+  nodes[id].parent = parent;
+  nodes[leaf].parent = parent;
+  _plSceneRefit(scene,parent);
+  return 1;
+}
+
+/* Takes a leaf out of the tree; its sibling takes the place of its parent */
+static void _plSceneExtract(pl_Scene *scene, pl_sInt32 leaf) {
+  _plSceneNode *nodes = scene->nodes;
+  pl_sInt32 parent = nodes[leaf].parent, grand, sibling;
+  if (parent < 0) {
+    if (scene->root == leaf) scene->root = -1;
+    return;
+  }
+  grand = nodes[parent].parent;
+  sibling = nodes[parent].child[nodes[parent].child[0] == leaf];
+  nodes[sibling].parent = grand;
+  if (grand < 0) scene->root = sibling;
+  else {
+    nodes[grand].child[nodes[grand].child[1] == parent] = sibling;
+    _plSceneRefit(scene,grand);
+  }
+  _plSceneFreeNode(scene,parent);
+  nodes[leaf].parent = -1;
+}
+
+/* Gets the world space box of the sphere around an object and its
+   subobjects. Returns 0 if their bounds are unknown. */
+static pl_Bool _plSceneObjBox(pl_Obj *obj, pl_Float *min, pl_Float *max,
+                              double *r) {
+  pl_Float oMatrix[16], nMatrix[16];
+  double c[3];
+  pl_uInt i;
+  _plObjMatrices(obj,0,0,oMatrix,nMatrix);
+  if (!_plObjTreeSphere(0,obj,oMatrix,c,r)) return 0;
+  *r += _plBoundsMargin(c,*r);
+  for (i = 0; i < 3; i ++) {
+    min[i] = (pl_Float) (c[i] - *r);
+    max[i] = (pl_Float) (c[i] + *r);
+  }
+  return 1;
+}
+
+/* Places a leaf in the tree from the current position of its object, or in
+   the loose list if its bounds are unknown */
+static void _plScenePlace(pl_Scene *scene, pl_sInt32 id) {
+  _plSceneNode *n = scene->nodes+id;
+  pl_Float min[3], max[3];
+  double r;
+  pl_uInt i;
+  n->faces = _plObjTreeFaces(n->obj);
+  if (_plSceneObjBox(n->obj,min,max,&r)) {
+    for (i = 0; i < 3; i ++) {
+      n->Min[i] = min[i] - (pl_Float) r*_PL_SCENE_MARGIN;
+      n->Max[i] = max[i] + (pl_Float) r*_PL_SCENE_MARGIN;
+    }
+    if (_plSceneInsert(scene,id)) return;
+  }
+  n = scene->nodes+id;
+  n->loose = scene->numLoose;
+  scene->loose[scene->numLoose++] = id;
+}
+
+/* Takes a leaf out of the tree or the loose list */
+static void _plSceneUnplace(pl_Scene *scene, pl_sInt32 id) {
+  _plSceneNode *n = scene->nodes+id;
+  pl_sInt32 last;
+  if (n->loose >= 0) {
+    last = scene->loose[--scene->numLoose];
+    scene->loose[n->loose] = last;
+    scene->nodes[last].loose = n->loose;
+    n->loose = -1;
+  } else _plSceneExtract(scene,id);
+}
+
+PL_API pl_Scene *plSceneCreate() {
+  pl_Scene *scene;
+  scene = (pl_Scene *) malloc(sizeof(pl_Scene));
+  if (!scene) return 0;
+  memset(scene,0,sizeof(pl_Scene));
+  scene->freeNode = scene->root = -1;
+  return scene;
+}
+
+PL_API void plSceneDelete(pl_Scene *scene) {
+  if (scene) {
+    if (scene->nodes) free(scene->nodes);
+    if (scene->stack) free(scene->stack);
+    if (scene->loose) free(scene->loose);
+    free(scene);
+  }
 }
 
-static _faceInfo *Base, tmp;
+PL_API pl_sInt32 plSceneAdd(pl_Scene *scene, pl_Obj *obj) {
+  pl_sInt32 id, *loose;
+  /* The loose list must have room for every object */
+  if (scene->numObjs >= scene->maxLoose) {
+    loose = (pl_sInt32 *) realloc(scene->loose,
+                                  (scene->maxLoose*2+64)*sizeof(pl_sInt32));
+    if (!loose) return -1;
+    scene->loose = loose;
+    scene->maxLoose = scene->maxLoose*2+64;
+  }
+  id = _plSceneAllocNode(scene);
+  if (id < 0) return -1;
+  scene->nodes[id].obj = obj;
+  scene->numObjs++;
+  _plScenePlace(scene,id);
+  return id;
+}
+
+PL_API void plSceneRemove(pl_Scene *scene, pl_sInt32 id) {
+  if (id < 0 || (pl_uInt32) id >= scene->maxNodes || !scene->nodes[id].obj)
+    return;
+  _plSceneUnplace(scene,id);
+  _plSceneFreeNode(scene,id);
+  scene->numObjs--;
+}
+
+PL_API void plSceneUpdate(pl_Scene *scene, pl_sInt32 id) {
+  _plSceneNode *n;
+  pl_Float min[3], max[3];
+  double r;
+  if (id < 0 || (pl_uInt32) id >= scene->maxNodes || !scene->nodes[id].obj)
+    return;
+  n = scene->nodes+id;
+  /* Nothing to do if it is still inside of the box it was inserted with */
+  if (n->loose < 0 && _plSceneObjBox(n->obj,min,max,&r) &&
+      min[0] >= n->Min[0] && max[0] <= n->Max[0] &&
+      min[1] >= n->Min[1] && max[1] <= n->Max[1] &&
+      min[2] >= n->Min[2] && max[2] <= n->Max[2]) {
+    if (n->faces != _plObjTreeFaces(n->obj)) {
+      n->faces = _plObjTreeFaces(n->obj);
+      if (n->parent >= 0) _plSceneRefit(scene,n->parent);
+    }
+    return;
+  }
+  _plSceneUnplace(scene,id);
+  _plScenePlace(scene,id);
+}
+
+PL_API void plRenderScene(pl_Scene *scene) {
+  plRenderSceneCtx(_plDefault(),scene);
+}
+
+PL_API void plRenderSceneCtx(pl_RenderContext *ctx, pl_Scene *scene) {
+  double planes[NUM_CLIP_PLANES][4], *p, d, e, c[3];
+  pl_Float vMatrix[16];
+  _plSceneNode *n;
+  _plSceneVisit *stack = scene->stack;
+  pl_uInt32 i, a, first, mask, sp = 0;
+  pl_Bool out;
+
+  /* Move the frustum planes to world space */
+  plMatrixTranslate(vMatrix, -ctx->cam->X, -ctx->cam->Y, -ctx->cam->Z);
+  plMatrixMultiply(vMatrix,ctx->cMatrix);
+  first = ctx->clipPlanes[0][3] < 0.0 ? 0 : 1;
+  for (a = first; a < NUM_CLIP_PLANES; a ++) {
+    p = ctx->clipPlanes[a];
+    for (i = 0; i < 3; i ++)
+      planes[a][i] = p[0]*vMatrix[i] + p[1]*vMatrix[4+i] + p[2]*vMatrix[8+i];
+    planes[a][3] = p[3] -
+      (p[0]*vMatrix[3] + p[1]*vMatrix[7] + p[2]*vMatrix[11]);
+  }
+
+  for (i = 0; i < scene->numLoose; i ++)
+    _RenderObj(ctx,scene->nodes[scene->loose[i]].obj,0,0,0);
+
+  if (scene->root < 0) return;
+  stack[sp].node = scene->root;
+  stack[sp++].planes = (1 << NUM_CLIP_PLANES) - (1 << first);
+  while (sp) {
+    sp--;
+    n = scene->nodes + stack[sp].node;
+    mask = stack[sp].planes;
+    for (i = 0; i < 3; i ++) c[i] = (n->Min[i]+n->Max[i])*0.5;
+    e = _plBoundsMargin(c,0.0);
+    out = 0;
+    for (a = first; a < NUM_CLIP_PLANES; a ++) {
+      if (!(mask & (1 << a))) continue;
+      p = planes[a];
+      /* The corner farthest along the plane normal, then the nearest */
+      d = (p[0] > 0.0 ? n->Max[0] : n->Min[0])*p[0] +
+          (p[1] > 0.0 ? n->Max[1] : n->Min[1])*p[1] +
+          (p[2] > 0.0 ? n->Max[2] : n->Min[2])*p[2] - p[3];
+      if (d < -e*ctx->clipPlaneLen[a]) {
+        out = 1;
+        break;
+      }
+      d = (p[0] > 0.0 ? n->Min[0] : n->Max[0])*p[0] +
+          (p[1] > 0.0 ? n->Min[1] : n->Max[1])*p[1] +
+          (p[2] > 0.0 ? n->Min[2] : n->Max[2])*p[2] - p[3];
+      if (d > e*ctx->clipPlaneLen[a]) mask &= ~(1 << a);
+    }
+    if (out) {
+      ctx->TriStats[0] += n->faces;
+      ctx->stats.FrustumCulled += n->faces;
+      continue;
+    }
+    if (n->obj) _RenderObj(ctx,n->obj,0,0,0);
+    else {
+      stack[sp].node = n->child[1];
+      stack[sp++].planes = mask;
+      stack[sp].node = n->child[0];
+      stack[sp++].planes = mask;
+    }
+  }
+}
 
 static void _hsort(_faceInfo *base, int nel, int dir) {
-  static int i;
+  _faceInfo *Base, tmp;
+  int i;
   Base=base-1;
-  for (i=nel/2; i>0; i--) _sift_down(i,nel,dir);
+  for (i=nel/2; i>0; i--) _sift_down(Base,i,nel,dir);
   for (i=nel; i>1; ) {
     tmp = base[0]; base[0] = Base[i]; Base[i] = tmp;
-    _sift_down(1,i-=1,dir);
+    _sift_down(Base,1,i-=1,dir);
   }
 }
 
 #define _pl_Comp(x,y) (( x ).zd < ( y ).zd ? 1 : 0)
 
-static void _sift_down(int L, int U, int dir) {
-  static int c;
+static void _sift_down(_faceInfo *Base, int L, int U, int dir) {
+  _faceInfo tmp;
+  int c;
   while (1) {
     c=L+L;
     if (c>U) break;
@@ -5193,6 +8566,48 @@ static void _sift_down(int L, int U, int dir) {
 }
 #undef _pl_Comp
 
+/* Maps the bits of an IEEE float to an unsigned int with the same order if
+   mask is 0, or the reverse order if mask is ~0 */
+#define _plRadixKey(f,mask) \
+  ((f) & 0x80000000 ? (f) ^ ~(mask) : (f) ^ (0x80000000 ^ (mask)))
+
+/* Stable LSD radix sort of base on zd, 3 passes of 11 bits. Passes where all
+   the keys have the same digit are skipped. dir is the same as _hsort(). */
+static void _plRadixSort(_faceInfo *base, _faceInfo *scratch, pl_uInt32 nel,
+                         int dir) {
+  pl_uInt32 hist[3][2048], sum[3], i, k, t, pass, shift;
+  uint32_t d = dir ? 0 : 0xffffffff, bits;
+  _faceInfo *src = base, *dst = scratch, *tmp;
+
+  memset(hist,0,sizeof(hist));
+  for (i = 0; i < nel; i ++) {
+    memcpy(&bits,&base[i].zd,sizeof(bits));
+    k = _plRadixKey(bits,d);
+    hist[0][k & 2047]++;
+    hist[1][(k >> 11) & 2047]++;
+    hist[2][k >> 22]++;
+  }
+  for (pass = 0; pass < 3; pass ++) {
+    shift = pass*11;
+    memcpy(&bits,&src[0].zd,sizeof(bits));
+    if (hist[pass][(_plRadixKey(bits,d) >> shift) & 2047] == nel) continue;
+    sum[pass] = 0;
+    for (i = 0; i < 2048; i ++) {
+      t = hist[pass][i];
+      hist[pass][i] = sum[pass];
+      sum[pass] += t;
+    }
+    for (i = 0; i < nel; i ++) {
+      memcpy(&bits,&src[i].zd,sizeof(bits));
+      k = (_plRadixKey(bits,d) >> shift) & 2047;
+      dst[hist[pass][k]++] = src[i];
+    }
+    tmp = src; src = dst; dst = tmp;
+  }
+  if (src != base) memcpy(base,src,nel*sizeof(_faceInfo));
+}
+#undef _plRadixKey
+
 PL_API void plSplineGetPoint(pl_Spline *s, pl_Float frame, pl_Float *out) {
   pl_sInt32 i, i_1, i0, i1, i2;
   pl_Float time1,time2,time3;
@@ -5247,11 +8662,14 @@ PL_API void plTextPutChar(pl_Cam *cam, pl_sInt x, pl_sInt y, pl_Float z,
                    pl_uChar color, pl_uChar c) {
   pl_uChar *font = current_font + (c*font_height);
   pl_sInt offset = x+(y*cam->ScreenWidth);
-  pl_ZBuffer zz = (pl_ZBuffer) (1.0/z);
+  pl_Float zs = (pl_Float) (_plZScale(cam)/z);
+  pl_Float zz = (pl_Float) _plZ(zs);
   pl_sInt xx = x, a;
   pl_uChar len = font_height;
   pl_uChar ch;
-  pl_uChar *outmem;
+  pl_uChar *outmem, *fb = _plFrameBuffer(cam,cam->frameBuffer32 != 0);
+  pl_sInt ps = _plPixelSize(cam->frameBuffer32 != 0);
+  pl_ARGB color32 = 0xFF000000 | color*0x010101;
   pl_ZBuffer *zbuffer;
   if (y+font_height < cam->ClipTop || y >= cam->ClipBottom) return;
   if (y < cam->ClipTop) {
@@ -5263,9 +8681,10 @@ PL_API void plTextPutChar(pl_Cam *cam, pl_sInt x, pl_sInt y, pl_Float z,
   if (y+font_height >= cam->ClipBottom) {
     len = cam->ClipBottom-y;
   }
+  if (cam->_Clear) _plCamTouch(cam,x,x+8,y,y+len);
   if (len > 0) {
     if (cam->zBuffer && z != 0.0) do {
-      outmem = cam->frameBuffer + offset;
+      outmem = fb + offset*ps;
       zbuffer = cam->zBuffer + offset;
       offset += cam->ScreenWidth;
       xx = x;
@@ -5277,24 +8696,25 @@ PL_API void plTextPutChar(pl_Cam *cam, pl_sInt x, pl_sInt y, pl_Float z,
           if (ch & a)
             if (zz > *zbuffer) {
               *zbuffer = zz;
-              *outmem = color;
+              _plPutPixel(ps == 4,outmem,&color,&color32,0);
             }
         zbuffer++;
-        outmem++;
+        outmem += ps;
         a >>= 1;
       }
       if (a) break;
     } while (--len);
     else do {
-      outmem = cam->frameBuffer + offset;
+      outmem = fb + offset*ps;
       offset += cam->ScreenWidth;
       xx = x;
       ch = *font++;
       a = 128;
       while (a) {
         if (xx >= cam->ClipRight) break;
-        if (xx++ >= cam->ClipLeft) if (ch & a) *outmem = color;
-        outmem++;
+        if (xx++ >= cam->ClipLeft)
+          if (ch & a) _plPutPixel(ps == 4,outmem,&color,&color32,0);
+        outmem += ps;
         a >>= 1;
       }
       if (a) break;